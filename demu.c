@@ -149,9 +149,16 @@ demu_map_guest_pages(xen_pfn_t pfn[], unsigned int n)
                                 pfn, NULL);
 }
 
+/*
+ * Enough pfns for the largest single descriptor a guest sends in practice
+ * (2MB), so that mapping a data segment does not have to go to the heap.
+ */
+#define DEMU_MAP_INLINE_PFNS    512
+
 void *
 demu_map_guest_range(uint64_t addr, uint64_t size)
 {
+    xen_pfn_t   pfn_inline[DEMU_MAP_INLINE_PFNS];
     xen_pfn_t   *pfn;
     int         i, n;
     void        *ptr;
@@ -159,9 +166,13 @@ demu_map_guest_range(uint64_t addr, uint64_t size)
     size = P2ROUNDUP(size, TARGET_PAGE_SIZE);
     n = size >> TARGET_PAGE_SHIFT;
 
-    pfn = malloc(sizeof (xen_pfn_t) * n);
-    if (pfn == NULL)
-        goto fail1;
+    pfn = pfn_inline;
+    if (n > DEMU_MAP_INLINE_PFNS) {
+        pfn = malloc(sizeof (xen_pfn_t) * n);
+        if (pfn == NULL)
+            goto fail1;
+        io_path_alloc_account();
+    }
 
     for (i = 0; i < n; i++)
         pfn[i] = (addr >> TARGET_PAGE_SHIFT) + i;
@@ -170,15 +181,17 @@ demu_map_guest_range(uint64_t addr, uint64_t size)
     if (ptr == NULL)
         goto fail2;
 
-    free(pfn);
+    if (pfn != pfn_inline)
+        free(pfn);
 
     return ptr + (addr & ~TARGET_PAGE_MASK);
 
 fail2:
     DBG("fail2\n");
-    
-    free(pfn);
-    
+
+    if (pfn != pfn_inline)
+        free(pfn);
+
 fail1:
     DBG("fail1\n");
 
@@ -397,6 +410,14 @@ demu_seq_next(void)
         for (i = 0; i < image_count; i++) {
             DBG("filename[%d] = %s\n", i, disk_image[i].filename);
             DBG("readonly[%d] = %d\n", i, disk_image[i].readonly);
+            DBG("direct[%d]   = %d\n", i, disk_image[i].direct);
+            DBG("mmap[%d]     = %d\n", i, disk_image[i].mmap);
+            DBG("writethrough[%d] = %d\n", i, disk_image[i].writethrough);
+            DBG("detect_zeroes[%d] = %d\n", i, disk_image[i].detect_zeroes);
+            DBG("l2_cache_size[%d] = %llu\n", i,
+                (unsigned long long)disk_image[i].l2_cache_size);
+            DBG("cluster_cache_size[%d] = %llu\n", i,
+                (unsigned long long)disk_image[i].cluster_cache_size);
             DBG("base[%d]     = 0x%x\n", i, disk_image[i].addr);
             DBG("irq[%d]      = %u\n", i, disk_image[i].irq);
         }
@@ -650,6 +671,48 @@ static int demu_read_xenstore_config(void *unused)
             break;
         disk_image[image_count].readonly = val;
 
+        /* Optional, bypass the backend's page cache (block devices do by default) */
+        snprintf(node, sizeof(node), "%d/direct", index);
+        if (xenstore_read_fe_int(demu_state.xs_dev, node, &val) < 0)
+            val = DISK_DIRECT_AUTO;
+        else
+            val = val ? DISK_DIRECT_ON : DISK_DIRECT_OFF;
+        disk_image[image_count].direct = val;
+
+        /* Optional, serve a raw image from a shared mapping */
+        snprintf(node, sizeof(node), "%d/mmap", index);
+        if (xenstore_read_fe_int(demu_state.xs_dev, node, &val) < 0)
+            val = 0;
+        disk_image[image_count].mmap = val;
+
+        /* Optional, initial write cache mode (the guest may change it) */
+        snprintf(node, sizeof(node), "%d/writeback", index);
+        if (xenstore_read_fe_int(demu_state.xs_dev, node, &val) < 0)
+            val = 1;
+        disk_image[image_count].writethrough = !val;
+
+        /* Optional, 1 zeroes all-zero writes in place, 2 punches holes */
+        snprintf(node, sizeof(node), "%d/detect-zeroes", index);
+        if (xenstore_read_fe_int(demu_state.xs_dev, node, &val) < 0 ||
+            val < DISK_ZEROES_OFF || val > DISK_ZEROES_UNMAP)
+            val = DISK_ZEROES_OFF;
+        disk_image[image_count].detect_zeroes = val;
+
+        /* Optional, bytes of qcow2 L2 tables to cache (0 covers the image) */
+        snprintf(node, sizeof(node), "%d/l2-cache-size", index);
+        if (xenstore_read_fe_int(demu_state.xs_dev, node, &val) < 0 || val < 0)
+            val = 0;
+        disk_image[image_count].l2_cache_size = val;
+
+        /*
+         * Optional, bytes of compressed clusters to keep inflated (0 for
+         * the default, less than a cluster turns it off)
+         */
+        snprintf(node, sizeof(node), "%d/cluster-cache-size", index);
+        if (xenstore_read_fe_int(demu_state.xs_dev, node, &val) < 0 || val < 0)
+            val = 0;
+        disk_image[image_count].cluster_cache_size = val;
+
         snprintf(node, sizeof(node), "%d/base", index);
         ret = xenstore_read_fe_int(demu_state.xs_dev, node, &val);
         if (ret < 0)
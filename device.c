@@ -76,6 +76,8 @@ int device_initialize(struct disk_image_params *disk_image, u8 image_count)
 
 void device_teardown(void)
 {
+    DBG("%lu heap allocation(s) on the I/O path\n", io_path_allocs);
+
     if (kvm) {
         init_list__exit(kvm);
         free(kvm);
@@ -56,6 +56,8 @@ ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
 	io_prep_pwritev(&iocb, disk->fd, iov, iovcount, offset);
 	io_set_eventfd(&iocb, disk->evt);
 	iocb.data = param;
+	if (disk->writethrough)
+		iocb.aio_rw_flags = RWF_DSYNC;
 
 	return aio_submit(disk, 1, ios);
 }
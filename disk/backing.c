@@ -0,0 +1,162 @@
+#include "kvm/disk-image.h"
+#include "kvm/qcow.h"
+#include "kvm/read-write.h"
+
+#include <linux/err.h>
+#include <linux/byteorder.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+
+/*
+ * Backing images of qcow2 overlays.
+ *
+ * A base image is opened once, read-only, however many overlays sit on
+ * it: they share its file and its metadata and cluster caches. Its data
+ * is read through the page cache, which is shared with every other
+ * process serving an overlay of the same base. Chains are followed by the
+ * qcow2 probe, opening its own backing image here in turn.
+ *
+ * Images are opened and closed along with the disks, from one thread.
+ */
+
+/* A chain deeper than this is taken for a loop */
+#define DISK_BACKING_MAX_DEPTH	16
+
+struct disk_backing {
+	struct list_head	list;
+	dev_t			dev;
+	ino_t			ino;
+	int			refs;
+	struct disk_image	*disk;
+};
+
+static LIST_HEAD(disk_backings);
+static int disk_backing_depth;
+
+/* Synchronous whatever the I/O engine, the overlay reads from its worker */
+static struct disk_image_operations backing_raw_ops = {
+	.read	= raw_image__read_sync,
+};
+
+static bool disk_backing_is_qcow(int fd)
+{
+	u32 magic;
+
+	if (pread_in_full(fd, &magic, sizeof(magic), 0) < 0)
+		return false;
+
+	return be32_to_cpu(magic) == QCOW_MAGIC;
+}
+
+static struct disk_image *disk_backing_probe(const char *filename, int fd,
+					     const char *format)
+{
+	off_t size;
+
+	/* Only trust the content if the overlay doesn't say what it is */
+	if (format ? !strcmp(format, "qcow2") : disk_backing_is_qcow(fd))
+		return qcow_backing_probe(filename, fd);
+
+	if (format && strcmp(format, "raw")) {
+		pr_warning("Backing file format '%s' is not supported", format);
+		return NULL;
+	}
+
+	/* Block devices have no st_size */
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0)
+		return NULL;
+
+	return disk_image__new(fd, size, &backing_raw_ops, DISK_IMAGE_REGULAR);
+}
+
+/*
+ * Get the image 'filename' for an overlay to read from, 'format' as the
+ * overlay names it or NULL to probe.
+ */
+struct disk_image *disk_backing_open(const char *filename, const char *format)
+{
+	struct disk_backing *b;
+	struct disk_image *disk;
+	struct stat st;
+	int fd, r;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return ERR_PTR(-errno);
+
+	if (fstat(fd, &st) < 0) {
+		r = -errno;
+		goto err_close;
+	}
+
+	list_for_each_entry(b, &disk_backings, list) {
+		if (b->dev == st.st_dev && b->ino == st.st_ino) {
+			close(fd);
+			b->refs++;
+			return b->disk;
+		}
+	}
+
+	if (disk_backing_depth == DISK_BACKING_MAX_DEPTH) {
+		pr_warning("Backing chain too deep at '%s'", filename);
+		r = -ELOOP;
+		goto err_close;
+	}
+
+	b = calloc(1, sizeof(*b));
+	if (!b) {
+		r = -ENOMEM;
+		goto err_close;
+	}
+
+	disk_backing_depth++;
+	disk = disk_backing_probe(filename, fd, format);
+	disk_backing_depth--;
+	if (IS_ERR_OR_NULL(disk)) {
+		r = -EINVAL;
+		goto err_free;
+	}
+
+	disk->readonly = true;
+
+	b->dev	= st.st_dev;
+	b->ino	= st.st_ino;
+	b->refs	= 1;
+	b->disk	= disk;
+	list_add(&b->list, &disk_backings);
+
+	return disk;
+
+err_free:
+	free(b);
+err_close:
+	close(fd);
+	return ERR_PTR(r);
+}
+
+void disk_backing_close(struct disk_image *disk)
+{
+	struct disk_backing *b;
+
+	list_for_each_entry(b, &disk_backings, list) {
+		if (b->disk != disk)
+			continue;
+
+		if (--b->refs)
+			return;
+
+		list_del(&b->list);
+		free(b);
+
+		if (disk->ops->close) {
+			disk->ops->close(disk);
+			return;
+		}
+
+		if (close(disk->fd) < 0)
+			pr_warning("close() failed");
+		free(disk);
+		return;
+	}
+}
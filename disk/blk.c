@@ -1,42 +1,265 @@
 #include "kvm/disk-image.h"
 
 #include <linux/err.h>
-#include <mntent.h>
+#include <linux/kernel.h>
+#include <sys/sysmacros.h>
+#include <poll.h>
 
 /*
- * raw image and blk dev are similar, so reuse raw image ops.
+ * Host block devices. Reads and writes are those of raw images, discard
+ * and zeroing go to the device's own ioctls.
  */
+
+/*
+ * Without a hardware offload BLKZEROOUT writes the zeroes out itself, keep
+ * such ranges small enough not to stall the queue thread.
+ */
+#define BLK_ZEROOUT_MAX_SECTORS	(8U << 11)
+
+static ssize_t blk_dev__discard(struct disk_image *disk, u64 sector, u64 len,
+				bool secure)
+{
+	u64 range[2] = { sector << SECTOR_SHIFT, len };
+
+	if (ioctl(disk->fd, secure ? BLKSECDISCARD : BLKDISCARD, range) < 0)
+		return -1;
+
+	if (disk->writethrough && fdatasync(disk->fd) < 0)
+		return -1;
+
+	return len;
+}
+
+static ssize_t blk_dev__write_zeroes(struct disk_image *disk, u64 sector,
+				     u64 len, bool unmap)
+{
+	u64 range[2] = { sector << SECTOR_SHIFT, len };
+
+	/*
+	 * BLKZEROOUT never deallocates. Punching a hole may, but it fails
+	 * instead of writing the zeroes when the device can't, so it goes
+	 * first.
+	 */
+	if (!unmap || fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				range[0], len) < 0) {
+		if (ioctl(disk->fd, BLKZEROOUT, range) < 0)
+			return -1;
+	}
+
+	if (disk->writethrough && fdatasync(disk->fd) < 0)
+		return -1;
+
+	return len;
+}
+
+/*
+ * Buffered devices only: what the page cache holds is read right away
+ * instead of waiting for a worker. With O_DIRECT this would do the I/O.
+ */
+static ssize_t blk_dev__read_nowait(struct disk_image *disk, u64 sector,
+				    const struct iovec *iov, int iovcount)
+{
+	return preadv2(disk->fd, iov, iovcount, sector << SECTOR_SHIFT,
+		       RWF_NOWAIT);
+}
+
 static struct disk_image_operations blk_dev_ops = {
 	.read	= raw_image__read,
 	.write	= raw_image__write,
 	.wait	= raw_image__wait,
+	.write_zeroes = blk_dev__write_zeroes,
+	.discard = blk_dev__discard,
+	.read_nowait = blk_dev__read_nowait,
 	.async	= true,
+	.writethrough = true,
 };
 
-static bool is_mounted(struct stat *st)
+static struct disk_image_operations blk_dev_direct_ops = {
+	.read	= raw_image__read_direct,
+	.write	= raw_image__write_direct,
+	.wait	= raw_image__wait,
+	.write_zeroes = blk_dev__write_zeroes,
+	.discard = blk_dev__discard,
+	.async	= true,
+	.writethrough = true,
+};
+
+/*
+ * Block devices holding a mounted filesystem. mountinfo is parsed once and
+ * again only after the kernel reports a change to the mount table.
+ */
+static struct {
+	int		fd;
+	bool		valid;
+	int		nr;
+	dev_t		*devs;
+} blk_mounts = {
+	.fd	= -1,
+};
+
+static int blk_mounts_add(dev_t dev)
+{
+	dev_t *devs;
+
+	devs = realloc(blk_mounts.devs, (blk_mounts.nr + 1) * sizeof(*devs));
+	if (!devs)
+		return -ENOMEM;
+
+	devs[blk_mounts.nr++] = dev;
+	blk_mounts.devs = devs;
+
+	return 0;
+}
+
+static int blk_mounts_scan(void)
 {
-	struct stat st_buf;
-	struct mntent *mnt;
+	unsigned int maj, min;
+	struct stat st;
+	char *line = NULL, *src;
+	size_t len = 0;
+	char dev[256];
 	FILE *f;
+	int r = 0;
 
-	f = setmntent("/proc/mounts", "r");
+	f = fopen("/proc/self/mountinfo", "r");
 	if (!f)
-		return false;
+		return -errno;
 
-	while ((mnt = getmntent(f)) != NULL) {
-		if (stat(mnt->mnt_fsname, &st_buf) == 0 &&
-		    S_ISBLK(st_buf.st_mode) && st->st_rdev == st_buf.st_rdev) {
-			fclose(f);
-			return true;
+	blk_mounts.nr = 0;
+	while (r == 0 && getline(&line, &len, f) > 0) {
+		if (sscanf(line, "%*d %*d %u:%u", &maj, &min) != 2)
+			continue;
+
+		if (maj) {
+			r = blk_mounts_add(makedev(maj, min));
+			continue;
 		}
+
+		/*
+		 * Filesystems such as btrfs report an anonymous device, the
+		 * source field after " - <type> " names the real one.
+		 */
+		src = strstr(line, " - ");
+		if (!src || sscanf(src, " - %*s %255s", dev) != 1 ||
+		    strncmp(dev, "/dev/", 5))
+			continue;
+
+		if (stat(dev, &st) == 0 && S_ISBLK(st.st_mode))
+			r = blk_mounts_add(st.st_rdev);
 	}
 
+	free(line);
 	fclose(f);
+
+	return r;
+}
+
+static bool is_mounted(struct stat *st)
+{
+	struct pollfd pfd;
+	int i;
+
+	if (blk_mounts.fd < 0)
+		blk_mounts.fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+
+	/* The table changed since it was parsed, or we can't tell */
+	pfd = (struct pollfd) { .fd = blk_mounts.fd, .events = POLLPRI };
+	if (blk_mounts.fd < 0 ||
+	    (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR))))
+		blk_mounts.valid = false;
+
+	if (!blk_mounts.valid) {
+		if (blk_mounts_scan() < 0)
+			return false;
+		blk_mounts.valid = blk_mounts.fd >= 0;
+	}
+
+	for (i = 0; i < blk_mounts.nr; i++)
+		if (blk_mounts.devs[i] == st->st_rdev)
+			return true;
+
 	return false;
 }
 
+/*
+ * Read a queue attribute from sysfs. Partitions have none of their own,
+ * those of the whole device apply.
+ */
+static u64 blk_dev__queue_attr(struct stat *st, const char *attr)
+{
+	unsigned long long val;
+	char path[96];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s",
+		 major(st->st_rdev), minor(st->st_rdev), attr);
+	f = fopen(path, "r");
+	if (!f) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/%s",
+			 major(st->st_rdev), minor(st->st_rdev), attr);
+		f = fopen(path, "r");
+		if (!f)
+			return 0;
+	}
+
+	if (fscanf(f, "%llu", &val) != 1)
+		val = 0;
+	fclose(f);
+
+	return val;
+}
+
+/*
+ * Whether the device can secure erase, asked with an empty range at its
+ * end. The kernel fails that with EOPNOTSUPP when it can't, before looking
+ * at the range: older kernels then turn the empty range down with EINVAL,
+ * newer ones erase nothing. No page cache is dropped either way.
+ */
+static bool blk_dev__can_secure_erase(struct disk_image *disk)
+{
+	u64 range[2] = { disk->size, 0 };
+
+	return !ioctl(disk->fd, BLKSECDISCARD, range) || errno == EINVAL;
+}
+
+static void blk_dev__limits(struct disk_image *disk, struct stat *st,
+			    bool readonly)
+{
+	struct disk_limits *lim = &disk->limits;
+	unsigned int val;
+	u64 bytes;
+	int ssz;
+
+	if (ioctl(disk->fd, BLKSSZGET, &ssz) == 0 && ssz > (int)SECTOR_SIZE)
+		lim->logical_block_size = ssz;
+	if (ioctl(disk->fd, BLKPBSZGET, &val) == 0)
+		lim->physical_block_size = val;
+	if (ioctl(disk->fd, BLKIOMIN, &val) == 0)
+		lim->io_min = val;
+	if (ioctl(disk->fd, BLKIOOPT, &val) == 0)
+		lim->io_opt = val;
+
+	if (readonly)
+		return;
+
+	bytes = blk_dev__queue_attr(st, "discard_max_bytes");
+	lim->max_discard_sectors = min_t(u64, bytes >> SECTOR_SHIFT,
+					 DISK_DISCARD_MAX_SECTORS);
+	lim->discard_alignment = blk_dev__queue_attr(st, "discard_granularity") >>
+				 SECTOR_SHIFT;
+
+	if (lim->max_discard_sectors && blk_dev__can_secure_erase(disk))
+		lim->max_secure_erase_sectors = lim->max_discard_sectors;
+
+	bytes = blk_dev__queue_attr(st, "write_zeroes_max_bytes");
+	lim->max_write_zeroes_sectors = bytes ?
+		min_t(u64, bytes >> SECTOR_SHIFT, DISK_DISCARD_MAX_SECTORS) :
+		BLK_ZEROOUT_MAX_SECTORS;
+}
+
 struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *st)
 {
+	struct disk_image *disk;
 	int fd, r;
 	u64 size;
 
@@ -55,7 +278,7 @@ struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *s
 	 */
 	fd = open(filename, flags);
 	if (fd < 0)
-		return ERR_PTR(fd);
+		return ERR_PTR(-errno);
 
 	if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
 		r = -errno;
@@ -68,5 +291,15 @@ struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *s
 	 * mmap large disk. There is not enough virtual address space
 	 * in 32-bit host. However, this works on 64-bit host.
 	 */
-	return disk_image__new(fd, size, &blk_dev_ops, DISK_IMAGE_REGULAR);
+	disk = disk_image__new(fd, size,
+			       (flags & O_DIRECT) ? &blk_dev_direct_ops : &blk_dev_ops,
+			       DISK_IMAGE_REGULAR);
+	if (IS_ERR_OR_NULL(disk)) {
+		close(fd);
+		return disk;
+	}
+
+	blk_dev__limits(disk, st, (flags & O_ACCMODE) == O_RDONLY);
+
+	return disk;
 }
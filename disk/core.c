@@ -4,8 +4,12 @@
 #include "kvm/kvm.h"
 
 #include <linux/err.h>
+#include <linux/kernel.h>
 #include <poll.h>
 
+/* Below this, a zero write is as cheap as anything else */
+#define DISK_ZEROES_MIN		4096
+
 int debug_iodelay;
 
 static int disk_image__close(struct disk_image *disk);
@@ -79,6 +83,22 @@ struct disk_image *disk_image__new(int fd, u64 size,
 			r = -errno;
 			goto err_free_disk;
 		}
+	} else if (use_mmap == DISK_IMAGE_MMAP_SHARED) {
+		/*
+		 * Guest writes go straight to the page cache, see raw.c
+		 */
+		disk->priv = mmap(NULL, size, PROT_RW, MAP_SHARED, fd, 0);
+		if (disk->priv == MAP_FAILED) {
+			r = -errno;
+			goto err_free_disk;
+		}
+
+		disk->mmap_dirty = calloc(DISK_MMAP_DIRTY_LONGS(size),
+					  sizeof(unsigned long));
+		if (!disk->mmap_dirty) {
+			r = -ENOMEM;
+			goto err_unmap_disk;
+		}
 	}
 
 	r = disk_aio_setup(disk);
@@ -88,6 +108,7 @@ struct disk_image *disk_image__new(int fd, u64 size,
 	return disk;
 
 err_unmap_disk:
+	free(disk->mmap_dirty);
 	if (disk->priv)
 		munmap(disk->priv, size);
 err_free_disk:
@@ -95,45 +116,100 @@ err_free_disk:
 	return ERR_PTR(r);
 }
 
-static struct disk_image *disk_image__open(const char *filename, bool readonly, bool direct)
+static struct disk_image *disk_image__open(const char *filename, bool readonly, u8 direct_mode,
+					   bool use_mmap, u64 l2_cache_size,
+					   u64 cluster_cache_size)
 {
+	bool direct = direct_mode == DISK_DIRECT_ON;
 	struct disk_image *disk;
 	struct stat st;
-	int fd, flags;
+	int fd, flags, r;
+	u32 align;
 
 	if (readonly)
 		flags = O_RDONLY;
 	else
 		flags = O_RDWR;
-	if (direct)
-		flags |= O_DIRECT;
 
 	if (stat(filename, &st) < 0)
 		return ERR_PTR(-errno);
 
 	/* blk device ?*/
-	disk = blkdev__probe(filename, flags, &st);
+	disk = blkdev__probe(filename,
+			     direct_mode != DISK_DIRECT_OFF ? flags | O_DIRECT : flags,
+			     &st);
+	if (!IS_ERR_OR_NULL(disk)) {
+		disk->readonly = readonly;
+		if (use_mmap)
+			pr_warning("mmap is only supported for raw images, ignoring");
+		if (direct_mode != DISK_DIRECT_OFF)
+			goto setup_direct;
+		return disk;
+	}
+
+	/* NVMe namespace char device ?*/
+	disk = nvme__probe(filename, flags, &st);
 	if (!IS_ERR_OR_NULL(disk)) {
 		disk->readonly = readonly;
+		if (use_mmap || direct)
+			pr_warning("NVMe passthrough ignores mmap and O_DIRECT");
 		return disk;
 	}
 
+	/* Image headers are read with unaligned buffers, O_DIRECT comes later */
 	fd = open(filename, flags);
 	if (fd < 0)
 		return ERR_PTR(fd);
 
 	/* qcow image ?*/
-	disk = qcow_probe(fd, true);
+	disk = qcow_probe(filename, fd, readonly, l2_cache_size,
+			  cluster_cache_size);
 	if (!IS_ERR_OR_NULL(disk)) {
-		pr_warning("Forcing read-only support for QCOW");
-		disk->readonly = true;
+		if (direct)
+			pr_warning("O_DIRECT is not supported for QCOW, using the page cache");
+		if (use_mmap)
+			pr_warning("mmap is only supported for raw images, ignoring");
+		/* Some images can only be read */
+		disk->readonly = readonly || !disk->ops->write;
 		return disk;
 	}
 
+	/*
+	 * Images always show the guest 512 byte sectors, which O_DIRECT can't
+	 * reach on a file system that needs more.
+	 */
+	align = direct ? disk_direct_align(fd) : SECTOR_SIZE;
+	if (align > SECTOR_SIZE) {
+		pr_warning("'%s' needs %u byte aligned O_DIRECT, using the page cache",
+			   filename, align);
+		direct = false;
+	}
+
+	if (direct && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) < 0) {
+		pr_warning("Unable to enable O_DIRECT on '%s'", filename);
+		direct = false;
+	}
+
+	if (direct && use_mmap) {
+		pr_warning("mmap and O_DIRECT are exclusive, using O_DIRECT");
+		use_mmap = false;
+	}
+
 	/* raw image ?*/
-	disk = raw_image__probe(fd, &st, readonly);
+	disk = raw_image__probe(fd, &st, readonly, direct, use_mmap);
 	if (!IS_ERR_OR_NULL(disk)) {
 		disk->readonly = readonly;
+		/* Not worth it when the image is mapped, or not sparse at all */
+		if (S_ISREG(st.st_mode) && !disk->priv)
+			disk_sparse_setup(disk);
+		/* Punching holes is all a file can do */
+		if (disk->ops->discard) {
+			disk->limits.max_discard_sectors = DISK_DISCARD_MAX_SECTORS;
+			disk->limits.max_write_zeroes_sectors = DISK_DISCARD_MAX_SECTORS;
+			disk->limits.discard_alignment = st.st_blksize >> SECTOR_SHIFT;
+		}
+		if (direct)
+			goto setup_direct;
 		return disk;
 	}
 
@@ -141,6 +217,15 @@ static struct disk_image *disk_image__open(const char *filename, bool readonly,
 		pr_warning("close() failed");
 
 	return ERR_PTR(-ENOSYS);
+
+setup_direct:
+	r = disk_direct_setup(disk);
+	if (r < 0) {
+		disk_image__close(disk);
+		return ERR_PTR(r);
+	}
+
+	return disk;
 }
 
 static struct disk_image **disk_image__open_all(struct kvm *kvm)
@@ -150,7 +235,8 @@ static struct disk_image **disk_image__open_all(struct kvm *kvm)
 	const char *wwpn;
 	const char *tpgt;
 	bool readonly;
-	bool direct;
+	u8 direct;
+	bool use_mmap;
 	void *err;
 	int i;
 	struct disk_image_params *params = (struct disk_image_params *)&kvm->cfg.disk_image;
@@ -169,6 +255,7 @@ static struct disk_image **disk_image__open_all(struct kvm *kvm)
 		filename = params[i].filename;
 		readonly = params[i].readonly;
 		direct = params[i].direct;
+		use_mmap = params[i].mmap;
 		wwpn = params[i].wwpn;
 		tpgt = params[i].tpgt;
 
@@ -184,13 +271,32 @@ static struct disk_image **disk_image__open_all(struct kvm *kvm)
 		if (!filename)
 			continue;
 
-		disks[i] = disk_image__open(filename, readonly, direct);
+		disks[i] = disk_image__open(filename, readonly, direct, use_mmap,
+					    params[i].l2_cache_size,
+					    params[i].cluster_cache_size);
 		if (IS_ERR_OR_NULL(disks[i])) {
 			pr_err("Loading disk image '%s' failed", filename);
 			err = disks[i];
 			goto error;
 		}
 		disks[i]->debug_iodelay = kvm->cfg.debug_iodelay;
+		disk_image__set_writethrough(disks[i], params[i].writethrough);
+		disks[i]->detect_zeroes = params[i].detect_zeroes;
+
+		/*
+		 * Synchronous backends get their requests off the queue thread,
+		 * and so do async ones for what they can't submit right away.
+		 * Mapped images are only a memcpy away.
+		 */
+		if (!disks[i]->ops->inline_io &&
+		    (!disks[i]->async || disks[i]->ops->read_sync) &&
+		    disk_worker_attach(disks[i]) < 0)
+			pr_warning("No worker threads for '%s', doing I/O inline",
+				   filename);
+
+		if (disk_flush_setup(disks[i]) < 0)
+			pr_warning("No flush thread for '%s', flushing inline",
+				   filename);
 
 		disks[i]->addr = params[i].addr;
 		disks[i]->irq = params[i].irq;
@@ -208,6 +314,9 @@ error:
 
 int disk_image__wait(struct disk_image *disk)
 {
+	disk_worker_wait(disk);
+	disk_flush_wait(disk);
+
 	if (disk->ops->wait)
 		return disk->ops->wait(disk);
 
@@ -219,7 +328,39 @@ int disk_image__flush(struct disk_image *disk)
 	if (disk->ops->flush)
 		return disk->ops->flush(disk);
 
-	return fsync(disk->fd);
+	/* The image size doesn't change under the guest */
+	return fdatasync(disk->fd);
+}
+
+/*
+ * Select the write cache mode. Writes that completed in writeback mode are
+ * made durable before writethrough takes over.
+ */
+void disk_image__set_writethrough(struct disk_image *disk, bool writethrough)
+{
+	/* Nothing the guest writes is kept */
+	if (disk->readonly)
+		writethrough = false;
+
+	if (writethrough && !disk->writethrough)
+		disk_image__flush(disk);
+
+	disk->writethrough = writethrough;
+}
+
+/*
+ * Called once a synchronous write returned 'total': in writethrough mode,
+ * sync it for backends that don't do that themselves.
+ */
+ssize_t disk_image__writethrough(struct disk_image *disk, ssize_t total)
+{
+	if (total < 0 || !disk->writethrough || disk->ops->writethrough)
+		return total;
+
+	if (disk_image__flush(disk) < 0)
+		return -1;
+
+	return total;
 }
 
 static int disk_image__close(struct disk_image *disk)
@@ -228,7 +369,11 @@ static int disk_image__close(struct disk_image *disk)
 	if (!disk)
 		return 0;
 
+	disk_flush_destroy(disk);
+	disk_worker_detach(disk);
 	disk_aio_destroy(disk);
+	disk_direct_destroy(disk);
+	disk_sparse_destroy(disk);
 
 	if (disk->ops->close)
 		return disk->ops->close(disk);
@@ -251,6 +396,26 @@ static int disk_image__close_all(struct disk_image **disks, int count)
 	return 0;
 }
 
+/*
+ * Read what can be had without blocking. Returns the bytes read, 0 when
+ * the read has to be queued.
+ */
+static ssize_t disk_image__read_nowait(struct disk_image *disk, u64 sector,
+				       const struct iovec *iov, int iovcount)
+{
+	ssize_t total = 0;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		total += iov[i].iov_len;
+
+	/* Partly cached is as good as not at all */
+	if (disk->ops->read_nowait(disk, sector, iov, iovcount) != total)
+		return 0;
+
+	return total;
+}
+
 /*
  * Fill iov with disk data, starting from sector 'sector'.
  * Return amount of bytes read.
@@ -263,6 +428,30 @@ ssize_t disk_image__read(struct disk_image *disk, u64 sector,
 	if (debug_iodelay)
 		msleep(debug_iodelay);
 
+	/* Entirely in a hole of a sparse image: no need to read anything */
+	if (disk->sparse) {
+		total = disk_sparse_read(disk, sector, iov, iovcount);
+		if (total) {
+			if (disk->disk_req_cb)
+				disk->disk_req_cb(param, total);
+			return total;
+		}
+	}
+
+	if (disk->wq && disk->ops->read_nowait) {
+		total = disk_image__read_nowait(disk, sector, iov, iovcount);
+		if (total) {
+			if (disk->disk_req_cb)
+				disk->disk_req_cb(param, total);
+			return total;
+		}
+	}
+
+	/* Completed by the worker, through disk_req_cb */
+	if (disk->wq && !disk->async &&
+	    !disk_worker_submit(disk, sector, iov, iovcount, param, false))
+		return 0;
+
 	if (disk->ops->read) {
 		total = disk->ops->read(disk, sector, iov, iovcount, param);
 		if (total < 0) {
@@ -277,6 +466,75 @@ ssize_t disk_image__read(struct disk_image *disk, u64 sector,
 	return total;
 }
 
+/*
+ * Deallocate a range, or erase it for good when 'secure' is set. Unlike
+ * reads and writes these run to completion: they return len, or a negative
+ * errno.
+ */
+ssize_t disk_image__discard(struct disk_image *disk, u64 sector, u64 len,
+			    bool secure)
+{
+	if (!disk->ops->discard)
+		return -EOPNOTSUPP;
+
+	if (disk->ops->discard(disk, sector, len, secure) < 0)
+		return -errno;
+
+	return len;
+}
+
+/*
+ * Make a range read as zeroes, deallocating it if 'unmap' is set and the
+ * backend can.
+ */
+ssize_t disk_image__write_zeroes(struct disk_image *disk, u64 sector, u64 len,
+				 bool unmap)
+{
+	if (!disk->ops->write_zeroes)
+		return -EOPNOTSUPP;
+
+	if (disk->ops->write_zeroes(disk, sector, len, unmap) < 0)
+		return -errno;
+
+	return len;
+}
+
+/*
+ * Turn a write of nothing but zeroes into write_zeroes(). Returns the
+ * bytes written that way, 0 when it has to be a regular write.
+ */
+static ssize_t disk_image__detect_zeroes(struct disk_image *disk, u64 sector,
+					 const struct iovec *iov, int iovcount)
+{
+	ssize_t r;
+	u64 len = 0;
+	int i;
+
+	if (!disk->ops->write_zeroes)
+		return 0;
+
+	for (i = 0; i < iovcount; i++)
+		len += iov[i].iov_len;
+
+	if (len < DISK_ZEROES_MIN)
+		return 0;
+
+	for (i = 0; i < iovcount; i++)
+		if (!buffer_is_zero(iov[i].iov_base, iov[i].iov_len))
+			return 0;
+
+	r = disk_image__write_zeroes(disk, sector, len,
+				     disk->detect_zeroes == DISK_ZEROES_UNMAP);
+
+	/* Don't scan again for a filesystem that can't do it */
+	if (r == -EOPNOTSUPP) {
+		pr_info("zero ranges not supported, detect-zeroes off\n");
+		disk->detect_zeroes = DISK_ZEROES_OFF;
+	}
+
+	return r < 0 ? 0 : len;
+}
+
 /*
  * Write iov to disk, starting from sector 'sector'.
  * Return amount of bytes written.
@@ -289,12 +547,30 @@ ssize_t disk_image__write(struct disk_image *disk, u64 sector,
 	if (debug_iodelay)
 		msleep(debug_iodelay);
 
+	if (disk->detect_zeroes) {
+		total = disk_image__detect_zeroes(disk, sector, iov, iovcount);
+		if (total) {
+			if (disk->disk_req_cb)
+				disk->disk_req_cb(param, total);
+			return total;
+		}
+	}
+
+	if (disk->sparse)
+		disk_sparse_write(disk, sector, iov, iovcount);
+
+	if (disk->wq && !disk->async &&
+	    !disk_worker_submit(disk, sector, iov, iovcount, param, true))
+		return 0;
+
 	if (disk->ops->write) {
 		/*
 		 * Try writev based operation first
 		 */
 
 		total = disk->ops->write(disk, sector, iov, iovcount, param);
+		if (!disk->async)
+			total = disk_image__writethrough(disk, total);
 		if (total < 0) {
 			pr_info("disk_image__write error: total=%ld\n", (long)total);
 			return total;
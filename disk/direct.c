@@ -0,0 +1,347 @@
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+
+#include <linux/err.h>
+#include <linux/kernel.h>
+
+/*
+ * O_DIRECT support for raw images and block devices.
+ *
+ * Guest buffers are used as they are whenever they meet the device's
+ * alignment. Segments that don't are staged through a small pool of
+ * aligned bounce buffers that is allocated once when the disk is opened.
+ */
+
+#define DISK_BOUNCE_BUF_SIZE	(64 * 1024)
+#define DISK_BOUNCE_NR_BUFS	16
+#define DISK_BOUNCE_MAX_IOV	64
+
+struct disk_bounce_pool {
+	struct mutex		mutex;
+	void			*arena;
+};
+
+u32 disk_direct_align(int fd)
+{
+	struct stat st;
+	int ssz;
+
+	if (fstat(fd, &st) < 0)
+		return SECTOR_SIZE;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKSSZGET, &ssz) < 0 || ssz < (int)SECTOR_SIZE)
+			return SECTOR_SIZE;
+		return ssz;
+	}
+
+#ifdef STATX_DIOALIGN
+	{
+		struct statx stx;
+
+		if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+		    (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align)
+			return max_t(u32, SECTOR_SIZE,
+				     max(stx.stx_dio_mem_align,
+					 stx.stx_dio_offset_align));
+	}
+#endif
+
+	return SECTOR_SIZE;
+}
+
+int disk_direct_setup(struct disk_image *disk)
+{
+	struct disk_bounce_pool *pool;
+	int r;
+
+	disk->dio_align = disk_direct_align(disk->fd);
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+
+	r = posix_memalign(&pool->arena, max_t(u32, disk->dio_align, getpagesize()),
+			   DISK_BOUNCE_BUF_SIZE * DISK_BOUNCE_NR_BUFS);
+	if (r) {
+		free(pool);
+		return -r;
+	}
+
+	mutex_init(&pool->mutex);
+	disk->bounce = pool;
+	disk->direct = true;
+
+#ifdef CONFIG_HAS_IO_URING
+	if (disk->uring) {
+		struct iovec arena = {
+			.iov_base	= pool->arena,
+			.iov_len	= DISK_BOUNCE_BUF_SIZE * DISK_BOUNCE_NR_BUFS,
+		};
+
+		/* Not fatal, the bounce I/O just won't use fixed buffers */
+		r = disk_uring_register_buffers(disk, &arena, 1);
+		if (r < 0)
+			pr_warning("io_uring: can't register bounce pool (%d)", r);
+	}
+#endif
+
+
+	return 0;
+}
+
+void disk_direct_destroy(struct disk_image *disk)
+{
+	if (!disk->bounce)
+		return;
+
+	free(disk->bounce->arena);
+	free(disk->bounce);
+	disk->bounce = NULL;
+}
+
+static inline bool disk_direct_aligned(struct disk_image *disk, u64 val)
+{
+	return !(val & (disk->dio_align - 1));
+}
+
+static bool disk_iov_aligned(struct disk_image *disk, const struct iovec *iov,
+			     int iovcount, bool check_base)
+{
+	while (iovcount--) {
+		if (!disk_direct_aligned(disk, iov->iov_len))
+			return false;
+		if (check_base &&
+		    !disk_direct_aligned(disk, (unsigned long)iov->iov_base))
+			return false;
+		iov++;
+	}
+
+	return true;
+}
+
+/*
+ * Segment lengths are aligned but some buffers are not: pass the aligned
+ * ones through and replace the others with bounce buffers, as many as fit
+ * in one pool-full, then issue that as a single vectored I/O.
+ */
+static ssize_t disk_bounce_segments(struct disk_image *disk, u64 offset,
+				    const struct iovec *iov, int iovcount,
+				    bool write)
+{
+	struct disk_bounce_pool *pool = disk->bounce;
+	struct iovec batch[DISK_BOUNCE_MAX_IOV];
+	void *orig[DISK_BOUNCE_MAX_IOV];
+	size_t seg_off = 0;
+	ssize_t total = 0;
+	int i = 0;
+
+	while (i < iovcount) {
+		size_t len = 0;
+		int slot = 0;
+		int nr = 0;
+		ssize_t r;
+		int j;
+
+		while (i < iovcount && nr < DISK_BOUNCE_MAX_IOV) {
+			void *base = iov[i].iov_base + seg_off;
+			size_t rem = iov[i].iov_len - seg_off;
+			size_t piece;
+			void *buf;
+
+			if (disk_direct_aligned(disk, (unsigned long)base)) {
+				batch[nr] = (struct iovec) { base, rem };
+				orig[nr++] = NULL;
+				len += rem;
+				seg_off = 0;
+				i++;
+				continue;
+			}
+
+			if (slot == DISK_BOUNCE_NR_BUFS)
+				break;
+
+			piece = min_t(size_t, rem, DISK_BOUNCE_BUF_SIZE);
+			buf = pool->arena + slot++ * DISK_BOUNCE_BUF_SIZE;
+			if (write)
+				memcpy(buf, base, piece);
+
+			batch[nr] = (struct iovec) { buf, piece };
+			orig[nr++] = base;
+			len += piece;
+
+			seg_off += piece;
+			if (seg_off == iov[i].iov_len) {
+				seg_off = 0;
+				i++;
+			}
+		}
+
+		if (write)
+			r = pwritev_in_full(disk->fd, batch, nr, offset);
+		else
+			r = preadv_in_full(disk->fd, batch, nr, offset);
+		if (r < 0)
+			return r;
+
+		if (!write)
+			for (j = 0; j < nr; j++)
+				if (orig[j])
+					memcpy(orig[j], batch[j].iov_base,
+					       batch[j].iov_len);
+
+		offset += len;
+		total += len;
+	}
+
+	return total;
+}
+
+/*
+ * Copy 'len' bytes between 'buf' and the iovec, starting 'skip' bytes in.
+ */
+static void disk_iov_copy(const struct iovec *iov, int iovcount, size_t skip,
+			  void *buf, size_t len, bool to_iov)
+{
+	size_t n;
+
+	for (; iovcount && skip >= iov->iov_len; iovcount--, iov++)
+		skip -= iov->iov_len;
+
+	for (; iovcount && len; iovcount--, iov++, skip = 0) {
+		n = min_t(size_t, len, iov->iov_len - skip);
+		if (to_iov)
+			memcpy(iov->iov_base + skip, buf, n);
+		else
+			memcpy(buf, iov->iov_base + skip, n);
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ * Single-buffer I/O on the pool. With io_uring the arena is a registered
+ * buffer, so this goes out as READ_FIXED/WRITE_FIXED.
+ */
+static ssize_t disk_bounce_io(struct disk_image *disk, void *buf, size_t len,
+			      u64 offset, bool write)
+{
+	ssize_t done = 0;
+
+#ifdef CONFIG_HAS_IO_URING
+	if (disk->uring) {
+		done = disk_uring_rw(disk, buf, len, offset, write);
+		if (done < 0)
+			return done;
+		if ((size_t)done == len)
+			return len;
+	}
+#endif
+
+	if (write)
+		return pwrite_in_full(disk->fd, buf + done, len - done,
+				      offset + done);
+
+	return pread_in_full(disk->fd, buf + done, len - done, offset + done);
+}
+
+/*
+ * Segment lengths don't line up with the device: stage the whole request
+ * through the pool as one linear buffer. Reads are rounded up to the
+ * alignment. Writes must end on it: a read-modify-write of the tail block
+ * would race with aligned writes to it going straight to the engine, and
+ * guests told the block size don't send anything else.
+ */
+static ssize_t disk_bounce_linear(struct disk_image *disk, u64 offset,
+				  const struct iovec *iov, int iovcount,
+				  bool write)
+{
+	struct disk_bounce_pool *pool = disk->bounce;
+	size_t size = DISK_BOUNCE_BUF_SIZE * DISK_BOUNCE_NR_BUFS;
+	size_t total = 0, done, len, io_len;
+	void *buf = pool->arena;
+	u32 align = disk->dio_align;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		total += iov[i].iov_len;
+
+	if (write && !disk_direct_aligned(disk, total)) {
+		pr_warning("O_DIRECT: write of %zu bytes at offset %llu ends in a block",
+			   total, (unsigned long long)offset);
+		return -1;
+	}
+
+	for (done = 0; done < total; done += len) {
+		len = min_t(size_t, total - done, size);
+		io_len = ALIGN(len, align);
+
+		if (write) {
+			disk_iov_copy(iov, iovcount, done, buf, len, false);
+			if (disk_bounce_io(disk, buf, len, offset + done, true) < 0)
+				return -1;
+		} else {
+			if (disk_bounce_io(disk, buf, io_len, offset + done, false) < 0)
+				return -1;
+			disk_iov_copy(iov, iovcount, done, buf, len, true);
+		}
+	}
+
+	return total;
+}
+
+static ssize_t disk_bounce_rw(struct disk_image *disk, u64 sector,
+			      const struct iovec *iov, int iovcount,
+			      void *param, bool write)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	ssize_t total;
+
+	/* Nothing we can stage without a read-modify-write of the head */
+	if (!disk_direct_aligned(disk, offset)) {
+		pr_warning("O_DIRECT: misaligned %s at offset %llu",
+			   write ? "write" : "read", (unsigned long long)offset);
+		total = -1;
+		goto out;
+	}
+
+	mutex_lock(&disk->bounce->mutex);
+	if (disk_iov_aligned(disk, iov, iovcount, false))
+		total = disk_bounce_segments(disk, offset, iov, iovcount, write);
+	else
+		total = disk_bounce_linear(disk, offset, iov, iovcount, write);
+	mutex_unlock(&disk->bounce->mutex);
+
+	/* Bounced writes aren't issued with RWF_DSYNC */
+	if (write && total >= 0 && disk->writethrough && fdatasync(disk->fd) < 0)
+		total = -1;
+
+out:
+	/* disk_image__read/write() only complete synchronous disks for us */
+	if (disk->async && disk->disk_req_cb)
+		disk->disk_req_cb(param, total);
+
+	return total;
+}
+
+ssize_t raw_image__read_direct(struct disk_image *disk, u64 sector,
+			       const struct iovec *iov, int iovcount,
+			       void *param)
+{
+	if (disk_direct_aligned(disk, sector << SECTOR_SHIFT) &&
+	    disk_iov_aligned(disk, iov, iovcount, true))
+		return raw_image__read(disk, sector, iov, iovcount, param);
+
+	return disk_bounce_rw(disk, sector, iov, iovcount, param, false);
+}
+
+ssize_t raw_image__write_direct(struct disk_image *disk, u64 sector,
+				const struct iovec *iov, int iovcount,
+				void *param)
+{
+	if (disk_direct_aligned(disk, sector << SECTOR_SHIFT) &&
+	    disk_iov_aligned(disk, iov, iovcount, true))
+		return raw_image__write(disk, sector, iov, iovcount, param);
+
+	return disk_bounce_rw(disk, sector, iov, iovcount, param, true);
+}
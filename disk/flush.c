@@ -0,0 +1,152 @@
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+#include "kvm/kvm.h"
+
+#include <pthread.h>
+
+/*
+ * FLUSH requests are handed to a per-disk thread so that the queue thread
+ * keeps going while the host syncs. Every flush queued while a sync is in
+ * progress is answered by the next one: it starts after they were queued,
+ * so it covers every write completed before them.
+ */
+
+#define DISK_FLUSH_DEPTH	256
+
+struct disk_flusher {
+	struct mutex		mutex;
+	pthread_cond_t		cond;
+	pthread_cond_t		idle;
+	pthread_t		thread;
+	bool			busy;
+	bool			stop;
+	int			nr_pending;
+	void			*pending[DISK_FLUSH_DEPTH];
+};
+
+static void *disk_flush_thread(void *arg)
+{
+	struct disk_image *disk = arg;
+	struct disk_flusher *f = disk->flusher;
+	void *batch[DISK_FLUSH_DEPTH];
+	int nr, i, r;
+
+	kvm__set_thread_name("disk-flush");
+
+	mutex_lock(&f->mutex);
+	for (;;) {
+		if (!f->nr_pending) {
+			if (f->stop)
+				break;
+			pthread_cond_wait(&f->cond, &f->mutex.mutex);
+			continue;
+		}
+
+		nr = f->nr_pending;
+		memcpy(batch, f->pending, nr * sizeof(*batch));
+		f->nr_pending = 0;
+		f->busy = true;
+		mutex_unlock(&f->mutex);
+
+		r = disk_image__flush(disk);
+		for (i = 0; i < nr && disk->disk_req_cb; i++)
+			disk->disk_req_cb(batch[i], r);
+
+		mutex_lock(&f->mutex);
+		f->busy = false;
+		if (!f->nr_pending)
+			pthread_cond_broadcast(&f->idle);
+	}
+	mutex_unlock(&f->mutex);
+
+	return NULL;
+}
+
+/*
+ * Flush the disk and complete 'param' through disk_req_cb once it is done,
+ * in the background when possible.
+ */
+int disk_image__flush_async(struct disk_image *disk, void *param)
+{
+	struct disk_flusher *f = disk->flusher;
+	int r;
+
+	if (f) {
+		mutex_lock(&f->mutex);
+		if (f->nr_pending < DISK_FLUSH_DEPTH) {
+			f->pending[f->nr_pending++] = param;
+			pthread_cond_signal(&f->cond);
+			mutex_unlock(&f->mutex);
+			return 0;
+		}
+		mutex_unlock(&f->mutex);
+	}
+
+	r = disk_image__flush(disk);
+	if (disk->disk_req_cb)
+		disk->disk_req_cb(param, r);
+
+	return r;
+}
+
+/*
+ * When this function returns there are no flushes pending.
+ */
+void disk_flush_wait(struct disk_image *disk)
+{
+	struct disk_flusher *f = disk->flusher;
+
+	if (!f)
+		return;
+
+	mutex_lock(&f->mutex);
+	while (f->nr_pending || f->busy)
+		pthread_cond_wait(&f->idle, &f->mutex.mutex);
+	mutex_unlock(&f->mutex);
+}
+
+int disk_flush_setup(struct disk_image *disk)
+{
+	struct disk_flusher *f;
+	int r;
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return -ENOMEM;
+
+	mutex_init(&f->mutex);
+	pthread_cond_init(&f->cond, NULL);
+	pthread_cond_init(&f->idle, NULL);
+
+	disk->flusher = f;
+
+	r = pthread_create(&f->thread, NULL, disk_flush_thread, disk);
+	if (r) {
+		disk->flusher = NULL;
+		free(f);
+		return -r;
+	}
+
+	return 0;
+}
+
+void disk_flush_destroy(struct disk_image *disk)
+{
+	struct disk_flusher *f = disk->flusher;
+
+	if (!f)
+		return;
+
+	/* The thread answers whatever is still queued before it exits */
+	mutex_lock(&f->mutex);
+	f->stop = true;
+	pthread_cond_signal(&f->cond);
+	mutex_unlock(&f->mutex);
+
+	pthread_join(f->thread, NULL);
+
+	pthread_cond_destroy(&f->cond);
+	pthread_cond_destroy(&f->idle);
+	free(f);
+	disk->flusher = NULL;
+}
@@ -0,0 +1,637 @@
+#include <linux/io_uring.h>
+#include <linux/nvme_ioctl.h>
+
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+
+#include <linux/byteorder.h>
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+
+/*
+ * NVMe passthrough for namespaces exposed as generic char devices
+ * (/dev/ngXnY).
+ *
+ * Reads and writes become NVMe Read and Write commands queued with
+ * IORING_OP_URING_CMD on a SQE128/CQE32 ring. They reach the driver
+ * without going through the block layer or the page cache. Flush, Dataset
+ * Management and Write Zeroes are issued with NVME_IOCTL_IO_CMD: like
+ * discard on the other backends they run to completion.
+ *
+ * A request the controller can't take in one command, because it is too
+ * large or has too many segments, is split into several, and completes
+ * once the last of them does.
+ */
+
+#define NVME_NR_IOS		256
+#define NVME_MAX_IOVS		64
+#define NVME_MAX_TRANSFER	(512 * 1024)
+#define NVME_IDENTIFY_SIZE	4096
+
+enum {
+	nvme_cmd_flush		= 0x00,
+	nvme_cmd_write		= 0x01,
+	nvme_cmd_read		= 0x02,
+	nvme_cmd_write_zeroes	= 0x08,
+	nvme_cmd_dsm		= 0x09,
+	nvme_admin_identify	= 0x06,
+};
+
+#define NVME_ID_CNS_NS		0x00
+#define NVME_ID_CNS_CTRL	0x01
+
+/* Identify Controller */
+#define NVME_ID_CTRL_MDTS	77
+#define NVME_ID_CTRL_ONCS	520
+#define NVME_ID_CTRL_VWC	525
+#define NVME_ONCS_DSM		(1 << 2)
+#define NVME_ONCS_WRITE_ZEROES	(1 << 3)
+#define NVME_VWC_PRESENT	(1 << 0)
+
+/* Identify Namespace */
+#define NVME_ID_NS_NSZE		0
+#define NVME_ID_NS_FLBAS	26
+#define NVME_ID_NS_LBAF		128
+
+#define NVME_RW_FUA		(1U << 30)
+#define NVME_WZ_DEAC		(1U << 25)
+#define NVME_WZ_MAX_BLOCKS	(1U << 16)
+#define NVME_DSM_AD		(1U << 2)
+
+/* A guest request in flight, possibly as several commands */
+struct nvme_io {
+	struct list_head	list;
+	void			*param;
+	long			total;
+	u32			pending;
+	bool			failed;
+	/*
+	 * The segments of each command when the request is split. Kept for
+	 * the next request, and only grown when that needs more.
+	 */
+	struct iovec		*iov;
+	int			nr_iov;
+};
+
+struct nvme_ns {
+	u32			nsid;
+	unsigned int		lba_shift;
+	u32			max_transfer;
+	bool			vwc;
+
+	struct mutex		lock;
+	struct list_head	free;
+	struct nvme_io		io[NVME_NR_IOS];
+};
+
+struct nvme_cursor {
+	int			idx;
+	size_t			off;
+};
+
+static struct nvme_io *nvme_io_get(struct nvme_ns *ns)
+{
+	struct nvme_io *io = NULL;
+
+	mutex_lock(&ns->lock);
+	if (!list_empty(&ns->free)) {
+		io = list_first_entry(&ns->free, struct nvme_io, list);
+		list_del(&io->list);
+	}
+	mutex_unlock(&ns->lock);
+
+	return io;
+}
+
+static void nvme_io_put(struct nvme_ns *ns, struct nvme_io *io)
+{
+	mutex_lock(&ns->lock);
+	list_add(&io->list, &ns->free);
+	mutex_unlock(&ns->lock);
+}
+
+/*
+ * Drop 'nr' commands from the request, completing it when they were the
+ * last ones.
+ */
+static void nvme_io_done(struct disk_image *disk, struct nvme_io *io, u32 nr)
+{
+	void *param = io->param;
+	long total;
+
+	if (__sync_sub_and_fetch(&io->pending, nr))
+		return;
+
+	total = io->failed ? -EIO : io->total;
+	nvme_io_put(disk->priv, io);
+
+	disk->disk_req_cb(param, total);
+	__sync_fetch_and_sub(&disk->aio_inflight, 1);
+}
+
+static void nvme_complete(struct disk_image *disk, struct io_uring_cqe *cqe)
+{
+	struct nvme_io *io = (void *)(unsigned long)cqe->user_data;
+
+	/* Negative errno, or the NVMe status of a failed command */
+	if (cqe->res) {
+		pr_warning("nvme: command failed (%d)", cqe->res);
+		io->failed = true;
+	}
+
+	nvme_io_done(disk, io, 1);
+}
+
+static int nvme_submit(struct disk_image *disk, struct nvme_io *io, u64 slba,
+		       const struct iovec *iov, int iovcount, size_t len,
+		       bool write)
+{
+	struct nvme_ns *ns = disk->priv;
+	struct nvme_uring_cmd *cmd;
+	struct io_uring_sqe *sqe;
+	u32 nlb = (len >> ns->lba_shift) - 1;
+
+	sqe = disk_uring_get_sqe(disk);
+
+	sqe->opcode	= IORING_OP_URING_CMD;
+	sqe->fd		= 0;
+	sqe->flags	= IOSQE_FIXED_FILE;
+	sqe->user_data	= (unsigned long)io;
+
+	cmd = (struct nvme_uring_cmd *)sqe->cmd;
+	cmd->opcode	= write ? nvme_cmd_write : nvme_cmd_read;
+	cmd->nsid	= ns->nsid;
+	cmd->cdw10	= slba;
+	cmd->cdw11	= slba >> 32;
+	cmd->cdw12	= nlb;
+	if (write && disk->writethrough && ns->vwc)
+		cmd->cdw12 |= NVME_RW_FUA;
+
+	if (iovcount == 1) {
+		sqe->cmd_op	= NVME_URING_CMD_IO;
+		cmd->addr	= (unsigned long)iov->iov_base;
+		cmd->data_len	= iov->iov_len;
+	} else {
+		sqe->cmd_op	= NVME_URING_CMD_IO_VEC;
+		cmd->addr	= (unsigned long)iov;
+		cmd->data_len	= iovcount;
+	}
+
+	return disk_uring_submit_sqe(disk);
+}
+
+/*
+ * Carve the next command out of the request: at most max_transfer bytes
+ * in at most NVME_MAX_IOVS segments, ending on a block boundary. Returns
+ * its length, 0 if the segments don't allow one.
+ */
+static size_t nvme_carve(struct nvme_ns *ns, const struct iovec *iov,
+			 int iovcount, struct nvme_cursor *cur,
+			 struct iovec *out, int *nr_out)
+{
+	struct nvme_cursor c = *cur, good = *cur;
+	size_t lba_mask = (1UL << ns->lba_shift) - 1;
+	size_t bytes = 0, good_bytes = 0, take;
+	int nr = 0, good_nr = 0;
+
+	while (c.idx < iovcount && nr < NVME_MAX_IOVS &&
+	       bytes < ns->max_transfer) {
+		take = min(iov[c.idx].iov_len - c.off, ns->max_transfer - bytes);
+
+		out[nr].iov_base = iov[c.idx].iov_base + c.off;
+		out[nr].iov_len	= take;
+		nr++;
+		bytes += take;
+
+		c.off += take;
+		if (c.off == iov[c.idx].iov_len) {
+			c.idx++;
+			c.off = 0;
+		}
+
+		if (!(bytes & lba_mask)) {
+			good = c;
+			good_bytes = bytes;
+			good_nr = nr;
+		}
+	}
+
+	*cur = good;
+	*nr_out = good_nr;
+
+	return good_bytes;
+}
+
+static ssize_t nvme_submit_split(struct disk_image *disk, struct nvme_io *io,
+				 u64 slba, const struct iovec *iov,
+				 int iovcount, bool write)
+{
+	struct nvme_ns *ns = disk->priv;
+	struct nvme_cursor cur = { 0 };
+	struct iovec scratch[NVME_MAX_IOVS];
+	struct iovec *seg;
+	u32 nr_cmds = 0, i;
+	int nr, nr_segs = 0;
+	size_t len;
+
+	/* Size things up first, every command must be known to be possible */
+	while (cur.idx < iovcount) {
+		len = nvme_carve(ns, iov, iovcount, &cur, scratch, &nr);
+		if (!len)
+			return -EINVAL;
+		nr_cmds++;
+		nr_segs += nr;
+	}
+
+	if (nr_segs > io->nr_iov) {
+		nr_segs = ALIGN(nr_segs, NVME_MAX_IOVS);
+		seg = realloc(io->iov, nr_segs * sizeof(*io->iov));
+		if (!seg)
+			return -ENOMEM;
+
+		io_path_alloc_account();
+		io->iov = seg;
+		io->nr_iov = nr_segs;
+	}
+
+	io->pending = nr_cmds;
+
+	cur = (struct nvme_cursor) { 0 };
+	seg = io->iov;
+	for (i = 0; i < nr_cmds; i++) {
+		len = nvme_carve(ns, iov, iovcount, &cur, seg, &nr);
+		if (nvme_submit(disk, io, slba, seg, nr, len, write) < 0) {
+			/* What went out completes on its own, account for the rest */
+			io->failed = true;
+			nvme_io_done(disk, io, nr_cmds - i);
+			return 1;
+		}
+		slba += len >> ns->lba_shift;
+		seg += nr;
+	}
+
+	return 1;
+}
+
+static ssize_t nvme_rw(struct disk_image *disk, u64 sector,
+		       const struct iovec *iov, int iovcount, void *param,
+		       bool write)
+{
+	struct nvme_ns *ns = disk->priv;
+	u64 offset = sector << SECTOR_SHIFT;
+	size_t len = 0;
+	struct nvme_io *io;
+	ssize_t r;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		len += iov[i].iov_len;
+
+	if (!len || (offset | len) & ((1UL << ns->lba_shift) - 1)) {
+		r = -EINVAL;
+		goto out_err;
+	}
+
+	io = nvme_io_get(ns);
+	if (!io) {
+		r = -EBUSY;
+		goto out_err;
+	}
+
+	io->param	= param;
+	io->total	= len;
+	io->failed	= false;
+	io->pending	= 1;
+
+	/* See aio_submit(): the completion thread must see this first */
+	__sync_fetch_and_add(&disk->aio_inflight, 1);
+
+	if (len <= ns->max_transfer && iovcount <= NVME_MAX_IOVS)
+		r = nvme_submit(disk, io, offset >> ns->lba_shift, iov,
+				iovcount, len, write);
+	else
+		r = nvme_submit_split(disk, io, offset >> ns->lba_shift, iov,
+				      iovcount, write);
+
+	if (r < 0) {
+		__sync_fetch_and_sub(&disk->aio_inflight, 1);
+		nvme_io_put(ns, io);
+		goto out_err;
+	}
+
+	return len;
+
+out_err:
+	/* disk_image__read/write() only complete synchronous disks for us */
+	if (disk->disk_req_cb)
+		disk->disk_req_cb(param, r);
+
+	return r;
+}
+
+static ssize_t nvme__read(struct disk_image *disk, u64 sector,
+			  const struct iovec *iov, int iovcount, void *param)
+{
+	return nvme_rw(disk, sector, iov, iovcount, param, false);
+}
+
+static ssize_t nvme__write(struct disk_image *disk, u64 sector,
+			   const struct iovec *iov, int iovcount, void *param)
+{
+	return nvme_rw(disk, sector, iov, iovcount, param, true);
+}
+
+/*
+ * Synchronous I/O command. Returns 0, or -1 with errno set.
+ */
+static int nvme_io_cmd(struct disk_image *disk, struct nvme_passthru_cmd *cmd)
+{
+	struct nvme_ns *ns = disk->priv;
+	int r;
+
+	cmd->nsid = ns->nsid;
+
+	r = ioctl(disk->fd, NVME_IOCTL_IO_CMD, cmd);
+	if (r > 0) {
+		/* The command reached the device, which failed it */
+		pr_warning("nvme: command %#x failed (status %#x)", cmd->opcode, r);
+		errno = EIO;
+		return -1;
+	}
+
+	return r;
+}
+
+static int nvme__flush(struct disk_image *disk)
+{
+	struct nvme_ns *ns = disk->priv;
+	struct nvme_passthru_cmd cmd = {
+		.opcode	= nvme_cmd_flush,
+	};
+
+	/* Nothing to flush without a volatile write cache */
+	if (!ns->vwc)
+		return 0;
+
+	return nvme_io_cmd(disk, &cmd);
+}
+
+static bool nvme_aligned(struct nvme_ns *ns, u64 sector, u64 len)
+{
+	return !(((sector << SECTOR_SHIFT) | len) & ((1UL << ns->lba_shift) - 1));
+}
+
+static ssize_t nvme__discard(struct disk_image *disk, u64 sector, u64 len,
+			     bool secure)
+{
+	struct nvme_ns *ns = disk->priv;
+	/* Context attributes, length in blocks, starting block */
+	struct {
+		u32	cattr;
+		u32	nlb;
+		u64	slba;
+	} range;
+	struct nvme_passthru_cmd cmd = {
+		.opcode		= nvme_cmd_dsm,
+		.addr		= (unsigned long)&range,
+		.data_len	= sizeof(range),
+		.cdw11		= NVME_DSM_AD,
+	};
+
+	if (secure) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	if (!nvme_aligned(ns, sector, len)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	range = (typeof(range)) {
+		.nlb	= len >> ns->lba_shift,
+		.slba	= (sector << SECTOR_SHIFT) >> ns->lba_shift,
+	};
+
+	if (nvme_io_cmd(disk, &cmd) < 0)
+		return -1;
+
+	return len;
+}
+
+static ssize_t nvme__write_zeroes(struct disk_image *disk, u64 sector,
+				  u64 len, bool unmap)
+{
+	struct nvme_ns *ns = disk->priv;
+	struct nvme_passthru_cmd cmd;
+	u64 slba, left;
+	u32 nlb;
+
+	if (!nvme_aligned(ns, sector, len)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	slba = (sector << SECTOR_SHIFT) >> ns->lba_shift;
+	for (left = len >> ns->lba_shift; left; left -= nlb, slba += nlb) {
+		nlb = min_t(u64, left, NVME_WZ_MAX_BLOCKS);
+
+		cmd = (struct nvme_passthru_cmd) {
+			.opcode	= nvme_cmd_write_zeroes,
+			.cdw10	= slba,
+			.cdw11	= slba >> 32,
+			.cdw12	= (nlb - 1) | (unmap ? NVME_WZ_DEAC : 0),
+		};
+		if (disk->writethrough && ns->vwc)
+			cmd.cdw12 |= NVME_RW_FUA;
+
+		if (nvme_io_cmd(disk, &cmd) < 0)
+			return -1;
+	}
+
+	return len;
+}
+
+static int nvme__close(struct disk_image *disk)
+{
+	struct nvme_ns *ns = disk->priv;
+	int i;
+
+	for (i = 0; i < NVME_NR_IOS; i++)
+		free(ns->io[i].iov);
+	free(ns);
+
+	if (close(disk->fd) < 0)
+		pr_warning("close() failed");
+
+	free(disk);
+
+	return 0;
+}
+
+/*
+ * Asynchronous through the ring nvme__probe() sets up, not the default
+ * one: .async is left clear for disk_image__new().
+ */
+static struct disk_image_operations nvme_ops = {
+	.read		= nvme__read,
+	.write		= nvme__write,
+	.flush		= nvme__flush,
+	.wait		= raw_image__wait,
+	.close		= nvme__close,
+	.write_zeroes	= nvme__write_zeroes,
+	.discard	= nvme__discard,
+	.writethrough	= true,
+};
+
+static int nvme_identify(int fd, u32 nsid, u32 cns, void *buf)
+{
+	struct nvme_admin_cmd cmd = {
+		.opcode		= nvme_admin_identify,
+		.nsid		= nsid,
+		.addr		= (unsigned long)buf,
+		.data_len	= NVME_IDENTIFY_SIZE,
+		.cdw10		= cns,
+	};
+
+	if (ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd))
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * Read what the namespace and its controller look like. Returns the
+ * namespace size in blocks.
+ */
+static int nvme_ns_init(struct nvme_ns *ns, struct disk_limits *lim, int fd,
+			u64 *nr_blocks)
+{
+	u8 *id;
+	u8 flbas, mdts, lbads;
+	u16 ms, oncs;
+	int r, idx;
+
+	id = malloc(NVME_IDENTIFY_SIZE);
+	if (!id)
+		return -ENOMEM;
+
+	r = nvme_identify(fd, 0, NVME_ID_CNS_CTRL, id);
+	if (r < 0)
+		goto out;
+
+	mdts	= id[NVME_ID_CTRL_MDTS];
+	oncs	= id[NVME_ID_CTRL_ONCS] | id[NVME_ID_CTRL_ONCS + 1] << 8;
+	ns->vwc	= id[NVME_ID_CTRL_VWC] & NVME_VWC_PRESENT;
+
+	r = nvme_identify(fd, ns->nsid, NVME_ID_CNS_NS, id);
+	if (r < 0)
+		goto out;
+
+	memcpy(nr_blocks, id + NVME_ID_NS_NSZE, sizeof(*nr_blocks));
+	*nr_blocks = le64_to_cpu(*nr_blocks);
+
+	flbas	= id[NVME_ID_NS_FLBAS];
+	idx	= (flbas & 0xf) | ((flbas >> 5) & 0x3) << 4;
+	ms	= id[NVME_ID_NS_LBAF + 4 * idx] |
+		  id[NVME_ID_NS_LBAF + 4 * idx + 1] << 8;
+	lbads	= id[NVME_ID_NS_LBAF + 4 * idx + 2];
+
+	if (ms || lbads < SECTOR_SHIFT || lbads > 16) {
+		pr_warning("nvme: unsupported LBA format (%u bytes, %u of metadata)",
+			   1U << lbads, ms);
+		r = -EINVAL;
+		goto out;
+	}
+
+	ns->lba_shift = lbads;
+
+	/* In units of the minimum page size, assumed to be 4KB */
+	ns->max_transfer = NVME_MAX_TRANSFER;
+	if (mdts && mdts < 8)
+		ns->max_transfer = min_t(u32, ns->max_transfer, 4096U << mdts);
+	ns->max_transfer = max_t(u32, ns->max_transfer, 1U << lbads);
+
+	if (oncs & NVME_ONCS_DSM) {
+		lim->max_discard_sectors = DISK_DISCARD_MAX_SECTORS;
+		lim->discard_alignment = 1U << (lbads - SECTOR_SHIFT);
+	}
+	if (oncs & NVME_ONCS_WRITE_ZEROES)
+		lim->max_write_zeroes_sectors = DISK_DISCARD_MAX_SECTORS;
+
+out:
+	free(id);
+	return r;
+}
+
+struct disk_image *nvme__probe(const char *filename, int flags, struct stat *st)
+{
+	struct disk_image *disk;
+	struct disk_limits lim = { 0 };
+	struct nvme_ns *ns;
+	u64 nr_blocks;
+	int fd, r, i;
+
+	if (!S_ISCHR(st->st_mode))
+		return ERR_PTR(-EINVAL);
+
+	/* Passthrough bypasses the page cache anyway */
+	fd = open(filename, flags & ~O_DIRECT);
+	if (fd < 0)
+		return ERR_PTR(-errno);
+
+	ns = calloc(1, sizeof(*ns));
+	if (!ns) {
+		r = -ENOMEM;
+		goto err_close;
+	}
+
+	r = ioctl(fd, NVME_IOCTL_ID);
+	if (r <= 0) {
+		r = -ENODEV;
+		goto err_free;
+	}
+	ns->nsid = r;
+
+	r = nvme_ns_init(ns, &lim, fd, &nr_blocks);
+	if (r < 0)
+		goto err_free;
+
+	mutex_init(&ns->lock);
+	INIT_LIST_HEAD(&ns->free);
+	for (i = 0; i < NVME_NR_IOS; i++)
+		list_add_tail(&ns->io[i].list, &ns->free);
+
+	disk = disk_image__new(fd, nr_blocks << ns->lba_shift, &nvme_ops,
+			       DISK_IMAGE_REGULAR);
+	if (IS_ERR_OR_NULL(disk)) {
+		r = disk ? PTR_ERR(disk) : -ENOMEM;
+		goto err_free;
+	}
+
+	disk->priv = ns;
+	if ((flags & O_ACCMODE) != O_RDONLY)
+		disk->limits = lim;
+	if (ns->lba_shift > SECTOR_SHIFT)
+		disk->limits.logical_block_size = 1U << ns->lba_shift;
+
+	r = disk_uring_setup(disk, IORING_SETUP_SQE128 | IORING_SETUP_CQE32,
+			     nvme_complete);
+	if (r < 0) {
+		pr_warning("nvme: no io_uring command support (%d)", r);
+		nvme__close(disk);
+		return ERR_PTR(r);
+	}
+
+	pr_info("nvme: %s namespace %u, %llu blocks of %u bytes", filename,
+		ns->nsid, (unsigned long long)nr_blocks, 1U << ns->lba_shift);
+
+	return disk;
+
+err_free:
+	free(ns);
+err_close:
+	close(fd);
+	return ERR_PTR(r);
+}
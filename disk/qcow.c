@@ -13,17 +13,26 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stddef.h>
 #ifdef CONFIG_HAS_ZLIB
 #include <zlib.h>
 #endif
+#ifdef CONFIG_HAS_ZSTD
+#include <zstd.h>
+#endif
 
 #include <linux/err.h>
 #include <linux/byteorder.h>
 #include <linux/kernel.h>
 #include <linux/types.h>
 
+/* Most iovec entries a single data read or write is built from */
+#define QCOW_MAX_IOVS		64
+
 static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append);
+static int qcow_flush_metadata(struct qcow *q);
 static int qcow_write_refcount_table(struct qcow *q);
+static int qcow_write_refcount_blocks(struct qcow *q);
 static u64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref);
 static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size);
 
@@ -36,89 +45,72 @@ static inline int qcow_pwrite_sync(int fd,
 	return fdatasync(fd);
 }
 
-static int l2_table_insert(struct rb_root *root, struct qcow_l2_table *new)
+/* Extended L2 entries take two words, the second one is their bitmap */
+static inline u64 qcow_l2_entry_size(struct qcow *q)
 {
-	struct rb_node **link = &(root->rb_node), *parent = NULL;
-	u64 offset = new->offset;
-
-	/* search the tree */
-	while (*link) {
-		struct qcow_l2_table *t;
-
-		t = rb_entry(*link, struct qcow_l2_table, node);
-		if (!t)
-			goto error;
+	return sizeof(u64) << q->extended_l2;
+}
 
-		parent = *link;
+static inline u64 *l2_slice_entry(struct qcow *q, struct qcow_l2_table *t,
+				  u64 idx)
+{
+	return &t->table[idx << q->extended_l2];
+}
 
-		if (t->offset > offset)
-			link = &(*link)->rb_left;
-		else if (t->offset < offset)
-			link = &(*link)->rb_right;
-		else
-			goto out;
-	}
+static inline struct hlist_head *l2_table_bucket(struct qcow_l1_table *l1t,
+						 u64 offset)
+{
+	u64 key = (offset >> SECTOR_SHIFT) * 0x9e3779b97f4a7c15ULL;
 
-	/* add new node */
-	rb_link_node(&new->node, parent, link);
-	rb_insert_color(&new->node, root);
-out:
-	return 0;
-error:
-	return -1;
+	return &l1t->hash[key >> (64 - l1t->hash_bits)];
 }
 
-static struct qcow_l2_table *l2_table_lookup(struct rb_root *root, u64 offset)
+static void l2_table_insert(struct qcow_l1_table *l1t, struct qcow_l2_table *new)
 {
-	struct rb_node *link = root->rb_node;
-
-	while (link) {
-		struct qcow_l2_table *t;
+	hlist_add_head(&new->node, l2_table_bucket(l1t, new->offset));
+}
 
-		t = rb_entry(link, struct qcow_l2_table, node);
-		if (!t)
-			goto out;
+static struct qcow_l2_table *l2_table_lookup(struct qcow_l1_table *l1t, u64 offset)
+{
+	struct qcow_l2_table *t;
 
-		if (t->offset > offset)
-			link = link->rb_left;
-		else if (t->offset < offset)
-			link = link->rb_right;
-		else
+	hlist_for_each_entry(t, l2_table_bucket(l1t, offset), node)
+		if (t->offset == offset)
 			return t;
-	}
-out:
+
 	return NULL;
 }
 
 static void l1_table_free_cache(struct qcow_l1_table *l1t)
 {
-	struct rb_root *r = &l1t->root;
 	struct list_head *pos, *n;
 	struct qcow_l2_table *t;
 
 	list_for_each_safe(pos, n, &l1t->lru_list) {
-		/* Remove cache table from the list and RB tree */
+		/* Remove cache table from the list and hash */
 		list_del(pos);
 		t = list_entry(pos, struct qcow_l2_table, list);
-		rb_erase(&t->node, r);
+		hlist_del(&t->node);
 
 		/* Free the cached node */
 		free(t);
 	}
+
+	list_for_each_safe(pos, n, &l1t->free_list) {
+		list_del(pos);
+		free(list_entry(pos, struct qcow_l2_table, list));
+	}
+
+	free(l1t->hash);
 }
 
 static int qcow_l2_cache_write(struct qcow *q, struct qcow_l2_table *c)
 {
-	struct qcow_header *header = q->header;
-	u64 size;
-
 	if (!c->dirty)
 		return 0;
 
-	size = 1 << header->l2_bits;
-
-	if (qcow_pwrite_sync(q->fd, c->table,
-		size * sizeof(u64), c->offset) < 0)
+	if (pwrite_in_full(q->fd, c->table,
+			   q->l2_slice_size * qcow_l2_entry_size(q), c->offset) < 0)
 		return -1;
 
 	c->dirty = 0;
@@ -126,31 +118,60 @@ static int qcow_l2_cache_write(struct qcow *q, struct qcow_l2_table *c)
 	return 0;
 }
 
+/*
+ * A dirty table leaving the cache may name clusters whose data and
+ * refcounts are still in flight: those go to the disk first, unless
+ * refcounts are lazy.
+ */
+static int qcow_l2_cache_evict(struct qcow *q, struct qcow_l2_table *c)
+{
+	if (!c->dirty)
+		return 0;
+
+	if (!q->lazy_refcounts &&
+	    (qcow_write_refcount_blocks(q) < 0 || fdatasync(q->fd) < 0))
+		return -1;
+
+	return qcow_l2_cache_write(q, c);
+}
+
 static int cache_table(struct qcow *q, struct qcow_l2_table *c)
 {
 	struct qcow_l1_table *l1t = &q->table;
-	struct rb_root *r = &l1t->root;
 	struct qcow_l2_table *lru;
+	int i;
 
-	if (l1t->nr_cached == MAX_CACHE_NODES) {
+	if (l1t->nr_cached == l1t->max_cached) {
 		/*
 		 * The node at the head of the list is least recently used
 		 * node. Remove it from the list and replaced with a new node.
+		 * Lockless lookups can't move what they hit to the tail, they
+		 * mark it instead: marked nodes get a second round.
 		 */
 		lru = list_first_entry(&l1t->lru_list, struct qcow_l2_table, list);
+		for (i = 0; i < l1t->nr_cached &&
+			    __atomic_load_n(&lru->referenced, __ATOMIC_RELAXED); i++) {
+			__atomic_store_n(&lru->referenced, 0, __ATOMIC_RELAXED);
+			list_move_tail(&lru->list, &l1t->lru_list);
+			lru = list_first_entry(&l1t->lru_list, struct qcow_l2_table, list);
+		}
+
+		if (qcow_l2_cache_evict(q, lru) < 0)
+			goto error;
 
 		/* Remove the node from the cache */
-		rb_erase(&lru->node, r);
-		list_del_init(&lru->list);
+		write_seqcount_begin(&q->seq);
+		hlist_del(&lru->node);
+		write_seqcount_end(&q->seq);
 		l1t->nr_cached--;
 
-		/* Free the LRUed node */
-		free(lru);
+		/* Keep the LRUed node around for the next miss */
+		list_move(&lru->list, &l1t->free_list);
 	}
 
-	/* Add new node in RB Tree: Helps in searching faster */
-	if (l2_table_insert(r, c) < 0)
-		goto error;
+	write_seqcount_begin(&q->seq);
+	l2_table_insert(l1t, c);
+	write_seqcount_end(&q->seq);
 
 	/* Add in LRU replacement list */
 	list_add_tail(&c->list, &l1t->lru_list);
@@ -166,7 +187,7 @@ static struct qcow_l2_table *l2_table_search(struct qcow *q, u64 offset)
 	struct qcow_l1_table *l1t = &q->table;
 	struct qcow_l2_table *l2t;
 
-	l2t = l2_table_lookup(&l1t->root, offset);
+	l2t = l2_table_lookup(l1t, offset);
 	if (!l2t)
 		return NULL;
 
@@ -176,27 +197,70 @@ static struct qcow_l2_table *l2_table_search(struct qcow *q, u64 offset)
 	return l2t;
 }
 
-/* Allocates a new node for caching L2 table */
+/*
+ * Allocates a new node for caching an L2 slice. Nodes evicted from the
+ * cache are recycled first, so the heap is only hit until the cache is
+ * full. The slice contents are left for the caller to fill in.
+ */
 static struct qcow_l2_table *new_cache_table(struct qcow *q, u64 offset)
 {
-	struct qcow_header *header = q->header;
+	struct qcow_l1_table *l1t = &q->table;
 	struct qcow_l2_table *c;
-	u64 l2t_sz;
 	u64 size;
 
-	l2t_sz = 1 << header->l2_bits;
-	size   = sizeof(*c) + l2t_sz * sizeof(u64);
+	if (!list_empty(&l1t->free_list)) {
+		c = list_first_entry(&l1t->free_list, struct qcow_l2_table, list);
+		list_del(&c->list);
+		c->dirty = 0;
+		__atomic_store_n(&c->referenced, 0, __ATOMIC_RELAXED);
+		goto init;
+	}
+
+	size   = sizeof(*c) + q->l2_slice_size * qcow_l2_entry_size(q);
 	c      = calloc(1, size);
 	if (!c)
 		goto out;
+	io_path_alloc_account();
 
+init:
 	c->offset = offset;
-	RB_CLEAR_NODE(&c->node);
+	INIT_HLIST_NODE(&c->node);
 	INIT_LIST_HEAD(&c->list);
 out:
 	return c;
 }
 
+/* Gives back a node that never made it into the cache */
+static void put_cache_table(struct qcow *q, struct qcow_l2_table *c)
+{
+	if (c)
+		list_add(&c->list, &q->table.free_list);
+}
+
+/*
+ * Forget the cached slices of a freed cluster, it may be reused for data
+ * or for another table.
+ */
+static void drop_cache_table(struct qcow *q, u64 offset)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	u64 slice = q->l2_slice_size * qcow_l2_entry_size(q);
+	struct qcow_l2_table *c;
+	u64 end;
+
+	for (end = offset + q->cluster_size; offset < end; offset += slice) {
+		c = l2_table_lookup(l1t, offset);
+		if (!c)
+			continue;
+
+		write_seqcount_begin(&q->seq);
+		hlist_del(&c->node);
+		write_seqcount_end(&q->seq);
+		list_move(&c->list, &l1t->free_list);
+		l1t->nr_cached--;
+	}
+}
+
 static inline u64 get_l1_index(struct qcow *q, u64 offset)
 {
 	struct qcow_header *header = q->header;
@@ -211,6 +275,12 @@ static inline u64 get_l2_index(struct qcow *q, u64 offset)
 	return (offset >> (header->cluster_bits)) & ((1 << header->l2_bits)-1);
 }
 
+/* Index of L2 entry 'l2_idx' within its slice */
+static inline u64 get_l2_slice_index(struct qcow *q, u64 l2_idx)
+{
+	return l2_idx & (q->l2_slice_size - 1);
+}
+
 static inline u64 get_cluster_offset(struct qcow *q, u64 offset)
 {
 	struct qcow_header *header = q->header;
@@ -218,39 +288,132 @@ static inline u64 get_cluster_offset(struct qcow *q, u64 offset)
 	return offset & ((1 << header->cluster_bits)-1);
 }
 
-static struct qcow_l2_table *qcow_read_l2_table(struct qcow *q, u64 offset)
+/*
+ * Get the slice of the L2 table at 'l2t_offset' holding entry 'l2_idx',
+ * from the cache or from the disk.
+ */
+static struct qcow_l2_table *qcow_read_l2_slice(struct qcow *q, u64 l2t_offset,
+						u64 l2_idx)
 {
-	struct qcow_header *header = q->header;
 	struct qcow_l2_table *l2t;
+	u64 offset;
 	u64 size;
 
-	size = 1 << header->l2_bits;
+	size = q->l2_slice_size * qcow_l2_entry_size(q);
+	offset = l2t_offset + (l2_idx - get_l2_slice_index(q, l2_idx)) *
+		 qcow_l2_entry_size(q);
 
 	/* search an entry for offset in cache */
 	l2t = l2_table_search(q, offset);
 	if (l2t)
 		return l2t;
 
-	/* allocate new node for caching l2 table */
+	/* allocate new node for caching l2 slice */
 	l2t = new_cache_table(q, offset);
 	if (!l2t)
 		goto error;
 
-	/* table not cached: read from the disk */
-	if (pread_in_full(q->fd, l2t->table, size * sizeof(u64), offset) < 0)
+	/* slice not cached: read from the disk */
+	if (pread_in_full(q->fd, l2t->table, size, offset) < 0)
 		goto error;
 
-	/* cache the table */
+	/* cache the slice */
 	if (cache_table(q, l2t) < 0)
 		goto error;
 
 	return l2t;
 error:
-	free(l2t);
+	put_cache_table(q, l2t);
 	return NULL;
 }
 
-static int qcow_decompress_buffer(u8 *out_buf, int out_buf_size,
+/*
+ * Size the L2 cache: 'cache_size' bytes of slices, or by default enough
+ * to map the whole image, within QCOW_L2_CACHE_MAX. Slices are allocated
+ * as they are first needed, an image only partly used costs no more.
+ */
+static int qcow_l2_cache_init(struct qcow *q, u64 cache_size)
+{
+	struct qcow_header *header = q->header;
+	struct qcow_l1_table *l1t = &q->table;
+	u64 slice, full, slices;
+
+	q->l2_slice_size = min_t(u64, 1ULL << header->l2_bits,
+				 QCOW_L2_SLICE_SIZE / qcow_l2_entry_size(q));
+	slice = q->l2_slice_size * qcow_l2_entry_size(q);
+
+	/* No point going past the whole image */
+	full = DIV_ROUND_UP(header->size, q->cluster_size) *
+	       qcow_l2_entry_size(q);
+	if (!cache_size)
+		cache_size = min_t(u64, full, QCOW_L2_CACHE_MAX);
+	else
+		cache_size = min(cache_size, full);
+
+	slices = max_t(u64, DIV_ROUND_UP(cache_size, slice),
+		       QCOW_L2_CACHE_MIN_SLICES);
+
+	l1t->max_cached = slices;
+	l1t->hash_bits = fls_long(slices - 1);
+	l1t->hash = calloc(1UL << l1t->hash_bits, sizeof(*l1t->hash));
+	if (!l1t->hash)
+		return -1;
+
+	INIT_LIST_HEAD(&l1t->lru_list);
+	INIT_LIST_HEAD(&l1t->free_list);
+
+	return 0;
+}
+
+/*
+ * Clusters are inflated into the cache as compressed ones are met, up to
+ * 'cache_size' bytes of them. Less than a cluster turns it off.
+ */
+static int qcow_cluster_cache_init(struct qcow *q, u64 cache_size)
+{
+	struct qcow_cluster_cache *cc = &q->ccache;
+	u64 clusters;
+
+	if (!cache_size)
+		cache_size = QCOW_CLUSTER_CACHE_DEFAULT;
+
+	/* No point going past the whole image */
+	clusters = DIV_ROUND_UP(q->header->size, q->cluster_size);
+	cc->max_cached = min_t(u64, cache_size / q->cluster_size, clusters);
+	if (!cc->max_cached)
+		return 0;
+
+	cc->hash_bits = fls_long(cc->max_cached);
+	cc->hash = calloc(1UL << cc->hash_bits, sizeof(*cc->hash));
+	if (!cc->hash) {
+		cc->max_cached = 0;
+		return -1;
+	}
+
+	mutex_init(&cc->mutex);
+	pthread_cond_init(&cc->loaded, NULL);
+	INIT_LIST_HEAD(&cc->lru_list);
+	cc->next_offset = (u64)-1;
+
+	return 0;
+}
+
+static void qcow_cluster_cache_free(struct qcow *q)
+{
+	struct qcow_cluster_cache *cc = &q->ccache;
+	struct qcow_cached_cluster *c, *n;
+
+	if (!cc->hash)
+		return;
+
+	list_for_each_entry_safe(c, n, &cc->lru_list, list)
+		free(c);
+
+	pthread_cond_destroy(&cc->loaded);
+	free(cc->hash);
+}
+
+static int qcow_inflate_buffer(u8 *out_buf, int out_buf_size,
 	const u8 *buf, int buf_size)
 {
 #ifdef CONFIG_HAS_ZLIB
@@ -283,194 +446,755 @@ static int qcow_decompress_buffer(u8 *out_buf, int out_buf_size,
 #endif
 }
 
-static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
-	void *dst, u32 dst_len)
+#ifdef CONFIG_HAS_ZSTD
+/* Decompression contexts are costly to set up, threads keep theirs */
+static __thread ZSTD_DCtx *qcow_zstd_dctx;
+#endif
+
+static int qcow_zstd_decompress_buffer(u8 *out_buf, int out_buf_size,
+	const u8 *buf, int buf_size)
+{
+#ifdef CONFIG_HAS_ZSTD
+	ZSTD_outBuffer output = { out_buf, out_buf_size, 0 };
+	ZSTD_inBuffer input = { buf, buf_size, 0 };
+	size_t ret;
+
+	if (!qcow_zstd_dctx) {
+		qcow_zstd_dctx = ZSTD_createDCtx();
+		if (!qcow_zstd_dctx)
+			return -1;
+	} else {
+		ZSTD_DCtx_reset(qcow_zstd_dctx, ZSTD_reset_session_only);
+	}
+
+	/*
+	 * The frame is followed by whatever is left of its last sector: it is
+	 * streamed until the cluster is complete, not to the end of the input.
+	 */
+	while (output.pos < output.size) {
+		ret = ZSTD_decompressStream(qcow_zstd_dctx, &output, &input);
+		if (ZSTD_isError(ret))
+			return -1;
+
+		/* Frame over or input used up, and still short of a cluster */
+		if (output.pos < output.size &&
+		    (!ret || input.pos == input.size))
+			return -1;
+	}
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static int qcow_decompress_buffer(struct qcow *q, u8 *out_buf,
+	int out_buf_size, const u8 *buf, int buf_size)
+{
+	if (q->header->compression_type == QCOW2_COMPRESSION_ZSTD)
+		return qcow_zstd_decompress_buffer(out_buf, out_buf_size,
+						   buf, buf_size);
+
+	return qcow_inflate_buffer(out_buf, out_buf_size, buf, buf_size);
+}
+
+/*
+ * Lockless twin of l2_table_lookup(): writers may be changing the chains,
+ * the caller validates what it finds with q->seq.
+ */
+static struct qcow_l2_table *l2_table_lookup_lockless(struct qcow_l1_table *l1t,
+						      u64 offset)
+{
+	struct hlist_node *n;
+	struct qcow_l2_table *t;
+
+	n = __atomic_load_n(&l2_table_bucket(l1t, offset)->first, __ATOMIC_RELAXED);
+	for (; n; n = __atomic_load_n(&n->next, __ATOMIC_RELAXED)) {
+		t = hlist_entry(n, struct qcow_l2_table, node);
+		if (__atomic_load_n(&t->offset, __ATOMIC_RELAXED) == offset)
+			return t;
+	}
+
+	return NULL;
+}
+
+/*
+ * Get the L2 entry for 'offset' from the cached tables, without the mutex,
+ * and its subcluster bitmap if entries are extended. Returns false when
+ * its slice isn't cached.
+ */
+static bool qcow_lookup_cached(struct qcow *q, u64 offset, u64 *entry,
+			       u64 *bitmap)
 {
-	struct qcow_header *header = q->header;
 	struct qcow_l1_table *l1t = &q->table;
+	u64 l1_idx = get_l1_index(q, offset);
+	u64 l2_idx = get_l2_index(q, offset);
 	struct qcow_l2_table *l2t;
-	u64 clust_offset;
-	u64 clust_start;
 	u64 l2t_offset;
-	size_t length;
-	u64 l2t_size;
-	u64 l1_idx;
-	u64 l2_idx;
-	int coffset;
-	int csize;
+	unsigned int seq;
+	bool found;
+	u64 *e;
+
+	do {
+		seq = read_seqcount_begin(&q->seq);
+
+		*bitmap = 0;
+		l2t_offset = __atomic_load_n(&l1t->l1_table[l1_idx], __ATOMIC_RELAXED);
+		l2t_offset = be64_to_cpu(l2t_offset) & ~QCOW2_OFLAG_COPIED;
+		if (!l2t_offset) {
+			*entry = 0;
+			found = true;
+			continue;
+		}
 
-	l1_idx = get_l1_index(q, offset);
-	if (l1_idx >= l1t->table_size)
-		return -1;
+		l2t_offset += (l2_idx - get_l2_slice_index(q, l2_idx)) *
+			      qcow_l2_entry_size(q);
+		l2t = l2_table_lookup_lockless(l1t, l2t_offset);
+		found = l2t != NULL;
+		if (!found)
+			continue;
+
+		e = l2_slice_entry(q, l2t, get_l2_slice_index(q, l2_idx));
+		*entry = be64_to_cpu(__atomic_load_n(e, __ATOMIC_RELAXED));
+		if (q->extended_l2)
+			*bitmap = be64_to_cpu(__atomic_load_n(e + 1,
+							      __ATOMIC_RELAXED));
+
+		/* Keeps it from eviction for a round, see cache_table() */
+		if (!__atomic_load_n(&l2t->referenced, __ATOMIC_RELAXED))
+			__atomic_store_n(&l2t->referenced, 1, __ATOMIC_RELAXED);
+	} while (read_seqcount_retry(&q->seq, seq));
+
+	return found;
+}
 
-	clust_offset = get_cluster_offset(q, offset);
-	if (clust_offset >= q->cluster_size)
-		return -1;
+/*
+ * Get the L2 entry for 'offset', reading its slice into the cache if need
+ * be. Entries of clusters that are shared or compressed may be moved by a
+ * concurrent copy-on-write, and the cluster freed and reused: once these
+ * have been read, the caller checks the entry is still the same.
+ */
+static int qcow_lookup(struct qcow *q, u64 offset, u64 *entry, u64 *bitmap)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	u64 l1_idx = get_l1_index(q, offset);
+	u64 l2_idx = get_l2_index(q, offset);
+	struct qcow_l2_table *l2t;
+	u64 l2t_offset;
+	int r = 0;
+	u64 *e;
 
-	length = q->cluster_size - clust_offset;
-	if (length > dst_len)
-		length = dst_len;
+	if (qcow_lookup_cached(q, offset, entry, bitmap))
+		return 0;
 
 	mutex_lock(&q->mutex);
 
-	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]);
-	if (!l2t_offset)
-		goto zero_cluster;
+	*bitmap = 0;
+	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]) & ~QCOW2_OFLAG_COPIED;
+	if (!l2t_offset) {
+		*entry = 0;
+		goto out;
+	}
 
-	l2t_size = 1 << header->l2_bits;
+	/* read and cache the slice of the level 2 table */
+	l2t = qcow_read_l2_slice(q, l2t_offset, l2_idx);
+	if (!l2t) {
+		r = -1;
+		goto out;
+	}
 
-	/* read and cache level 2 table */
-	l2t = qcow_read_l2_table(q, l2t_offset);
-	if (!l2t)
-		goto out_error;
+	e = l2_slice_entry(q, l2t, get_l2_slice_index(q, l2_idx));
+	*entry = be64_to_cpu(e[0]);
+	if (q->extended_l2)
+		*bitmap = be64_to_cpu(e[1]);
+out:
+	mutex_unlock(&q->mutex);
+	return r;
+}
 
-	l2_idx = get_l2_index(q, offset);
-	if (l2_idx >= l2t_size)
-		goto out_error;
+/*
+ * Compressed clusters are read and inflated outside the mutex, into
+ * buffers each thread has to itself. They grow to the largest cluster
+ * size met and live as long as the thread.
+ */
+static __thread struct qcow_buffers {
+	u8	*data;
+	u8	*cluster;
+	u64	size;
+} qcow_buffers;
 
-	clust_start = be64_to_cpu(l2t->table[l2_idx]);
-	if (clust_start & QCOW1_OFLAG_COMPRESSED) {
-		coffset	= clust_start & q->cluster_offset_mask;
-		csize	= clust_start >> (63 - q->header->cluster_bits);
-		csize	&= (q->cluster_size - 1);
+static struct qcow_buffers *qcow_get_buffers(struct qcow *q)
+{
+	struct qcow_buffers *b = &qcow_buffers;
 
-		if (pread_in_full(q->fd, q->cluster_data, csize,
-				  coffset) < 0)
-			goto out_error;
+	if (b->size >= q->cluster_size)
+		return b;
 
-		if (qcow_decompress_buffer(q->cluster_cache, q->cluster_size,
-					q->cluster_data, csize) < 0)
-			goto out_error;
+	free(b->data);
+	free(b->cluster);
+	b->size = 0;
 
-		memcpy(dst, q->cluster_cache + clust_offset, length);
-		mutex_unlock(&q->mutex);
-	} else {
-		if (!clust_start)
-			goto zero_cluster;
+	b->data = malloc(q->cluster_size);
+	b->cluster = malloc(q->cluster_size);
+	if (!b->data || !b->cluster) {
+		free(b->data);
+		free(b->cluster);
+		b->data = b->cluster = NULL;
+		return NULL;
+	}
+	io_path_alloc_account();
 
-		mutex_unlock(&q->mutex);
+	b->size = q->cluster_size;
 
-		if (pread_in_full(q->fd, dst, length,
-				  clust_start + clust_offset) < 0)
-			return -1;
-	}
+	return b;
+}
 
-	return length;
+static int qcow1_decompress_cluster(struct qcow *q, u64 clust_start, void *dst,
+				    void *data)
+{
+	u64 coffset;
+	int csize;
 
-zero_cluster:
-	mutex_unlock(&q->mutex);
-	memset(dst, 0, length);
-	return length;
+	coffset	= clust_start & q->cluster_offset_mask;
+	csize	= clust_start >> (63 - q->header->cluster_bits);
+	csize	&= (q->cluster_size - 1);
 
-out_error:
-	mutex_unlock(&q->mutex);
-	length = -1;
-	return -1;
+	if (pread_in_full(q->fd, data, csize, coffset) < 0)
+		return -1;
+
+	return qcow_decompress_buffer(q, dst, q->cluster_size, data, csize);
 }
 
-static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
-	void *dst, u32 dst_len)
+/*
+ * Inflate the compressed cluster described by L2 entry 'clust_start' into
+ * 'dst', with 'data' (a cluster worth) as the staging area.
+ */
+static int qcow2_decompress_cluster(struct qcow *q, u64 clust_start, void *dst,
+				    void *data)
 {
-	struct qcow_header *header = q->header;
-	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
-	u64 clust_offset;
-	u64 clust_start;
-	u64 l2t_offset;
-	size_t length;
-	u64 l2t_size;
-	u64 l1_idx;
-	u64 l2_idx;
-	int coffset;
 	int sector_offset;
 	int nb_csectors;
+	u64 coffset;
 	int csize;
 
-	l1_idx = get_l1_index(q, offset);
-	if (l1_idx >= l1t->table_size)
-		return -1;
+	coffset = clust_start & q->cluster_offset_mask;
+	nb_csectors = ((clust_start >> q->csize_shift) & q->csize_mask) + 1;
+	sector_offset = coffset & (SECTOR_SIZE - 1);
+	csize = nb_csectors * SECTOR_SIZE - sector_offset;
 
-	clust_offset = get_cluster_offset(q, offset);
-	if (clust_offset >= q->cluster_size)
+	if (pread_in_full(q->fd, data, nb_csectors * SECTOR_SIZE,
+			  coffset & ~(SECTOR_SIZE - 1)) < 0)
 		return -1;
 
-	length = q->cluster_size - clust_offset;
-	if (length > dst_len)
-		length = dst_len;
+	return qcow_decompress_buffer(q, dst, q->cluster_size,
+				      data + sector_offset, csize);
+}
 
-	mutex_lock(&q->mutex);
+static int qcow_decompress_cluster(struct qcow *q, u64 clust_start, void *dst,
+				   void *data)
+{
+	if (q->version == QCOW1_VERSION)
+		return qcow1_decompress_cluster(q, clust_start, dst, data);
 
-	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]);
+	return qcow2_decompress_cluster(q, clust_start, dst, data);
+}
 
-	l2t_offset &= ~QCOW2_OFLAG_COPIED;
-	if (!l2t_offset)
-		goto zero_cluster;
+static inline struct hlist_head *
+cluster_cache_bucket(struct qcow_cluster_cache *cc, u64 entry)
+{
+	u64 key = entry * 0x9e3779b97f4a7c15ULL;
 
-	l2t_size = 1 << header->l2_bits;
+	return &cc->hash[key >> (64 - cc->hash_bits)];
+}
 
-	/* read and cache level 2 table */
-	l2t = qcow_read_l2_table(q, l2t_offset);
-	if (!l2t)
-		goto out_error;
-
-	l2_idx = get_l2_index(q, offset);
-	if (l2_idx >= l2t_size)
-		goto out_error;
-
-	clust_start = be64_to_cpu(l2t->table[l2_idx]);
-	if (clust_start & QCOW2_OFLAG_COMPRESSED) {
-		coffset = clust_start & q->cluster_offset_mask;
-		nb_csectors = ((clust_start >> q->csize_shift)
-			& q->csize_mask) + 1;
-		sector_offset = coffset & (SECTOR_SIZE - 1);
-		csize = nb_csectors * SECTOR_SIZE - sector_offset;
-
-		if (pread_in_full(q->fd, q->cluster_data,
-				  nb_csectors * SECTOR_SIZE,
-				  coffset & ~(SECTOR_SIZE - 1)) < 0) {
-			goto out_error;
+static struct qcow_cached_cluster *
+cluster_cache_lookup(struct qcow_cluster_cache *cc, u64 entry)
+{
+	struct qcow_cached_cluster *c;
+
+	hlist_for_each_entry(c, cluster_cache_bucket(cc, entry), node)
+		if (c->entry == entry)
+			return c;
+
+	return NULL;
+}
+
+/*
+ * A node to inflate a cluster into: a new one while under budget, else the
+ * least recently used. NULL when all are busy being filled.
+ */
+static struct qcow_cached_cluster *cluster_cache_get(struct qcow *q)
+{
+	struct qcow_cluster_cache *cc = &q->ccache;
+	struct qcow_cached_cluster *c;
+
+	if (cc->nr_cached < cc->max_cached) {
+		c = malloc(sizeof(*c) + q->cluster_size);
+		if (!c)
+			return NULL;
+		io_path_alloc_account();
+
+		INIT_LIST_HEAD(&c->list);
+		cc->nr_cached++;
+		return c;
+	}
+
+	if (list_empty(&cc->lru_list))
+		return NULL;
+
+	c = list_first_entry(&cc->lru_list, struct qcow_cached_cluster, list);
+	list_del_init(&c->list);
+	hlist_del(&c->node);
+
+	return c;
+}
+
+/* The compressed cluster behind 'clust_start' is gone, so is its copy */
+static void cluster_cache_drop(struct qcow *q, u64 clust_start)
+{
+	struct qcow_cluster_cache *cc = &q->ccache;
+	struct qcow_cached_cluster *c;
+
+	if (!cc->max_cached)
+		return;
+
+	mutex_lock(&cc->mutex);
+	c = cluster_cache_lookup(cc, clust_start);
+	if (c && !c->loading) {
+		hlist_del(&c->node);
+		list_del(&c->list);
+		cc->nr_cached--;
+		free(c);
+	}
+	mutex_unlock(&cc->mutex);
+}
+
+/*
+ * Copy 'length' bytes at 'clust_offset' of the compressed cluster behind
+ * L2 entry 'clust_start' to 'dst', inflating it only if it isn't cached.
+ * A cluster being inflated is waited for rather than inflated twice.
+ *
+ * A sequential reader is done with a cluster once it has read its end: the
+ * cluster is then the first to go, instead of pushing out the clusters
+ * random readers come back to.
+ */
+static int qcow_read_compressed(struct qcow *q, u64 offset, u64 clust_start,
+				void *dst, u64 clust_offset, size_t length)
+{
+	struct qcow_cluster_cache *cc = &q->ccache;
+	struct qcow_cached_cluster *c;
+	struct qcow_buffers *b;
+	bool done;
+	int r;
+
+	b = qcow_get_buffers(q);
+	if (!b)
+		return -1;
+
+	if (!cc->max_cached)
+		goto uncached;
+
+	mutex_lock(&cc->mutex);
+
+	done = offset == cc->next_offset &&
+	       clust_offset + length == q->cluster_size;
+	cc->next_offset = offset + length;
+again:
+	c = cluster_cache_lookup(cc, clust_start);
+	if (c && c->loading) {
+		pthread_cond_wait(&cc->loaded, &cc->mutex.mutex);
+		goto again;
+	}
+
+	if (c) {
+		memcpy(dst, c->data + clust_offset, length);
+		if (done)
+			list_move(&c->list, &cc->lru_list);
+		else
+			list_move_tail(&c->list, &cc->lru_list);
+		mutex_unlock(&cc->mutex);
+		return 0;
+	}
+
+	c = done ? NULL : cluster_cache_get(q);
+	if (!c) {
+		mutex_unlock(&cc->mutex);
+		goto uncached;
+	}
+
+	c->entry = clust_start;
+	c->loading = 1;
+	hlist_add_head(&c->node, cluster_cache_bucket(cc, clust_start));
+	mutex_unlock(&cc->mutex);
+
+	r = qcow_decompress_cluster(q, clust_start, c->data, b->data);
+	if (!r)
+		memcpy(dst, c->data + clust_offset, length);
+
+	mutex_lock(&cc->mutex);
+	c->loading = 0;
+	if (r < 0) {
+		hlist_del(&c->node);
+		cc->nr_cached--;
+		free(c);
+	} else {
+		list_add_tail(&c->list, &cc->lru_list);
+	}
+	pthread_cond_broadcast(&cc->loaded);
+	mutex_unlock(&cc->mutex);
+
+	return r;
+
+uncached:
+	if (qcow_decompress_cluster(q, clust_start, b->cluster, b->data) < 0)
+		return -1;
+
+	memcpy(dst, b->cluster + clust_offset, length);
+	return 0;
+}
+
+/*
+ * Describe 'len' bytes of 'iov', starting 'skip' bytes into it, with at
+ * most 'max' entries of 'dst'. Returns the number of entries used, and
+ * trims 'len' to the bytes they hold.
+ */
+static int qcow_iov_slice(struct iovec *dst, int max, const struct iovec *iov,
+			  int iovcount, size_t skip, u64 *len)
+{
+	u64 left = *len;
+	size_t n;
+	int nr = 0;
+
+	for (; iovcount && left && nr < max; iov++, iovcount--) {
+		if (skip >= iov->iov_len) {
+			skip -= iov->iov_len;
+			continue;
+		}
+
+		n = min_t(u64, iov->iov_len - skip, left);
+		dst[nr].iov_base = iov->iov_base + skip;
+		dst[nr++].iov_len = n;
+		left -= n;
+		skip = 0;
+	}
+
+	*len -= left;
+
+	return nr;
+}
+
+/* Copy 'len' bytes of 'src' into 'iov' from 'skip' bytes in, zeroes if NULL */
+static void qcow_iov_fill(const struct iovec *iov, int iovcount, size_t skip,
+			  const void *src, u64 len)
+{
+	size_t n;
+
+	for (; iovcount && len; iov++, iovcount--) {
+		if (skip >= iov->iov_len) {
+			skip -= iov->iov_len;
+			continue;
 		}
 
-		if (qcow_decompress_buffer(q->cluster_cache, q->cluster_size,
-					q->cluster_data + sector_offset,
-					csize) < 0) {
-			goto out_error;
+		n = min_t(u64, iov->iov_len - skip, len);
+		if (src) {
+			memcpy(iov->iov_base + skip, src, n);
+			src += n;
+		} else {
+			memset(iov->iov_base + skip, 0, n);
 		}
+		len -= n;
+		skip = 0;
+	}
+}
 
-		memcpy(dst, q->cluster_cache + clust_offset, length);
-		mutex_unlock(&q->mutex);
+/* Backing images are synchronous, see disk_backing_open() */
+static int qcow_backing_read(struct disk_image *backing, u64 offset,
+			     const struct iovec *iov, int iovcount, u64 len)
+{
+	return backing->ops->read(backing, offset >> SECTOR_SHIFT, iov,
+				  iovcount, NULL) == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * What the backing image has at 'offset', 'len' bytes of it into 'iov',
+ * zeroes past its end. The backing image is read in whole sectors, so
+ * those that the range only starts or ends in part of go through a buffer.
+ */
+static int qcow_read_backing(struct qcow *q, u64 offset,
+			     const struct iovec *iov, int iovcount, u64 len)
+{
+	struct disk_image *backing = q->backing;
+	struct iovec vec[QCOW_MAX_IOVS];
+	u8 sector[SECTOR_SIZE];
+	u64 done, pos, head, n, length;
+	int nr;
+
+	for (done = 0; done < len; done += length) {
+		pos = offset + done;
+		if (pos >= backing->size)
+			break;
+
+		n = min(len - done, backing->size - pos);
+		head = pos & (SECTOR_SIZE - 1);
+		length = n & ~(u64)(SECTOR_SIZE - 1);
+
+		if (!head && length) {
+			nr = qcow_iov_slice(vec, QCOW_MAX_IOVS, iov, iovcount,
+					    done, &length);
+			if (length & (SECTOR_SIZE - 1)) {
+				length &= ~(u64)(SECTOR_SIZE - 1);
+				nr = qcow_iov_slice(vec, QCOW_MAX_IOVS, iov,
+						    iovcount, done, &length);
+			}
+		}
+
+		if (!head && length) {
+			if (qcow_backing_read(backing, pos, vec, nr, length) < 0)
+				return -1;
+			continue;
+		}
+
+		/* The sector 'pos' is in, as far as the backing image goes */
+		pos -= head;
+		vec[0].iov_base = sector;
+		vec[0].iov_len = min_t(u64, SECTOR_SIZE, backing->size - pos);
+		if (qcow_backing_read(backing, pos, vec, 1, vec[0].iov_len) < 0)
+			return -1;
+
+		length = min(n, vec[0].iov_len - head);
+		qcow_iov_fill(iov, iovcount, done, sector + head, length);
+	}
+
+	qcow_iov_fill(iov, iovcount, done, NULL, len - done);
+
+	return 0;
+}
+
+/* What a cluster, or a subcluster of an extended L2 entry, reads as */
+enum {
+	QCOW2_SC_UNALLOCATED,	/* from the backing image, or zeroes */
+	QCOW2_SC_ALLOCATED,
+	QCOW2_SC_ZERO,
+};
+
+/*
+ * State of the subcluster holding byte 'clust_off' of a cluster, going by
+ * the bitmap of its extended L2 entry. Trims 'len' to the subclusters from
+ * there on in the same state.
+ */
+static int qcow2_subcluster_state(struct qcow *q, u64 bitmap, u64 clust_off,
+				  u64 *len)
+{
+	u32 alloc = bitmap & QCOW2_SC_ALLOC_MASK;
+	u32 zero = bitmap >> QCOW2_SC_ZERO_SHIFT;
+	u32 sc = clust_off >> q->subcluster_bits;
+	u32 same;
+	u64 end;
+	int state;
+
+	if (alloc & (1U << sc)) {
+		state = QCOW2_SC_ALLOCATED;
+		same = alloc;
+	} else if (zero & (1U << sc)) {
+		state = QCOW2_SC_ZERO;
+		same = zero & ~alloc;
 	} else {
-		clust_start &= QCOW2_OFFSET_MASK;
-		if (!clust_start)
-			goto zero_cluster;
+		state = QCOW2_SC_UNALLOCATED;
+		same = ~(alloc | zero);
+	}
 
-		mutex_unlock(&q->mutex);
+	/* The run ends at the first subcluster in another state */
+	end = sc + __builtin_ctzll(~((u64)same >> sc));
+	*len = min(*len, (end << q->subcluster_bits) - clust_off);
+
+	return state;
+}
+
+/*
+ * What a cluster reads as from byte 'clust_off' on, going by its L2 entry.
+ * Trims 'len' to where that changes.
+ */
+static int qcow2_entry_state(struct qcow *q, u64 entry, u64 bitmap,
+			     u64 clust_off, u64 *len)
+{
+	if (entry & QCOW2_OFLAG_COMPRESSED)
+		return QCOW2_SC_ALLOCATED;
+
+	if (q->extended_l2) {
+		/* Allocated subclusters of no cluster at all */
+		if (!(entry & QCOW2_OFFSET_MASK))
+			bitmap &= ~QCOW2_SC_ALLOC_MASK;
+		return qcow2_subcluster_state(q, bitmap, clust_off, len);
+	}
+
+	if (!entry)
+		return QCOW2_SC_UNALLOCATED;
+
+	if ((entry & QCOW2_OFLAG_ZERO) || !(entry & QCOW2_OFFSET_MASK))
+		return QCOW2_SC_ZERO;
+
+	return QCOW2_SC_ALLOCATED;
+}
+
+/* The subclusters holding bytes 'start' to 'end' of a cluster */
+static u64 qcow2_subcluster_mask(struct qcow *q, u64 start, u64 end)
+{
+	u32 first = start >> q->subcluster_bits;
+	u32 last = (end - 1) >> q->subcluster_bits;
+
+	return ((2ULL << last) - 1) & ~((1ULL << first) - 1);
+}
+
+static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
+	void *dst, u32 dst_len)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	u64 clust_offset;
+	u64 clust_start;
+	size_t length;
+	u64 l1_idx;
+	u64 bitmap;
+
+	l1_idx = get_l1_index(q, offset);
+	if (l1_idx >= l1t->table_size)
+		return -1;
+
+	clust_offset = get_cluster_offset(q, offset);
+	if (clust_offset >= q->cluster_size)
+		return -1;
+
+	length = q->cluster_size - clust_offset;
+	if (length > dst_len)
+		length = dst_len;
+
+	/* Never written to, the tables don't change */
+	if (qcow_lookup(q, offset, &clust_start, &bitmap) < 0)
+		return -1;
 
+	if (clust_start & QCOW1_OFLAG_COMPRESSED) {
+		if (qcow_read_compressed(q, offset, clust_start, dst,
+					 clust_offset, length) < 0)
+			return -1;
+	} else if (!clust_start) {
+		memset(dst, 0, length);
+	} else {
 		if (pread_in_full(q->fd, dst, length,
 				  clust_start + clust_offset) < 0)
 			return -1;
 	}
 
 	return length;
+}
 
-zero_cluster:
-	mutex_unlock(&q->mutex);
-	memset(dst, 0, length);
-	return length;
+/*
+ * Grow the '*length' bytes at 'offset', in clusters of our own from 'host'
+ * on, over the clusters after them that are ours too, allocated all
+ * through and next on the host. Up to 'len' bytes.
+ */
+static int qcow2_copied_extent(struct qcow *q, u64 offset, u64 host,
+			       u64 *length, u64 len)
+{
+	u64 entry, bitmap;
+	u64 n;
 
-out_error:
-	mutex_unlock(&q->mutex);
-	length = -1;
-	return -1;
+	/* A run that stops inside a cluster ends there */
+	while (*length < len && !get_cluster_offset(q, offset + *length)) {
+		if (qcow_lookup(q, offset + *length, &entry, &bitmap) < 0)
+			return -1;
+
+		n = min(len - *length, q->cluster_size);
+		if ((entry & QCOW2_OFLAGS_MASK) != QCOW2_OFLAG_COPIED ||
+		    qcow2_entry_state(q, entry, bitmap, 0, &n) !=
+		    QCOW2_SC_ALLOCATED ||
+		    (entry & QCOW2_OFFSET_MASK) != host + *length)
+			break;
+
+		*length += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Read up to 'len' bytes from 'offset' on into 'iov', from 'skip' bytes
+ * in, as far as they read the same way. Clusters of our own that follow
+ * each other on the host are read with one preadv(), however many there
+ * are and whichever iovec entries they go to. Returns how many bytes were
+ * read.
+ */
+static ssize_t qcow2_read_extent(struct qcow *q, u64 offset,
+				 const struct iovec *iov, int iovcount,
+				 size_t skip, u64 len)
+{
+	struct iovec vec[QCOW_MAX_IOVS];
+	u64 entry, bitmap, check;
+	u64 clust_offset;
+	u64 length, done;
+	u64 clust_start;
+	int state;
+	int i, nr;
+	ssize_t r;
+
+	if (get_l1_index(q, offset) >= q->table.table_size)
+		return -1;
+
+	clust_offset = get_cluster_offset(q, offset);
+
+again:
+	if (qcow_lookup(q, offset, &entry, &bitmap) < 0)
+		return -1;
+
+	length = min(len, q->cluster_size - clust_offset);
+	state = qcow2_entry_state(q, entry, bitmap, clust_offset, &length);
+
+	clust_start = entry & QCOW2_OFFSET_MASK;
+	if (state == QCOW2_SC_ALLOCATED && (entry & QCOW2_OFLAG_COPIED) &&
+	    qcow2_copied_extent(q, offset, clust_start + clust_offset,
+				&length, len) < 0)
+		return -1;
+
+	nr = qcow_iov_slice(vec, QCOW_MAX_IOVS, iov, iovcount, skip, &length);
+
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		r = 0;
+		for (i = 0, done = 0; i < nr && r >= 0; done += vec[i++].iov_len)
+			r = qcow_read_compressed(q, offset + done, entry,
+						 vec[i].iov_base,
+						 clust_offset + done,
+						 vec[i].iov_len);
+	} else if (state == QCOW2_SC_UNALLOCATED && q->backing) {
+		if (qcow_read_backing(q, offset, vec, nr, length) < 0)
+			return -1;
+		return length;
+	} else if (state != QCOW2_SC_ALLOCATED) {
+		for (i = 0; i < nr; i++)
+			memset(vec[i].iov_base, 0, vec[i].iov_len);
+		return length;
+	} else {
+		r = preadv_in_full(q->fd, vec, nr, clust_start + clust_offset);
+	}
+
+	/*
+	 * Only clusters this entry owns alone are sure to stay put. Others
+	 * were read from the right place if the entry is still the same.
+	 */
+	if (!(entry & QCOW2_OFLAG_COPIED)) {
+		if (qcow_lookup(q, offset, &check, &bitmap) < 0)
+			return -1;
+		if (check != entry)
+			goto again;
+	}
+
+	return r < 0 ? -1 : (ssize_t)length;
 }
 
-static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
+/* Segments needn't be whole sectors when an overlay reads through us */
+static ssize_t qcow1_read_sector_single(struct disk_image *disk, u64 offset,
 	void *dst, u32 dst_len)
 {
 	struct qcow *q = disk->priv;
 	struct qcow_header *header = q->header;
 	u32 nr_read;
-	u64 offset;
 	char *buf;
 	u32 nr;
 
@@ -478,41 +1202,35 @@ static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
 	nr_read = 0;
 
 	while (nr_read < dst_len) {
-		offset = sector << SECTOR_SHIFT;
 		if (offset >= header->size)
 			return -1;
 
-		if (q->version == QCOW1_VERSION)
-			nr = qcow1_read_cluster(q, offset, buf,
-				dst_len - nr_read);
-		else
-			nr = qcow2_read_cluster(q, offset, buf,
-				dst_len - nr_read);
-
+		nr = qcow1_read_cluster(q, offset, buf, dst_len - nr_read);
 		if (nr <= 0)
 			return -1;
 
 		nr_read	+= nr;
 		buf	+= nr;
-		sector	+= (nr >> SECTOR_SHIFT);
+		offset	+= nr;
 	}
 
 	return dst_len;
 }
 
-static ssize_t qcow_read_sector(struct disk_image *disk, u64 sector,
-				const struct iovec *iov, int iovcount, void *param)
+static ssize_t qcow1_read_sector(struct disk_image *disk, u64 sector,
+				 const struct iovec *iov, int iovcount)
 {
+	u64 offset = sector << SECTOR_SHIFT;
 	ssize_t nr, total = 0;
 
 	while (iovcount--) {
-		nr = qcow_read_sector_single(disk, sector, iov->iov_base, iov->iov_len);
+		nr = qcow1_read_sector_single(disk, offset, iov->iov_base, iov->iov_len);
 		if (nr != (ssize_t)iov->iov_len) {
 			pr_info("qcow_read_sector error: nr=%ld iov_len=%ld\n", (long)nr, (long)iov->iov_len);
 			return -1;
 		}
 
-		sector += iov->iov_len >> SECTOR_SHIFT;
+		offset += iov->iov_len;
 		total += nr;
 		iov++;
 	}
@@ -520,6 +1238,50 @@ static ssize_t qcow_read_sector(struct disk_image *disk, u64 sector,
 	return total;
 }
 
+static ssize_t qcow_read_sector(struct disk_image *disk, u64 sector,
+				const struct iovec *iov, int iovcount, void *param)
+{
+	struct qcow *q = disk->priv;
+	ssize_t nr, total = 0;
+	size_t skip = 0;
+	u64 offset, len;
+	int i;
+
+	if (q->version == QCOW1_VERSION)
+		return qcow1_read_sector(disk, sector, iov, iovcount);
+
+	len = 0;
+	for (i = 0; i < iovcount; i++)
+		len += iov[i].iov_len;
+
+	offset = sector << SECTOR_SHIFT;
+	if (offset + len > q->header->size)
+		return -1;
+
+	while (len) {
+		nr = qcow2_read_extent(q, offset, iov, iovcount, skip, len);
+		if (nr <= 0) {
+			pr_info("qcow_read_sector error: nr=%ld offset=%llu\n",
+				(long)nr, (unsigned long long)offset);
+			return -1;
+		}
+
+		offset	+= nr;
+		total	+= nr;
+		len	-= nr;
+
+		/* Skip what the extent took */
+		skip	+= nr;
+		while (iovcount && skip >= iov->iov_len) {
+			skip -= iov->iov_len;
+			iov++;
+			iovcount--;
+		}
+	}
+
+	return total;
+}
+
 static void refcount_table_free_cache(struct qcow_refcount_table *rft)
 {
 	struct rb_root *r = &rft->root;
@@ -533,6 +1295,11 @@ static void refcount_table_free_cache(struct qcow_refcount_table *rft)
 
 		free(t);
 	}
+
+	list_for_each_safe(pos, n, &rft->free_list) {
+		list_del(pos);
+		free(list_entry(pos, struct qcow_refcount_block, list));
+	}
 }
 
 static int refcount_block_insert(struct rb_root *root, struct qcow_refcount_block *new)
@@ -572,7 +1339,7 @@ static int write_refcount_block(struct qcow *q, struct qcow_refcount_block *rfb)
 	if (!rfb->dirty)
 		return 0;
 
-	if (qcow_pwrite_sync(q->fd, rfb->entries,
+	if (pwrite_in_full(q->fd, rfb->entries,
 		rfb->size * sizeof(u16), rfb->offset) < 0)
 		return -1;
 
@@ -581,6 +1348,22 @@ static int write_refcount_block(struct qcow *q, struct qcow_refcount_block *rfb)
 	return 0;
 }
 
+/*
+ * Write back every cached refcount block. Increments may reach the disk
+ * ahead of anything else, decrements are only made once the references
+ * they drop are gone from the disk (see qcow_free_clusters()).
+ */
+static int qcow_write_refcount_blocks(struct qcow *q)
+{
+	struct qcow_refcount_block *c;
+
+	list_for_each_entry(c, &q->refcount_table.lru_list, list)
+		if (write_refcount_block(q, c) < 0)
+			return -1;
+
+	return 0;
+}
+
 static int cache_refcount_block(struct qcow *q, struct qcow_refcount_block *c)
 {
 	struct qcow_refcount_table *rft = &q->refcount_table;
@@ -590,11 +1373,13 @@ static int cache_refcount_block(struct qcow *q, struct qcow_refcount_block *c)
 	if (rft->nr_cached == MAX_CACHE_NODES) {
 		lru = list_first_entry(&rft->lru_list, struct qcow_refcount_block, list);
 
+		if (write_refcount_block(q, lru) < 0)
+			goto error;
+
 		rb_erase(&lru->node, r);
-		list_del_init(&lru->list);
 		rft->nr_cached--;
 
-		free(lru);
+		list_move(&lru->list, &rft->free_list);
 	}
 
 	if (refcount_block_insert(r, c) < 0)
@@ -610,13 +1395,21 @@ error:
 
 static struct qcow_refcount_block *new_refcount_block(struct qcow *q, u64 rfb_offset)
 {
+	struct qcow_refcount_table *rft = &q->refcount_table;
 	struct qcow_refcount_block *rfb;
 
-	rfb = malloc(sizeof *rfb + q->cluster_size);
-	if (!rfb)
-		return NULL;
+	if (!list_empty(&rft->free_list)) {
+		rfb = list_first_entry(&rft->free_list, struct qcow_refcount_block, list);
+		list_del(&rfb->list);
+	} else {
+		rfb = malloc(sizeof *rfb + q->cluster_size);
+		if (!rfb)
+			return NULL;
+		io_path_alloc_account();
+	}
 
 	rfb->offset = rfb_offset;
+	rfb->dirty = 0;
 	rfb->size = q->cluster_size / sizeof(u16);
 	RB_CLEAR_NODE(&rfb->node);
 	INIT_LIST_HEAD(&rfb->list);
@@ -689,18 +1482,22 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 	memset(rfb->entries, 0x00, q->cluster_size);
 	rfb->dirty = 1;
 
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0)
-		goto free_rfb;
-
-	if (cache_refcount_block(q, rfb) < 0)
-		goto free_rfb;
+	if (cache_refcount_block(q, rfb) < 0) {
+		list_add(&rfb->list, &rft->free_list);
+		return NULL;
+	}
 
+	/* The new block may well be the one accounting for itself */
 	rft->rf_table[rft_idx] = cpu_to_be64(new_block_offset);
 	if (update_cluster_refcount(q, new_block_offset >>
 		    header->cluster_bits, 1) < 0)
 		goto recover_rft;
 
+	/* Blocks reach the disk before the table entries naming them */
+	if (qcow_write_refcount_blocks(q) < 0 ||
+	    (!q->lazy_refcounts && fdatasync(q->fd) < 0))
+		goto recover_rft;
+
 	if (qcow_write_refcount_table(q) < 0)
 		goto recover_rft;
 
@@ -708,8 +1505,9 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 
 recover_rft:
 	rft->rf_table[rft_idx] = 0;
-free_rfb:
-	free(rfb);
+	rb_erase(&rfb->node, &rft->root);
+	list_move(&rfb->list, &rft->free_list);
+	rft->nr_cached--;
 	return NULL;
 }
 
@@ -746,7 +1544,7 @@ static struct qcow_refcount_block *qcow_read_refcount_block(struct qcow *q, u64
 	return rfb;
 
 error_free_rfb:
-	free(rfb);
+	list_add(&rfb->list, &rft->free_list);
 
 	return NULL;
 }
@@ -776,93 +1574,320 @@ static u16 qcow_get_refcount(struct qcow *q, u64 clust_idx)
 	return be16_to_cpu(rfb->entries[rfb_idx]);
 }
 
-static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append)
+#define QCOW_USED_MAP_BITS	(8 * sizeof(unsigned long))
+
+static inline u64 qcow_refcount_block_entries(struct qcow *q)
 {
-	struct qcow_refcount_block *rfb = NULL;
-	struct qcow_header *header = q->header;
-	u16 refcount;
-	u64 rfb_idx;
+	return 1ULL << (q->header->cluster_bits - QCOW_REFCOUNT_BLOCK_SHIFT);
+}
 
-	rfb = qcow_read_refcount_block(q, clust_idx);
-	if (PTR_ERR(rfb) == -ENOSPC) {
-		rfb = qcow_grow_refcount_block(q, clust_idx);
-		if (!rfb) {
-			pr_warning("error while growing refcount table");
-			return -1;
-		}
-	} else if (IS_ERR_OR_NULL(rfb)) {
-		pr_warning("error while reading refcount table");
-		return -1;
-	}
+static inline bool qcow_used_map_test(unsigned long *map, u64 idx)
+{
+	return map[idx / QCOW_USED_MAP_BITS] & (1UL << (idx % QCOW_USED_MAP_BITS));
+}
 
-	rfb_idx = clust_idx & (((1ULL <<
-		(header->cluster_bits - QCOW_REFCOUNT_BLOCK_SHIFT)) - 1));
-	if (rfb_idx >= rfb->size) {
-		pr_warning("refcount block index out of bounds");
-		return -1;
-	}
+static inline void qcow_used_map_set(unsigned long *map, u64 idx, bool used)
+{
+	unsigned long bit = 1UL << (idx % QCOW_USED_MAP_BITS);
 
-	refcount = be16_to_cpu(rfb->entries[rfb_idx]) + append;
-	rfb->entries[rfb_idx] = cpu_to_be16(refcount);
-	rfb->dirty = 1;
+	if (used)
+		map[idx / QCOW_USED_MAP_BITS] |= bit;
+	else
+		map[idx / QCOW_USED_MAP_BITS] &= ~bit;
+}
+
+/*
+ * Follow a refcount change. Parts of the map not filled in yet get the
+ * refcount when they are.
+ */
+static void qcow_used_map_update(struct qcow *q, u64 clust_idx, u16 refcount)
+{
+	if (clust_idx >= q->used_clusters ||
+	    !qcow_used_map_test(q->used_loaded,
+				clust_idx / qcow_refcount_block_entries(q)))
+		return;
+
+	qcow_used_map_set(q->used_map, clust_idx, refcount);
+}
+
+/* Have the map cover cluster 'clust_idx', in whole refcount blocks */
+static int qcow_used_map_grow(struct qcow *q, u64 clust_idx)
+{
+	u64 per_block = qcow_refcount_block_entries(q);
+	u64 nr = q->used_clusters ? q->used_clusters : per_block;
+	size_t old_map, old_loaded, map_size, loaded_size;
+	unsigned long *map;
+
+	while (nr <= clust_idx)
+		nr *= 2;
+
+	old_map = q->used_clusters / 8;
+	old_loaded = DIV_ROUND_UP(q->used_clusters / per_block,
+				  QCOW_USED_MAP_BITS) * sizeof(unsigned long);
+	map_size = nr / 8;
+	loaded_size = DIV_ROUND_UP(nr / per_block, QCOW_USED_MAP_BITS) *
+		      sizeof(unsigned long);
+
+	map = realloc(q->used_map, map_size);
+	if (!map)
+		return -1;
+	memset((void *)map + old_map, 0, map_size - old_map);
+	q->used_map = map;
+
+	map = realloc(q->used_loaded, loaded_size);
+	if (!map)
+		return -1;
+	memset((void *)map + old_loaded, 0, loaded_size - old_loaded);
+	q->used_loaded = map;
+
+	q->used_clusters = nr;
+
+	return 0;
+}
+
+/* Fill in the map from the refcount block of cluster 'clust_idx' */
+static int qcow_used_map_load(struct qcow *q, u64 clust_idx)
+{
+	u64 per_block = qcow_refcount_block_entries(q);
+	u64 first = clust_idx & ~(per_block - 1);
+	struct qcow_refcount_block *rfb;
+	u64 i;
+
+	rfb = qcow_read_refcount_block(q, first);
+	if (IS_ERR_OR_NULL(rfb) && PTR_ERR(rfb) != -ENOSPC) {
+		pr_warning("Error while reading refcount table");
+		return -1;
+	}
+
+	/* Without a block, none of its clusters are in use */
+	for (i = 0; !IS_ERR(rfb) && i < rfb->size; i++)
+		if (rfb->entries[i])
+			qcow_used_map_set(q->used_map, first + i, true);
+
+	qcow_used_map_set(q->used_loaded, clust_idx / per_block, true);
+
+	return 0;
+}
+
+static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append)
+{
+	struct qcow_refcount_block *rfb = NULL;
+	struct qcow_header *header = q->header;
+	u16 refcount;
+	u64 rfb_idx;
+
+	rfb = qcow_read_refcount_block(q, clust_idx);
+	if (PTR_ERR(rfb) == -ENOSPC) {
+		rfb = qcow_grow_refcount_block(q, clust_idx);
+		if (!rfb) {
+			pr_warning("error while growing refcount table");
+			return -1;
+		}
+	} else if (IS_ERR_OR_NULL(rfb)) {
+		pr_warning("error while reading refcount table");
+		return -1;
+	}
 
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0) {
+	rfb_idx = clust_idx & (((1ULL <<
+		(header->cluster_bits - QCOW_REFCOUNT_BLOCK_SHIFT)) - 1));
+	if (rfb_idx >= rfb->size) {
 		pr_warning("refcount block index out of bounds");
 		return -1;
 	}
 
+	/* Written back on flush or eviction */
+	refcount = be16_to_cpu(rfb->entries[rfb_idx]) + append;
+	rfb->entries[rfb_idx] = cpu_to_be16(refcount);
+	rfb->dirty = 1;
+
+	qcow_used_map_update(q, clust_idx, refcount);
+
 	/* update free_clust_idx since refcount becomes zero */
-	if (!refcount && clust_idx < q->free_clust_idx)
-		q->free_clust_idx = clust_idx;
+	if (!refcount) {
+		drop_cache_table(q, clust_idx << header->cluster_bits);
+		if (clust_idx < q->free_clust_idx)
+			q->free_clust_idx = clust_idx;
+	}
 
 	return 0;
 }
 
+/*
+ * The references to the clusters are gone from the cached metadata. They
+ * must be gone from the disk too before the clusters can be reused, so
+ * their refcounts only drop in the next qcow_flush_metadata(), after the
+ * tables are written back. Until then they stay in use. Only copy-on-write
+ * and zeroing free clusters.
+ */
 static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size)
+{
+	if (q->nr_pending_frees == QCOW_PENDING_FREES_MAX &&
+	    qcow_flush_metadata(q) < 0) {
+		pr_warning("Leaking clusters at %llu",
+			   (unsigned long long)clust_start);
+		return;
+	}
+
+	q->pending_frees[q->nr_pending_frees++] = (struct qcow_free_range) {
+		.offset	= clust_start,
+		.size	= size,
+	};
+}
+
+/* Drop the refcounts of the clusters freed since the last write-back */
+static void qcow_put_pending_frees(struct qcow *q)
 {
 	struct qcow_header *header = q->header;
+	struct qcow_free_range *f;
 	u64 start, end, offset;
+	u32 i;
+
+	for (i = 0; i < q->nr_pending_frees; i++) {
+		f = &q->pending_frees[i];
+		start = f->offset & ~(q->cluster_size - 1);
+		end = (f->offset + f->size - 1) & ~(q->cluster_size - 1);
+		for (offset = start; offset <= end; offset += q->cluster_size)
+			update_cluster_refcount(q, offset >> header->cluster_bits,
+						-1);
+	}
 
-	start = clust_start & ~(q->cluster_size - 1);
-	end = (clust_start + size - 1) & ~(q->cluster_size - 1);
-	for (offset = start; offset <= end; offset += q->cluster_size)
-		update_cluster_refcount(q, offset >> header->cluster_bits, -1);
+	q->nr_pending_frees = 0;
+}
+
+static int qcow2_write_incompatible_features(struct qcow *q, u64 features)
+{
+	u64 v = cpu_to_be64(features);
+
+	if (qcow_pwrite_sync(q->fd, &v, sizeof(v),
+			     offsetof(struct qcow2_header_disk,
+				      incompatible_features)) < 0)
+		return -1;
+
+	q->header->incompatible_features = features;
+
+	return 0;
 }
 
 /*
- * Allocate clusters according to the size. Find a postion that
- * can satisfy the size. free_clust_idx is initialized to zero and
- * Record last position.
+ * With lazy refcounts the metadata goes to the disk in whatever order it is
+ * written back, with no syncs in between. Until it is all there the image
+ * is marked dirty, and the refcounts are rebuilt if it is opened that way.
+ */
+static int qcow_mark_dirty(struct qcow *q)
+{
+	u64 features = q->header->incompatible_features;
+
+	if (!q->lazy_refcounts || (features & QCOW2_INCOMPAT_DIRTY))
+		return 0;
+
+	return qcow2_write_incompatible_features(q,
+			features | QCOW2_INCOMPAT_DIRTY);
+}
+
+/* Only once the metadata has been flushed */
+static int qcow_mark_clean(struct qcow *q)
+{
+	u64 features = q->header->incompatible_features;
+
+	if (!(features & QCOW2_INCOMPAT_DIRTY))
+		return 0;
+
+	return qcow2_write_incompatible_features(q,
+			features & ~QCOW2_INCOMPAT_DIRTY);
+}
+
+/*
+ * Find 'nr' free clusters in a row, the first such run from free_clust_idx
+ * on, the lowest index that may be free. The map is filled in as the search
+ * gets to parts of it that aren't yet, and words of it all in use or all
+ * free are taken whole. Moves free_clust_idx to the first free cluster met.
+ */
+static u64 qcow_find_free_run(struct qcow *q, u64 nr)
+{
+	u64 per_block = qcow_refcount_block_entries(q);
+	u64 idx = q->free_clust_idx;
+	u64 start = idx, first = (u64)-1;
+	unsigned long word;
+
+	while (idx - start < nr) {
+		if (idx >= q->used_clusters && qcow_used_map_grow(q, idx) < 0)
+			return -1;
+
+		if (!qcow_used_map_test(q->used_loaded, idx / per_block) &&
+		    qcow_used_map_load(q, idx) < 0)
+			return -1;
+
+		word = q->used_map[idx / QCOW_USED_MAP_BITS];
+		if (!(idx % QCOW_USED_MAP_BITS) && word == ~0UL) {
+			idx += QCOW_USED_MAP_BITS;
+			start = idx;
+			continue;
+		}
+
+		if (qcow_used_map_test(q->used_map, idx)) {
+			start = ++idx;
+			continue;
+		}
+
+		if (first == (u64)-1)
+			first = idx;
+
+		if (!(idx % QCOW_USED_MAP_BITS) && !word &&
+		    nr - (idx - start) >= QCOW_USED_MAP_BITS)
+			idx += QCOW_USED_MAP_BITS;
+		else
+			idx++;
+	}
+
+	q->free_clust_idx = first == start ? idx : first;
+
+	return start;
+}
+
+/*
+ * Allocate clusters according to the size, as one contiguous run found in
+ * the map of clusters in use. Only copy-on-write frees clusters, so
+ * allocations mostly land one after the other at the end of the image and
+ * a guest writing sequentially gets host-sequential clusters. The refcounts
+ * are updated in the cache; without 'update_ref' the caller sets them, and
+ * the clusters count as used until then.
  */
 static u64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref)
 {
 	struct qcow_header *header = q->header;
-	u16 clust_refcount;
-	u32 clust_idx = 0, i;
+	u64 clust_idx, i;
 	u64 clust_num;
 
+	if (qcow_mark_dirty(q) < 0)
+		return -1;
+
 	clust_num = (size + (q->cluster_size - 1)) >> header->cluster_bits;
 
-again:
-	for (i = 0; i < clust_num; i++) {
-		clust_idx = q->free_clust_idx++;
-		clust_refcount = qcow_get_refcount(q, clust_idx);
-		if (clust_refcount == (u16)-1)
-			return -1;
-		else if (clust_refcount > 0)
-			goto again;
-	}
+	clust_idx = qcow_find_free_run(q, clust_num);
+	if (clust_idx == (u64)-1)
+		return -1;
 
-	clust_idx++;
+	/* Taken before any refcount update, which may allocate a block */
+	for (i = 0; i < clust_num; i++)
+		qcow_used_map_set(q->used_map, clust_idx + i, true);
 
 	if (update_ref)
 		for (i = 0; i < clust_num; i++)
-			if (update_cluster_refcount(q,
-				clust_idx - clust_num + i, 1))
-				return -1;
+			if (update_cluster_refcount(q, clust_idx + i, 1))
+				goto err_put;
+
+	return clust_idx << header->cluster_bits;
+
+err_put:
+	/* Give the run back whole, the refcounts raised so far included */
+	while (i--)
+		update_cluster_refcount(q, clust_idx + i, -1);
+	for (i = 0; i < clust_num; i++)
+		qcow_used_map_set(q->used_map, clust_idx + i, false);
+	if (clust_idx < q->free_clust_idx)
+		q->free_clust_idx = clust_idx;
 
-	return (clust_idx - clust_num) << header->cluster_bits;
+	return -1;
 }
 
 static int qcow_write_l1_table(struct qcow *q)
@@ -870,18 +1895,83 @@ static int qcow_write_l1_table(struct qcow *q)
 	struct qcow_l1_table *l1t = &q->table;
 	struct qcow_header *header = q->header;
 
-	if (qcow_pwrite_sync(q->fd, l1t->l1_table,
+	if (!l1t->dirty)
+		return 0;
+
+	if (pwrite_in_full(q->fd, l1t->l1_table,
 		l1t->table_size * sizeof(u64),
 		header->l1_table_offset) < 0)
 		return -1;
 
+	l1t->dirty = 0;
+
 	return 0;
 }
 
+/*
+ * Write back the cached metadata in an order that keeps the image
+ * consistent whenever the host goes down: data and refcounts reach the
+ * disk before the L2 entries using them, L2 tables before the L1 entries
+ * pointing at them. The worst a crash leaves behind is leaked clusters.
+ * Images with lazy refcounts are marked dirty instead, and only skip the
+ * sync before the L2 tables: an L1 entry must never name a table whose
+ * contents aren't on the disk yet. Everything written so far is durable
+ * on return.
+ */
+static int qcow_flush_metadata(struct qcow *q)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_table *c;
+	bool l2_dirty = false;
+
+	if (qcow_write_refcount_blocks(q) < 0)
+		return -1;
+
+	list_for_each_entry(c, &l1t->lru_list, list)
+		l2_dirty |= c->dirty;
+
+	if (l2_dirty) {
+		if (!q->lazy_refcounts && fdatasync(q->fd) < 0)
+			return -1;
+
+		list_for_each_entry(c, &l1t->lru_list, list)
+			if (qcow_l2_cache_write(q, c) < 0)
+				return -1;
+	}
+
+	/* New tables are written by get_cluster_table() before this too */
+	if (l1t->dirty) {
+		if (fdatasync(q->fd) < 0)
+			return -1;
+
+		if (qcow_write_l1_table(q) < 0)
+			return -1;
+	}
+
+	/*
+	 * Freed clusters are no longer referenced once the tables are on the
+	 * disk. Lazy refcounts may get there first: nothing is allocated
+	 * before the sync below.
+	 */
+	if (q->nr_pending_frees) {
+		if (!q->lazy_refcounts && fdatasync(q->fd) < 0)
+			return -1;
+
+		qcow_put_pending_frees(q);
+		if (qcow_write_refcount_blocks(q) < 0)
+			return -1;
+	}
+
+	return fdatasync(q->fd);
+}
+
 /*
  * Get l2 table. If the table has been copied, read table directly.
  * If the table exists, allocate a new cluster and copy the table
- * to the new cluster.
+ * to the new cluster. The new table is written out whole, its slices
+ * are cached as they are used. The L1 entry is written back by
+ * qcow_flush_metadata(). Returns the slice holding the entry for
+ * 'offset', and the entry's index in it.
  */
 static int get_cluster_table(struct qcow *q, u64 offset,
 	struct qcow_l2_table **result_l2t, u64 *result_l2_index)
@@ -894,6 +1984,7 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 	u64 l2t_idx;
 	u64 l2t_size;
 	u64 l2t_new_offset;
+	void *buf;
 
 	l2t_size = 1 << header->l2_bits;
 
@@ -906,58 +1997,49 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 		return -1;
 
 	l2t_offset = be64_to_cpu(l1t->l1_table[l1t_idx]);
-	if (l2t_offset & QCOW2_OFLAG_COPIED) {
-		l2t_offset &= ~QCOW2_OFLAG_COPIED;
-		l2t = qcow_read_l2_table(q, l2t_offset);
-		if (!l2t)
-			goto error;
-	} else {
-		l2t_new_offset = qcow_alloc_clusters(q,
-			l2t_size*sizeof(u64), 1);
+	if (!(l2t_offset & QCOW2_OFLAG_COPIED)) {
+		l2t_new_offset = qcow_alloc_clusters(q, q->cluster_size, 1);
 
-		if (l2t_new_offset != (u64)-1)
+		if (l2t_new_offset == (u64)-1)
 			goto error;
 
-		l2t = new_cache_table(q, l2t_new_offset);
-		if (!l2t)
-			goto free_cluster;
-
+		/* A shared table is never modified, the disk has it all */
+		buf = q->zero_cluster;
 		if (l2t_offset) {
-			l2t = qcow_read_l2_table(q, l2t_offset);
-			if (!l2t)
-				goto free_cache;
-		} else
-			memset(l2t->table, 0x00, l2t_size * sizeof(u64));
-
-		/* write l2 table */
-		l2t->dirty = 1;
-		if (qcow_l2_cache_write(q, l2t) < 0)
-			goto free_cache;
+			if (pread_in_full(q->fd, q->copy_buff, q->cluster_size,
+					  l2t_offset) < 0)
+				goto free_cluster;
+			buf = q->copy_buff;
+		}
 
-		/* cache l2 table */
-		if (cache_table(q, l2t))
-			goto free_cache;
+		if (pwrite_in_full(q->fd, buf, q->cluster_size,
+				   l2t_new_offset) < 0)
+			goto free_cluster;
 
 		/* update the l1 talble */
+		write_seqcount_begin(&q->seq);
 		l1t->l1_table[l1t_idx] = cpu_to_be64(l2t_new_offset
 			| QCOW2_OFLAG_COPIED);
-		if (qcow_write_l1_table(q)) {
-			pr_warning("Update l1 table error");
-			goto free_cache;
-		}
+		write_seqcount_end(&q->seq);
+		l1t->dirty = 1;
 
 		/* free old cluster */
-		qcow_free_clusters(q, l2t_offset, q->cluster_size);
+		if (l2t_offset)
+			qcow_free_clusters(q, l2t_offset, q->cluster_size);
+
+		l2t_offset = l2t_new_offset;
 	}
 
+	l2t_offset &= ~QCOW2_OFLAG_COPIED;
+	l2t = qcow_read_l2_slice(q, l2t_offset, l2t_idx);
+	if (!l2t)
+		goto error;
+
 	*result_l2t = l2t;
-	*result_l2_index = l2t_idx;
+	*result_l2_index = get_l2_slice_index(q, l2t_idx);
 
 	return 0;
 
-free_cache:
-	free(l2t);
-
 free_cluster:
 	qcow_free_clusters(q, l2t_new_offset, q->cluster_size);
 
@@ -965,21 +2047,275 @@ error:
 	return -1;
 }
 
+/* The least a write allocates: a subcluster, or a whole cluster */
+static inline u64 qcow_alloc_size(struct qcow *q)
+{
+	return q->extended_l2 ? 1ULL << q->subcluster_bits : q->cluster_size;
+}
+
+/*
+ * Bytes the guest doesn't write around those it does, in the subclusters
+ * or clusters they get allocated: they keep reading as they did, zeroes or
+ * the backing image's data. 'e' is the entry of the cluster at 'offset',
+ * 'buf' holds data from the backing image.
+ */
+static int qcow_fill_gap(struct qcow *q, struct iovec *vec, u64 *e,
+			 u64 offset, u64 len, void *buf)
+{
+	u64 bitmap = q->extended_l2 ? be64_to_cpu(e[1]) : 0;
+	u64 n = len;
+
+	vec->iov_base = q->zero_cluster;
+	vec->iov_len = len;
+
+	if (!len || !q->backing ||
+	    qcow2_entry_state(q, be64_to_cpu(e[0]), bitmap,
+			      get_cluster_offset(q, offset), &n) !=
+	    QCOW2_SC_UNALLOCATED)
+		return 0;
+
+	vec->iov_base = buf;
+	return qcow_read_backing(q, offset, vec, 1, len);
+}
+
+/* The bitmap of an extended entry once bytes 'start' to 'end' are written */
+static u64 qcow2_bitmap_written(struct qcow *q, u64 bitmap, u64 start, u64 end)
+{
+	u64 mask = qcow2_subcluster_mask(q, start, end);
+
+	return (bitmap | mask) & ~(mask << QCOW2_SC_ZERO_SHIFT);
+}
+
+/*
+ * Fresh clusters from the entry at 'l2t_idx' of the slice on, for entries
+ * unallocated or reading as zeroes, are allocated as one run. The data is
+ * written to it, padded out to the subclusters or clusters it starts and
+ * ends in with what those read as until now. Subclusters the write doesn't
+ * touch aren't written at all. Called with the mutex held.
+ */
+static ssize_t qcow_write_new_clusters(struct qcow *q, struct qcow_l2_table *l2t,
+				       u64 l2t_idx, u64 offset, u64 clust_off,
+				       const struct iovec *iov, int iovcount,
+				       size_t skip, u64 src_len)
+{
+	struct qcow_header *header = q->header;
+	struct iovec vec[QCOW_MAX_IOVS];
+	u64 l2t_size = q->l2_slice_size;
+	u64 unit = qcow_alloc_size(q);
+	u64 head, tail, end;
+	u64 clust_start;
+	u64 len, run, i;
+	u64 *e;
+	int nr;
+
+	/* As far as the write goes, within this slice */
+	len = min(src_len, ((l2t_size - l2t_idx) << header->cluster_bits) -
+			   clust_off);
+	run = (clust_off + len + q->cluster_size - 1) >> header->cluster_bits;
+	for (i = 1; i < run; i++)
+		if (be64_to_cpu(*l2_slice_entry(q, l2t, l2t_idx + i)) &
+		    ~QCOW2_OFLAG_ZERO)
+			break;
+	len = min(len, (i << header->cluster_bits) - clust_off);
+
+	nr = qcow_iov_slice(vec + 1, QCOW_MAX_IOVS - 2, iov, iovcount,
+			    skip, &len);
+	run = (clust_off + len + q->cluster_size - 1) >> header->cluster_bits;
+
+	clust_start = qcow_alloc_clusters(q, run << header->cluster_bits, 1);
+	if (clust_start == (u64)-1) {
+		pr_warning("Cluster alloc error");
+		return -1;
+	}
+
+	end = clust_off + len;
+	head = clust_off & (unit - 1);
+	tail = ALIGN(end, unit) - end;
+
+	if (qcow_fill_gap(q, &vec[0], l2_slice_entry(q, l2t, l2t_idx),
+			  offset - head, head, q->copy_buff) < 0 ||
+	    qcow_fill_gap(q, &vec[nr + 1],
+			  l2_slice_entry(q, l2t, l2t_idx + run - 1),
+			  offset + len, tail, q->cluster_data) < 0)
+		goto free_cluster;
+
+	/* Write actual data */
+	if (pwritev_in_full(q->fd, vec, nr + 2,
+			    clust_start + clust_off - head) < 0)
+		goto free_cluster;
+
+	/* update l2 table, written back once the data is durable */
+	write_seqcount_begin(&q->seq);
+	for (i = 0; i < run; i++) {
+		e = l2_slice_entry(q, l2t, l2t_idx + i);
+		if (q->extended_l2)
+			e[1] = cpu_to_be64(qcow2_bitmap_written(q,
+				be64_to_cpu(e[1]), i ? 0 : clust_off - head,
+				i < run - 1 ? q->cluster_size :
+				get_cluster_offset(q, end + tail - 1) + 1));
+		e[0] = cpu_to_be64((clust_start + (i << header->cluster_bits)) |
+				   QCOW2_OFLAG_COPIED);
+	}
+	write_seqcount_end(&q->seq);
+	l2t->dirty = 1;
+
+	return len;
+
+free_cluster:
+	qcow_free_clusters(q, clust_start, run << header->cluster_bits);
+	return -1;
+}
+
+/*
+ * Write to a cluster of our own, parts of which read as zeroes or from the
+ * backing image: the subclusters the write covers in part are filled in,
+ * and the entry then has all it covers allocated. The data goes in 'vec',
+ * from vec[1] on, vec[0] and vec[nr + 1] are for the padding. Called with
+ * the mutex held.
+ */
+static ssize_t qcow_write_gaps(struct qcow *q, struct qcow_l2_table *l2t,
+			       u64 l2t_idx, u64 offset, u64 clust_start,
+			       u64 clust_off, struct iovec *vec, int nr, u64 len)
+{
+	u64 *e = l2_slice_entry(q, l2t, l2t_idx);
+	u64 bitmap = q->extended_l2 ? be64_to_cpu(e[1]) : 0;
+	u64 entry = be64_to_cpu(e[0]);
+	u64 unit = qcow_alloc_size(q);
+	u64 end = clust_off + len;
+	u64 head, tail, n = 1;
+
+	/* Allocated subclusters have nothing to fill in */
+	head = clust_off & (unit - 1);
+	if (head && qcow2_entry_state(q, entry, bitmap, clust_off - head,
+				      &n) == QCOW2_SC_ALLOCATED)
+		head = 0;
+
+	tail = ALIGN(end, unit) - end;
+	if (tail && qcow2_entry_state(q, entry, bitmap, end,
+				      &n) == QCOW2_SC_ALLOCATED)
+		tail = 0;
+
+	if (qcow_fill_gap(q, &vec[0], e, offset - head, head,
+			  q->copy_buff) < 0 ||
+	    qcow_fill_gap(q, &vec[nr + 1], e, offset + len, tail,
+			  q->cluster_data) < 0)
+		return -1;
+
+	if (pwritev_in_full(q->fd, vec, nr + 2,
+			    clust_start + clust_off - head) < 0)
+		return -1;
+
+	write_seqcount_begin(&q->seq);
+	if (q->extended_l2)
+		e[1] = cpu_to_be64(qcow2_bitmap_written(q, bitmap,
+					clust_off - head, end + tail));
+	else
+		e[0] = cpu_to_be64(entry & ~QCOW2_OFLAG_ZERO);
+	write_seqcount_end(&q->seq);
+	l2t->dirty = 1;
+
+	return len;
+}
+
+/*
+ * Read a cluster to be copied whole into q->copy_buff, the subclusters
+ * that aren't allocated as they read. 'offset' is where it is in the image.
+ */
+static int qcow2_read_cow_cluster(struct qcow *q, u64 entry, u64 bitmap,
+				  u64 offset)
+{
+	u64 clust_off, len;
+	struct iovec iov;
+	int r;
+
+	for (clust_off = 0; clust_off < q->cluster_size; clust_off += len) {
+		len = q->cluster_size - clust_off;
+		switch (qcow2_entry_state(q, entry, bitmap, clust_off, &len)) {
+		case QCOW2_SC_ALLOCATED:
+			r = pread_in_full(q->fd, q->copy_buff + clust_off, len,
+					  (entry & QCOW2_OFFSET_MASK) + clust_off);
+			break;
+		case QCOW2_SC_UNALLOCATED:
+			if (q->backing) {
+				iov.iov_base = q->copy_buff + clust_off;
+				iov.iov_len = len;
+				r = qcow_read_backing(q, offset + clust_off,
+						      &iov, 1, len);
+				break;
+			}
+			/* fall through */
+		default:
+			memset(q->copy_buff + clust_off, 0, len);
+			r = 0;
+		}
+
+		if (r < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Grow a write in place of 'len' bytes from 'clust_off' in the cluster at
+ * 'l2t_idx' of the slice, which is ours and starts at 'clust_start' on the
+ * host, over the clusters after it in the slice that are ours too, next on
+ * the host and allocated as far as the write goes. Up to 'src_len' bytes.
+ * Called with the mutex held.
+ */
+static u64 qcow_copied_run(struct qcow *q, struct qcow_l2_table *l2t,
+			   u64 l2t_idx, u64 clust_start, u64 clust_off,
+			   u64 len, u64 src_len)
+{
+	u64 mask, bitmap, n, i;
+	u64 *e;
+
+	if (clust_off + len < q->cluster_size)
+		return len;
+
+	for (i = 1; len < src_len && l2t_idx + i < q->l2_slice_size; i++) {
+		e = l2_slice_entry(q, l2t, l2t_idx + i);
+		n = min(src_len - len, q->cluster_size);
+		clust_start += q->cluster_size;
+
+		/* Zero flags of version 3 entries fail this too */
+		if (be64_to_cpu(e[0]) != (clust_start | QCOW2_OFLAG_COPIED))
+			break;
+
+		if (q->extended_l2) {
+			mask = qcow2_subcluster_mask(q, 0, n);
+			bitmap = be64_to_cpu(e[1]);
+			if ((bitmap & mask) != mask)
+				break;
+		}
+
+		len += n;
+	}
+
+	return len;
+}
+
 /*
  * If the cluster has been copied, write data directly. If not,
  * read the original data and write it to the new cluster with
- * modification.
+ * modification. Writes 'src_len' bytes at most, from 'skip' bytes
+ * into 'iov', and returns how many were written.
  */
 static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
-		void *buf, u32 src_len)
+		const struct iovec *iov, int iovcount, size_t skip, u64 src_len)
 {
+	struct iovec vec[QCOW_MAX_IOVS];
 	struct qcow_l2_table *l2t;
 	u64 clust_new_start;
 	u64 clust_start;
 	u64 clust_flags;
 	u64 clust_off;
 	u64 l2t_idx;
+	u64 entry, bitmap, mask;
+	ssize_t nr;
 	u64 len;
+	u64 *e;
+	int i, n;
 
 	l2t = NULL;
 
@@ -998,67 +2334,118 @@ static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
 		goto error;
 	}
 
-	clust_start = be64_to_cpu(l2t->table[l2t_idx]);
-	clust_flags = clust_start & QCOW2_OFLAGS_MASK;
+	e = l2_slice_entry(q, l2t, l2t_idx);
+	entry = be64_to_cpu(e[0]);
+	bitmap = q->extended_l2 ? be64_to_cpu(e[1]) : 0;
+	if (!(entry & ~QCOW2_OFLAG_ZERO)) {
+		nr = qcow_write_new_clusters(q, l2t, l2t_idx, offset, clust_off,
+					     iov, iovcount, skip, src_len);
+		mutex_unlock(&q->mutex);
+		return nr;
+	}
 
-	clust_start &= QCOW2_OFFSET_MASK;
-	if (!(clust_flags & QCOW2_OFLAG_COPIED)) {
-		clust_new_start	= qcow_alloc_clusters(q, q->cluster_size, 1);
-		if (clust_new_start != (u64)-1) {
-			pr_warning("Cluster alloc error");
-			goto error;
-		}
+	clust_flags = entry & QCOW2_OFLAGS_MASK;
+	clust_start = entry & QCOW2_OFFSET_MASK;
 
-		offset &= ~(q->cluster_size - 1);
+	/* A preallocated zero cluster, the bit is offset in compressed ones */
+	if (!q->extended_l2 && !(clust_flags & QCOW2_OFLAG_COMPRESSED) &&
+	    (clust_start & QCOW2_OFLAG_ZERO)) {
+		clust_flags |= QCOW2_OFLAG_ZERO;
+		clust_start &= ~QCOW2_OFLAG_ZERO;
+	}
 
-		/* if clust_start is not zero, read the original data*/
-		if (clust_start) {
-			mutex_unlock(&q->mutex);
-			if (qcow2_read_cluster(q, offset, q->copy_buff,
-				q->cluster_size) < 0) {
-				pr_warning("Read copy cluster error");
-				qcow_free_clusters(q, clust_new_start,
-					q->cluster_size);
-				return -1;
-			}
-			mutex_lock(&q->mutex);
-		} else
-			memset(q->copy_buff, 0x00, q->cluster_size);
+	n = qcow_iov_slice(vec + 1, QCOW_MAX_IOVS - 2, iov, iovcount,
+			   skip, &len);
 
-		memcpy(q->copy_buff + clust_off, buf, len);
+	if (!clust_start && !(clust_flags & QCOW2_OFLAG_COMPRESSED)) {
+		pr_warning("Corrupt L2 entry at offset %llu",
+			   (unsigned long long)offset);
+		goto error;
+	}
 
-		 /* Write actual data */
-		if (pwrite_in_full(q->fd, q->copy_buff, q->cluster_size,
-			clust_new_start) < 0)
-			goto free_cluster;
+	/* Subclusters written to for the first time get allocated */
+	mask = q->extended_l2 ?
+	       qcow2_subcluster_mask(q, clust_off, clust_off + len) : 0;
 
-		/* update l2 table*/
-		l2t->table[l2t_idx] = cpu_to_be64(clust_new_start
-			| QCOW2_OFLAG_COPIED);
-		l2t->dirty = 1;
+	if (clust_flags == QCOW2_OFLAG_COPIED && (bitmap & mask) == mask) {
+		/* Clusters of ours next on the host take their part too */
+		len = qcow_copied_run(q, l2t, l2t_idx, clust_start, clust_off,
+				      len, src_len);
+		n = qcow_iov_slice(vec + 1, QCOW_MAX_IOVS - 2, iov, iovcount,
+				   skip, &len);
 
-		if (qcow_l2_cache_write(q, l2t))
-			goto free_cluster;
+		/* Only copy-on-write moves a cluster, and these are ours */
+		mutex_unlock(&q->mutex);
+
+		/* Write actual data */
+		if (pwritev_in_full(q->fd, vec + 1, n,
+				    clust_start + clust_off) < 0)
+			return -1;
 
-		/* free old cluster*/
-		if (clust_flags & QCOW2_OFLAG_COMPRESSED) {
-			int size;
-			size = ((clust_start >> q->csize_shift) &
-				q->csize_mask) + 1;
-			size *= 512;
-			clust_start &= q->cluster_offset_mask;
-			clust_start &= ~511;
+		return len;
+	}
 
-			qcow_free_clusters(q, clust_start, size);
-		} else if (clust_start)
-			qcow_free_clusters(q, clust_start, q->cluster_size);
+	if (clust_flags & QCOW2_OFLAG_COPIED) {
+		nr = qcow_write_gaps(q, l2t, l2t_idx, offset, clust_start,
+				     clust_off, vec, n, len);
+		mutex_unlock(&q->mutex);
+		return nr;
+	}
 
-	} else {
-		/* Write actual data */
-		if (pwrite_in_full(q->fd, buf, len,
-			clust_start + clust_off) < 0)
+	/* read the original data */
+	if (clust_flags & QCOW2_OFLAG_COMPRESSED) {
+		if (qcow2_decompress_cluster(q, clust_start, q->copy_buff,
+					     q->cluster_data) < 0) {
+			pr_warning("Read copy cluster error");
 			goto error;
+		}
+	} else if (qcow2_read_cow_cluster(q, entry, bitmap,
+					  offset - clust_off) < 0) {
+		pr_warning("Read copy cluster error");
+		goto error;
 	}
+
+	offset = clust_off;
+	for (i = 1; i <= n; i++) {
+		memcpy(q->copy_buff + offset, vec[i].iov_base, vec[i].iov_len);
+		offset += vec[i].iov_len;
+	}
+
+	clust_new_start	= qcow_alloc_clusters(q, q->cluster_size, 1);
+	if (clust_new_start == (u64)-1) {
+		pr_warning("Cluster alloc error");
+		goto error;
+	}
+
+	 /* Write actual data */
+	if (pwrite_in_full(q->fd, q->copy_buff, q->cluster_size,
+		clust_new_start) < 0)
+		goto free_cluster;
+
+	/* update l2 table*/
+	write_seqcount_begin(&q->seq);
+	if (q->extended_l2)
+		e[1] = cpu_to_be64(QCOW2_SC_ALLOC_MASK);
+	e[0] = cpu_to_be64(clust_new_start | QCOW2_OFLAG_COPIED);
+	write_seqcount_end(&q->seq);
+	l2t->dirty = 1;
+
+	/* free old cluster*/
+	if (clust_flags & QCOW2_OFLAG_COMPRESSED) {
+		int size;
+
+		cluster_cache_drop(q, clust_start | clust_flags);
+
+		size = ((clust_start >> q->csize_shift) &
+			q->csize_mask) + 1;
+		size *= 512;
+		clust_start &= q->cluster_offset_mask;
+		clust_start &= ~511;
+
+		qcow_free_clusters(q, clust_start, size);
+	} else
+		qcow_free_clusters(q, clust_start, q->cluster_size);
+
 	mutex_unlock(&q->mutex);
 	return len;
 
@@ -1070,91 +2457,194 @@ error:
 	return -1;
 }
 
-static ssize_t qcow_write_sector_single(struct disk_image *disk, u64 sector, void *src, u32 src_len)
+static ssize_t qcow_write_sector(struct disk_image *disk, u64 sector,
+				const struct iovec *iov, int iovcount, void *param)
 {
 	struct qcow *q = disk->priv;
 	struct qcow_header *header = q->header;
-	u32 nr_written;
-	char *buf;
-	u64 offset;
-	ssize_t nr;
+	ssize_t nr, total = 0;
+	size_t skip = 0;
+	u64 offset, len;
+	int i;
 
-	buf		= src;
-	nr_written	= 0;
-	offset		= sector << SECTOR_SHIFT;
+	len = 0;
+	for (i = 0; i < iovcount; i++)
+		len += iov[i].iov_len;
 
-	while (nr_written < src_len) {
-		if (offset >= header->size)
-			return -1;
+	offset = sector << SECTOR_SHIFT;
+	if (offset + len > header->size)
+		return -1;
 
-		nr = qcow_write_cluster(q, offset, buf, src_len - nr_written);
-		if (nr < 0)
+	while (len) {
+		nr = qcow_write_cluster(q, offset, iov, iovcount, skip, len);
+		if (nr <= 0) {
+			pr_info("qcow_write_sector error: nr=%ld offset=%llu\n",
+				(long)nr, (unsigned long long)offset);
 			return -1;
+		}
+
+		offset	+= nr;
+		total	+= nr;
+		len	-= nr;
+
+		/* Skip what the cluster took */
+		skip	+= nr;
+		while (iovcount && skip >= iov->iov_len) {
+			skip -= iov->iov_len;
+			iov++;
+			iovcount--;
+		}
+	}
+
+	return total;
+}
+
+/*
+ * Zero the part of the range 'offset' and '*len' starts with that fits in
+ * one cluster, by its L2 entry alone. Version 3 images say clusters, or
+ * subclusters, read as zeroes. Unallocated ones without a backing image do
+ * already. Returns 0, and trims '*len' to what the caller has to write
+ * zeroes to, when the entry can't help.
+ */
+static int qcow_zero_cluster(struct qcow *q, u64 offset, u64 *len, bool unmap)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	u64 clust_off = get_cluster_offset(q, offset);
+	u64 unit = qcow_alloc_size(q);
+	bool zero_flag = q->header->version >= QCOW3_VERSION;
+	struct qcow_l2_table *l2t;
+	u64 entry, bitmap, mask;
+	u64 clust_start;
+	u64 l2t_idx;
+	u64 n;
+	u64 *e;
+	int r = 1;
+
+	n = min(*len, q->cluster_size - clust_off);
+	if (clust_off & (unit - 1)) {
+		*len = min(n, ALIGN(clust_off, unit) - clust_off);
+		return 0;
+	}
+	if (n < unit) {
+		*len = n;
+		return 0;
+	}
+	*len = n &= ~(unit - 1);
+
+	mutex_lock(&q->mutex);
+
+	if (!l1t->l1_table[get_l1_index(q, offset)] && !q->backing)
+		goto out;
+
+	if (!zero_flag && q->backing)
+		goto write;
 
-		nr_written	+= nr;
-		buf		+= nr;
-		offset		+= nr;
+	if (get_cluster_table(q, offset, &l2t, &l2t_idx) < 0) {
+		r = -1;
+		goto out;
 	}
 
-	return nr_written;
-}
+	e = l2_slice_entry(q, l2t, l2t_idx);
+	entry = be64_to_cpu(e[0]);
+	bitmap = q->extended_l2 ? be64_to_cpu(e[1]) : 0;
+	clust_start = entry & QCOW2_OFFSET_MASK & ~QCOW2_OFLAG_ZERO;
 
-static ssize_t qcow_write_sector(struct disk_image *disk, u64 sector,
-				const struct iovec *iov, int iovcount, void *param)
-{
-	ssize_t nr, total = 0;
+	if (!entry && !q->backing)
+		goto out;
 
-	while (iovcount--) {
-		nr = qcow_write_sector_single(disk, sector, iov->iov_base, iov->iov_len);
-		if (nr != (ssize_t)iov->iov_len) {
-			pr_info("qcow_write_sector error: nr=%ld iov_len=%ld\n", (long)nr, (long)iov->iov_len);
-			return -1;
+	if (!zero_flag)
+		goto write;
+
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		/* Compressed clusters only go whole */
+		if (n < q->cluster_size)
+			goto write;
+
+		write_seqcount_begin(&q->seq);
+		if (q->extended_l2) {
+			e[0] = 0;
+			e[1] = cpu_to_be64(QCOW2_SC_ALLOC_MASK <<
+					   QCOW2_SC_ZERO_SHIFT);
+		} else {
+			e[0] = cpu_to_be64(QCOW2_OFLAG_ZERO);
 		}
+		write_seqcount_end(&q->seq);
+		l2t->dirty = 1;
 
-		sector	+= iov->iov_len >> SECTOR_SHIFT;
-		iov++;
-		total	+= nr;
+		cluster_cache_drop(q, entry);
+		n = (((entry >> q->csize_shift) & q->csize_mask) + 1) *
+		    SECTOR_SIZE;
+		qcow_free_clusters(q, (entry & q->cluster_offset_mask) &
+				   ~(SECTOR_SIZE - 1), n);
+		goto out;
 	}
 
-	return total;
+	/* Allocated clusters stay so, only their space may go back */
+	write_seqcount_begin(&q->seq);
+	if (q->extended_l2) {
+		mask = qcow2_subcluster_mask(q, clust_off, clust_off + n);
+		e[1] = cpu_to_be64((bitmap & ~mask) |
+				   (mask << QCOW2_SC_ZERO_SHIFT));
+	} else {
+		e[0] = cpu_to_be64(entry | QCOW2_OFLAG_ZERO);
+	}
+	write_seqcount_end(&q->seq);
+	l2t->dirty = 1;
+
+	if (unmap && clust_start && (entry & QCOW2_OFLAG_COPIED))
+		fallocate(q->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  clust_start + clust_off, n);
+out:
+	mutex_unlock(&q->mutex);
+	return r;
+
+write:
+	mutex_unlock(&q->mutex);
+	return 0;
 }
 
 static int qcow_disk_flush(struct disk_image *disk)
 {
 	struct qcow *q = disk->priv;
-	struct qcow_refcount_table *rft;
-	struct list_head *pos, *n;
-	struct qcow_l1_table *l1t;
-
-	l1t = &q->table;
-	rft = &q->refcount_table;
+	int r;
 
 	mutex_lock(&q->mutex);
+	r = qcow_flush_metadata(q);
+	mutex_unlock(&q->mutex);
 
-	list_for_each_safe(pos, n, &rft->lru_list) {
-		struct qcow_refcount_block *c = list_entry(pos, struct qcow_refcount_block, list);
-
-		if (write_refcount_block(q, c) < 0)
-			goto error_unlock;
-	}
+	return r;
+}
 
-	list_for_each_safe(pos, n, &l1t->lru_list) {
-		struct qcow_l2_table *c = list_entry(pos, struct qcow_l2_table, list);
+static ssize_t qcow_write_zeroes(struct disk_image *disk, u64 sector, u64 len,
+				 bool unmap)
+{
+	struct qcow *q = disk->priv;
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 done, n;
+	struct iovec iov;
+	int r;
 
-		if (qcow_l2_cache_write(q, c) < 0)
-			goto error_unlock;
-	}
+	if (offset + len > q->header->size)
+		return -1;
 
-	if (qcow_write_l1_table < 0)
-		goto error_unlock;
+	for (done = 0; done < len; done += n) {
+		n = len - done;
+		r = qcow_zero_cluster(q, offset + done, &n, unmap);
+		if (r < 0)
+			return -1;
+		if (r)
+			continue;
 
-	mutex_unlock(&q->mutex);
+		iov = (struct iovec) { .iov_base = q->zero_cluster, .iov_len = n };
+		if (qcow_write_cluster(q, offset + done, &iov, 1, 0, n) !=
+		    (ssize_t)n)
+			return -1;
+	}
 
-	return fsync(disk->fd);
+	if (disk->writethrough && qcow_disk_flush(disk) < 0)
+		return -1;
 
-error_unlock:
-	mutex_unlock(&q->mutex);
-	return -1;
+	return len;
 }
 
 static int qcow_disk_close(struct disk_image *disk)
@@ -1166,29 +2656,167 @@ static int qcow_disk_close(struct disk_image *disk)
 
 	q = disk->priv;
 
+	if (disk->ops->flush) {
+		if (qcow_disk_flush(disk) < 0)
+			pr_warning("Unable to write back QCOW metadata");
+		else if (qcow_mark_clean(q) < 0)
+			pr_warning("Unable to mark QCOW image clean");
+	}
+
 	refcount_table_free_cache(&q->refcount_table);
 	l1_table_free_cache(&q->table);
+	qcow_cluster_cache_free(q);
+	if (q->backing)
+		disk_backing_close(q->backing);
+	free(q->zero_cluster);
 	free(q->copy_buff);
 	free(q->cluster_data);
-	free(q->cluster_cache);
+	free(q->used_map);
+	free(q->used_loaded);
 	free(q->refcount_table.rf_table);
 	free(q->table.l1_table);
 	free(q->header);
 	free(q);
 
+	if (close(disk->fd) < 0)
+		pr_warning("close() failed");
+
+	free(disk);
+
 	return 0;
 }
 
+#if defined(CONFIG_HAS_AIO) || defined(CONFIG_HAS_IO_URING)
+/*
+ * How many of the 'len' bytes at 'offset' the cached L2 entries map to
+ * one run of host bytes, starting at '*host', in clusters of our own that
+ * are allocated all through. Only copy-on-write moves a cluster, and those
+ * never need it: the run can be handed to the async engine as it is.
+ */
+static u64 qcow_map_cached(struct qcow *q, u64 offset, u64 len, u64 *host)
+{
+	u64 entry, bitmap, start;
+	u64 clust_off;
+	u64 done, n;
+
+	for (done = 0; done < len; done += n) {
+		clust_off = get_cluster_offset(q, offset + done);
+		n = min(len - done, q->cluster_size - clust_off);
+
+		if (!qcow_lookup_cached(q, offset + done, &entry, &bitmap))
+			break;
+
+		if ((entry & QCOW2_OFLAGS_MASK) != QCOW2_OFLAG_COPIED ||
+		    qcow2_entry_state(q, entry, bitmap, clust_off, &n) !=
+		    QCOW2_SC_ALLOCATED)
+			break;
+
+		start = (entry & QCOW2_OFFSET_MASK) + clust_off;
+		if (!done)
+			*host = start;
+		else if (start != *host + done)
+			break;
+	}
+
+	return done;
+}
+
+/*
+ * Data the cached tables map in one piece goes straight to the async
+ * engine, which completes it. The rest needs metadata work first and goes
+ * to a worker: the L2 slices it reads on the way stay cached, and the
+ * requests after it needn't.
+ */
+static ssize_t qcow_submit_async(struct disk_image *disk, u64 sector,
+				 const struct iovec *iov, int iovcount,
+				 void *param, bool write)
+{
+	struct qcow *q = disk->priv;
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 host = 0, len = 0;
+	ssize_t r;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		len += iov[i].iov_len;
+
+	if (offset + len <= q->header->size &&
+	    qcow_map_cached(q, offset, len, &host) == len) {
+		if (write)
+			r = raw_image__write_async(disk, host >> SECTOR_SHIFT,
+						   iov, iovcount, param);
+		else
+			r = raw_image__read_async(disk, host >> SECTOR_SHIFT,
+						  iov, iovcount, param);
+		if (r > 0)
+			return r;
+	}
+
+	if (disk->wq && !disk_worker_submit(disk, sector, iov, iovcount,
+					    param, write))
+		return 0;
+
+	/* disk_image__read/write() only complete synchronous disks for us */
+	if (write)
+		r = disk_image__writethrough(disk,
+			qcow_write_sector(disk, sector, iov, iovcount, param));
+	else
+		r = qcow_read_sector(disk, sector, iov, iovcount, param);
+
+	if (disk->disk_req_cb)
+		disk->disk_req_cb(param, r);
+
+	return r;
+}
+
+static ssize_t qcow_read_async(struct disk_image *disk, u64 sector,
+			       const struct iovec *iov, int iovcount,
+			       void *param)
+{
+	return qcow_submit_async(disk, sector, iov, iovcount, param, false);
+}
+
+static ssize_t qcow_write_async(struct disk_image *disk, u64 sector,
+				const struct iovec *iov, int iovcount,
+				void *param)
+{
+	return qcow_submit_async(disk, sector, iov, iovcount, param, true);
+}
+#endif /* CONFIG_HAS_AIO || CONFIG_HAS_IO_URING */
+
 static struct disk_image_operations qcow_disk_readonly_ops = {
 	.read	= qcow_read_sector,
 	.close	= qcow_disk_close,
 };
 
+#if defined(CONFIG_HAS_AIO) || defined(CONFIG_HAS_IO_URING)
+/* Version 1 entries don't say which clusters are ours, qcow2 ones do */
+static struct disk_image_operations qcow2_disk_readonly_ops = {
+	.read		= qcow_read_async,
+	.read_sync	= qcow_read_sector,
+	.wait		= raw_image__wait,
+	.close		= qcow_disk_close,
+	.async		= true,
+};
+#else
+#define qcow2_disk_readonly_ops	qcow_disk_readonly_ops
+#endif
+
 static struct disk_image_operations qcow_disk_ops = {
+#if defined(CONFIG_HAS_AIO) || defined(CONFIG_HAS_IO_URING)
+	.read		= qcow_read_async,
+	.write		= qcow_write_async,
+	.read_sync	= qcow_read_sector,
+	.write_sync	= qcow_write_sector,
+	.wait		= raw_image__wait,
+	.async		= true,
+#else
 	.read	= qcow_read_sector,
 	.write	= qcow_write_sector,
+#endif
 	.flush	= qcow_disk_flush,
 	.close	= qcow_disk_close,
+	.write_zeroes	= qcow_write_zeroes,
 };
 
 static int qcow_read_refcount_table(struct qcow *q)
@@ -1205,6 +2833,7 @@ static int qcow_read_refcount_table(struct qcow *q)
 
 	rft->root = (struct rb_root) RB_ROOT;
 	INIT_LIST_HEAD(&rft->lru_list);
+	INIT_LIST_HEAD(&rft->free_list);
 
 	return pread_in_full(q->fd, rft->rf_table, sizeof(u64) * rft->rf_size, header->refcount_table_offset);
 }
@@ -1232,6 +2861,182 @@ static int qcow_read_l1_table(struct qcow *q)
 	return pread_in_full(q->fd, table->l1_table, sizeof(u64) * table->table_size, header->l1_table_offset);
 }
 
+/* Count a reference to each cluster in the range, which must be in the file */
+static int qcow_count_refs(struct qcow *q, u16 *counts, u64 nr_clusters,
+			   u64 offset, u64 size)
+{
+	u64 start = offset >> q->header->cluster_bits;
+	u64 end = (offset + size - 1) >> q->header->cluster_bits;
+
+	if (!size)
+		return 0;
+
+	if (end >= nr_clusters) {
+		pr_warning("QCOW2 metadata points past the end of the image: %llu",
+			   (unsigned long long)offset);
+		return -1;
+	}
+
+	for (; start <= end; start++)
+		counts[start]++;
+
+	return 0;
+}
+
+static int qcow2_count_l2_refs(struct qcow *q, u16 *counts, u64 nr_clusters,
+			       u64 l2t_offset)
+{
+	u64 l2t_size = 1ULL << q->header->l2_bits;
+	u64 *l2t = q->copy_buff;
+	u64 entry, coffset;
+	u64 i;
+
+	if (pread_in_full(q->fd, l2t, q->cluster_size, l2t_offset) < 0)
+		return -1;
+
+	for (i = 0; i < l2t_size; i++) {
+		entry = be64_to_cpu(l2t[i << q->extended_l2]);
+		if (entry & QCOW2_OFLAG_COMPRESSED) {
+			coffset = entry & q->cluster_offset_mask;
+			if (qcow_count_refs(q, counts, nr_clusters,
+					coffset & ~(SECTOR_SIZE - 1),
+					(((entry >> q->csize_shift) &
+					  q->csize_mask) + 1) * SECTOR_SIZE) < 0)
+				return -1;
+			continue;
+		}
+
+		entry &= QCOW2_OFFSET_MASK & ~QCOW2_OFLAG_ZERO;
+		if (entry && qcow_count_refs(q, counts, nr_clusters, entry,
+					     q->cluster_size) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Set a cluster's refcount, only raising or only lowering it. Returns 1 if
+ * it had to change.
+ */
+static int qcow_fix_refcount(struct qcow *q, u64 clust_idx, u16 refcount,
+			     bool raise)
+{
+	u16 old = qcow_get_refcount(q, clust_idx);
+
+	if (old == (u16)-1)
+		return -1;
+
+	if (raise ? old >= refcount : old <= refcount)
+		return 0;
+
+	if (update_cluster_refcount(q, clust_idx, refcount - old) < 0)
+		return -1;
+
+	return 1;
+}
+
+/*
+ * Refcounts of an image left dirty may be anything: count the references
+ * the metadata holds and make them agree. Overcounted clusters are leaks
+ * and get freed, undercounted ones would have been handed out twice.
+ * Clusters past the end of the file keep no refcount either. Images with
+ * snapshots share clusters, and are not repaired.
+ */
+static int qcow2_repair_refcounts(struct qcow *q)
+{
+	struct qcow_header *header = q->header;
+	struct qcow_refcount_table *rft = &q->refcount_table;
+	struct qcow_l1_table *l1t = &q->table;
+	u64 nr_clusters, per_block, clust_idx, offset;
+	u64 nr_fixed = 0;
+	struct stat st;
+	u16 *counts;
+	int r = -1;
+	int pass;
+	u64 i;
+
+	if (fstat(q->fd, &st) < 0)
+		return -1;
+
+	nr_clusters = DIV_ROUND_UP((u64)st.st_size, q->cluster_size);
+	counts = calloc(nr_clusters ? nr_clusters : 1, sizeof(u16));
+	if (!counts)
+		return -1;
+
+	/* The header, with its extensions and the backing file name */
+	if (qcow_count_refs(q, counts, nr_clusters, 0, q->cluster_size) < 0 ||
+	    qcow_count_refs(q, counts, nr_clusters, header->l1_table_offset,
+			    l1t->table_size * sizeof(u64)) < 0 ||
+	    qcow_count_refs(q, counts, nr_clusters,
+			    header->refcount_table_offset,
+			    (u64)header->refcount_table_size * q->cluster_size) < 0)
+		goto out;
+
+	for (i = 0; i < rft->rf_size; i++) {
+		offset = be64_to_cpu(rft->rf_table[i]);
+		if (offset && qcow_count_refs(q, counts, nr_clusters, offset,
+					      q->cluster_size) < 0)
+			goto out;
+	}
+
+	for (i = 0; i < l1t->table_size; i++) {
+		offset = be64_to_cpu(l1t->l1_table[i]) & QCOW2_OFFSET_MASK;
+		if (!offset)
+			continue;
+
+		if (qcow_count_refs(q, counts, nr_clusters, offset,
+				    q->cluster_size) < 0 ||
+		    qcow2_count_l2_refs(q, counts, nr_clusters, offset) < 0)
+			goto out;
+	}
+
+	/*
+	 * Clusters past the end first: they are only ever lowered, and are
+	 * then free for the blocks the table may have to grow below.
+	 */
+	per_block = 1ULL << (header->cluster_bits - QCOW_REFCOUNT_BLOCK_SHIFT);
+	for (i = 0; i < rft->rf_size; i++) {
+		if (!rft->rf_table[i])
+			continue;
+
+		clust_idx = max(nr_clusters, i * per_block);
+		for (; clust_idx < (i + 1) * per_block; clust_idx++) {
+			r = qcow_fix_refcount(q, clust_idx, 0, false);
+			if (r < 0)
+				goto out;
+			nr_fixed += r;
+		}
+	}
+
+	/*
+	 * Raise the refcounts before lowering any, so that no cluster yet to
+	 * be accounted for looks free to an allocation.
+	 */
+	q->free_clust_idx = nr_clusters;
+	for (pass = 0; pass < 2; pass++) {
+		for (clust_idx = 0; clust_idx < nr_clusters; clust_idx++) {
+			r = qcow_fix_refcount(q, clust_idx, counts[clust_idx],
+					      !pass);
+			if (r < 0)
+				goto out;
+			nr_fixed += r;
+		}
+	}
+
+	r = -1;
+	if (qcow_flush_metadata(q) < 0 || qcow_mark_clean(q) < 0)
+		goto out;
+
+	pr_info("QCOW2 image was not closed cleanly, %llu refcounts repaired",
+		(unsigned long long)nr_fixed);
+	r = 0;
+out:
+	q->free_clust_idx = 0;
+	free(counts);
+	return r;
+}
+
 static void *qcow2_read_header(int fd)
 {
 	struct qcow2_header_disk f_header;
@@ -1260,23 +3065,200 @@ static void *qcow2_read_header(int fd)
 	be32_to_cpus(&f_header.nb_snapshots);
 	be64_to_cpus(&f_header.snapshots_offset);
 
+	if (f_header.version == QCOW2_VERSION) {
+		f_header.incompatible_features	= 0;
+		f_header.compatible_features	= 0;
+		f_header.autoclear_features	= 0;
+		f_header.refcount_order		= 4;
+		f_header.header_length		= 72;
+	} else {
+		be64_to_cpus(&f_header.incompatible_features);
+		be64_to_cpus(&f_header.compatible_features);
+		be64_to_cpus(&f_header.autoclear_features);
+		be32_to_cpus(&f_header.refcount_order);
+		be32_to_cpus(&f_header.header_length);
+	}
+
+	if (f_header.header_length <= offsetof(struct qcow2_header_disk,
+					       compression_type))
+		f_header.compression_type = QCOW2_COMPRESSION_ZLIB;
+
 	*header		= (struct qcow_header) {
+		.version		= f_header.version,
 		.size			= f_header.size,
+		.backing_file_offset	= f_header.backing_file_offset,
+		.backing_file_size	= f_header.backing_file_size,
 		.l1_table_offset	= f_header.l1_table_offset,
 		.l1_size		= f_header.l1_size,
 		.cluster_bits		= f_header.cluster_bits,
-		.l2_bits		= f_header.cluster_bits - 3,
+		/* Extended entries are twice the size */
+		.l2_bits		= f_header.cluster_bits - 3 -
+			!!(f_header.incompatible_features & QCOW2_INCOMPAT_EXTL2),
 		.refcount_table_offset	= f_header.refcount_table_offset,
 		.refcount_table_size	= f_header.refcount_table_clusters,
+		.nb_snapshots		= f_header.nb_snapshots,
+		.header_length		= f_header.header_length,
+		.incompatible_features	= f_header.incompatible_features,
+		.compatible_features	= f_header.compatible_features,
+		.autoclear_features	= f_header.autoclear_features,
+		.refcount_order		= f_header.refcount_order,
+		.compression_type	= f_header.compression_type,
 	};
 
 	return header;
 }
 
-static struct disk_image *qcow2_probe(int fd, bool readonly)
+/* The format named in the header extensions, NULL if none is */
+static const char *qcow2_read_backing_format(struct qcow *q, char *buf,
+					     size_t size)
+{
+	u64 offset = q->header->header_length;
+	struct {
+		u32	type;
+		u32	len;
+	} ext;
+
+	while (offset + sizeof(ext) <= q->cluster_size) {
+		if (pread_in_full(q->fd, &ext, sizeof(ext), offset) < 0)
+			return NULL;
+
+		be32_to_cpus(&ext.type);
+		be32_to_cpus(&ext.len);
+		offset += sizeof(ext);
+
+		if (ext.type == QCOW2_EXT_END)
+			break;
+
+		if (ext.type == QCOW2_EXT_BACKING_FORMAT) {
+			if (ext.len >= size ||
+			    pread_in_full(q->fd, buf, ext.len, offset) < 0)
+				return NULL;
+			buf[ext.len] = '\0';
+			return buf;
+		}
+
+		offset += ALIGN(ext.len, 8);
+	}
+
+	return NULL;
+}
+
+/*
+ * Open the image the header names as backing file, that unallocated
+ * clusters are read from. A relative name is relative to the directory
+ * of the image itself.
+ */
+static int qcow2_open_backing(struct qcow *q, const char *filename)
+{
+	struct qcow_header *h = q->header;
+	char name[QCOW_BACKING_NAME_MAX + 1];
+	const char *format;
+	char buf[16];
+	char *path = NULL;
+	char *slash;
+
+	if (!h->backing_file_size || h->backing_file_size > QCOW_BACKING_NAME_MAX) {
+		pr_warning("QCOW2 backing file name is invalid");
+		return -1;
+	}
+
+	if (pread_in_full(q->fd, name, h->backing_file_size,
+			  h->backing_file_offset) < 0)
+		return -1;
+	name[h->backing_file_size] = '\0';
+
+	slash = filename ? strrchr(filename, '/') : NULL;
+	if (name[0] != '/' && slash &&
+	    asprintf(&path, "%.*s/%s", (int)(slash - filename), filename,
+		     name) < 0)
+		return -1;
+
+	format = qcow2_read_backing_format(q, buf, sizeof(buf));
+
+	q->backing = disk_backing_open(path ? path : name, format);
+	free(path);
+	if (IS_ERR_OR_NULL(q->backing)) {
+		pr_warning("Unable to open backing file '%s'", name);
+		q->backing = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Version 3 images may carry features that change how they are read: those
+ * unknown here turn the image down. Those that only stand in the way of
+ * keeping it consistent make it read-only.
+ */
+static int qcow2_check_features(struct qcow *q, bool *readonly)
+{
+	struct qcow_header *h = q->header;
+	u64 unknown = h->incompatible_features & ~QCOW2_INCOMPAT_SUPPORTED;
+	u64 zero = 0;
+
+	if (unknown) {
+		pr_warning("QCOW2 image has unsupported features 0x%llx",
+			   (unsigned long long)unknown);
+		return -1;
+	}
+
+	if ((h->incompatible_features & QCOW2_INCOMPAT_EXTL2) &&
+	    h->cluster_bits < QCOW2_EXTL2_MIN_CLUSTER_BITS) {
+		pr_warning("QCOW2 subclusters of %u bytes are not supported",
+			   (1U << h->cluster_bits) / QCOW2_SUBCLUSTERS);
+		return -1;
+	}
+
+	switch (h->compression_type) {
+	case QCOW2_COMPRESSION_ZLIB:
+		break;
+	case QCOW2_COMPRESSION_ZSTD:
+#ifndef CONFIG_HAS_ZSTD
+		pr_warning("Built without zstd, compressed clusters can't be read");
+#endif
+		break;
+	default:
+		pr_warning("QCOW2 compression type %u is not supported",
+			   h->compression_type);
+		return -1;
+	}
+
+	if (*readonly)
+		return 0;
+
+	if (h->incompatible_features & QCOW2_INCOMPAT_CORRUPT) {
+		pr_warning("QCOW2 image is marked corrupt, opening it read-only");
+		*readonly = true;
+	} else if (h->refcount_order != 4) {
+		pr_warning("QCOW2 images with %u-bit refcounts are read-only",
+			   1U << h->refcount_order);
+		*readonly = true;
+	} else if ((h->incompatible_features & QCOW2_INCOMPAT_DIRTY) &&
+		   h->nb_snapshots) {
+		pr_warning("QCOW2 image refcounts may be stale, opening it read-only");
+		*readonly = true;
+	} else if (h->autoclear_features) {
+		/* Whatever they vouch for won't hold once written to */
+		if (pwrite_in_full(q->fd, &zero, sizeof(zero),
+				   offsetof(struct qcow2_header_disk,
+					    autoclear_features)) < 0)
+			return -1;
+		h->autoclear_features = 0;
+	}
+
+	if (!*readonly)
+		q->lazy_refcounts = h->compatible_features &
+				    QCOW2_COMPAT_LAZY_REFCOUNTS;
+
+	return 0;
+}
+
+static struct disk_image *qcow2_probe(const char *filename, int fd,
+				      bool readonly, u64 l2_cache_size,
+				      u64 cluster_cache_size, bool backing)
 {
 	struct disk_image *disk_image;
-	struct qcow_l1_table *l1t;
 	struct qcow_header *h;
 	struct qcow *q;
 
@@ -1285,13 +3267,9 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 		return NULL;
 
 	mutex_init(&q->mutex);
+	seqcount_init(&q->seq);
 	q->fd = fd;
 
-	l1t = &q->table;
-
-	l1t->root = (struct rb_root) RB_ROOT;
-	INIT_LIST_HEAD(&l1t->lru_list);
-
 	h = q->header = qcow2_read_header(fd);
 	if (!h)
 		goto free_qcow;
@@ -1302,6 +3280,24 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 	q->cluster_offset_mask = (1LL << q->csize_shift) - 1;
 	q->cluster_size = 1 << q->header->cluster_bits;
 
+	if (qcow2_check_features(q, &readonly) < 0)
+		goto free_header;
+
+	if (h->incompatible_features & QCOW2_INCOMPAT_EXTL2) {
+		q->extended_l2 = true;
+		q->subcluster_bits = h->cluster_bits - QCOW2_SUBCLUSTERS_SHIFT;
+	}
+
+	if (qcow_l2_cache_init(q, l2_cache_size) < 0) {
+		pr_warning("L2 cache malloc error");
+		goto free_header;
+	}
+
+	if (qcow_cluster_cache_init(q, cluster_cache_size) < 0) {
+		pr_warning("cluster cache malloc error");
+		goto free_header;
+	}
+
 	q->copy_buff = malloc(q->cluster_size);
 	if (!q->copy_buff) {
 		pr_warning("copy buff malloc error");
@@ -1314,42 +3310,65 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 		goto free_copy_buff;
 	}
 
-	q->cluster_cache = malloc(q->cluster_size);
-	if (!q->cluster_cache) {
-		pr_warning("cluster cache malloc error");
-		goto free_cluster_data;
+	/* Untouched, it costs no memory */
+	if (!readonly) {
+		q->zero_cluster = calloc(1, q->cluster_size);
+		if (!q->zero_cluster) {
+			pr_warning("zero cluster malloc error");
+			goto free_cluster_data;
+		}
 	}
 
 	if (qcow_read_l1_table(q) < 0)
-		goto free_cluster_cache;
+		goto free_zero_cluster;
 
 	if (qcow_read_refcount_table(q) < 0)
 		goto free_l1_table;
 
+	if (!readonly && (h->incompatible_features & QCOW2_INCOMPAT_DIRTY) &&
+	    qcow2_repair_refcounts(q) < 0) {
+		pr_warning("QCOW2 image refcounts can't be repaired, opening it read-only");
+		q->lazy_refcounts = false;
+		readonly = true;
+	}
+
+	if (h->backing_file_offset && qcow2_open_backing(q, filename) < 0)
+		goto free_refcount_table;
+
 	/*
-	 * Do not use mmap use read/write instead
+	 * Do not use mmap use read/write instead. Overlays read backing images
+	 * synchronously, they get no async engine.
 	 */
-	if (readonly)
+	if (backing)
 		disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
+	else if (readonly)
+		disk_image = disk_image__new(fd, h->size, &qcow2_disk_readonly_ops, DISK_IMAGE_REGULAR);
 	else
 		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
 
 	if (IS_ERR_OR_NULL(disk_image))
-		goto free_refcount_table;
+		goto close_backing;
 
 	disk_image->priv = q;
 
+	/* Zeroes mostly go to the L2 tables, no data is written */
+	if (!readonly)
+		disk_image->limits.max_write_zeroes_sectors =
+			DISK_DISCARD_MAX_SECTORS;
+
 	return disk_image;
 
+close_backing:
+	if (q->backing)
+		disk_backing_close(q->backing);
 free_refcount_table:
 	if (q->refcount_table.rf_table)
 		free(q->refcount_table.rf_table);
 free_l1_table:
 	if (q->table.l1_table)
 		free(q->table.l1_table);
-free_cluster_cache:
-	if (q->cluster_cache)
-		free(q->cluster_cache);
+free_zero_cluster:
+	free(q->zero_cluster);
 free_cluster_data:
 	if (q->cluster_data)
 		free(q->cluster_data);
@@ -1357,6 +3376,10 @@ free_copy_buff:
 	if (q->copy_buff)
 		free(q->copy_buff);
 free_header:
+	qcow_cluster_cache_free(q);
+	free(q->used_map);
+	free(q->used_loaded);
+	free(q->table.hash);
 	if (q->header)
 		free(q->header);
 free_qcow:
@@ -1378,7 +3401,8 @@ static bool qcow2_check_image(int fd)
 	if (f_header.magic != QCOW_MAGIC)
 		return false;
 
-	if (f_header.version != QCOW2_VERSION)
+	if (f_header.version != QCOW2_VERSION &&
+	    f_header.version != QCOW3_VERSION)
 		return false;
 
 	return true;
@@ -1408,6 +3432,7 @@ static void *qcow1_read_header(int fd)
 	be64_to_cpus(&f_header.l1_table_offset);
 
 	*header		= (struct qcow_header) {
+		.version		= f_header.version,
 		.size			= f_header.size,
 		.l1_table_offset	= f_header.l1_table_offset,
 		.l1_size		= f_header.size / ((1 << f_header.l2_bits) * (1 << f_header.cluster_bits)),
@@ -1418,10 +3443,10 @@ static void *qcow1_read_header(int fd)
 	return header;
 }
 
-static struct disk_image *qcow1_probe(int fd, bool readonly)
+static struct disk_image *qcow1_probe(int fd, bool readonly, u64 l2_cache_size,
+				      u64 cluster_cache_size)
 {
 	struct disk_image *disk_image;
-	struct qcow_l1_table *l1t;
 	struct qcow_header *h;
 	struct qcow *q;
 
@@ -1430,13 +3455,11 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 		return NULL;
 
 	mutex_init(&q->mutex);
+	seqcount_init(&q->seq);
 	q->fd = fd;
 
-	l1t = &q->table;
-
-	l1t->root = (struct rb_root)RB_ROOT;
-	INIT_LIST_HEAD(&l1t->lru_list);
 	INIT_LIST_HEAD(&q->refcount_table.lru_list);
+	INIT_LIST_HEAD(&q->refcount_table.free_list);
 
 	h = q->header = qcow1_read_header(fd);
 	if (!h)
@@ -1447,30 +3470,28 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 	q->cluster_offset_mask = (1LL << (63 - q->header->cluster_bits)) - 1;
 	q->free_clust_idx = 0;
 
-	q->cluster_data = malloc(q->cluster_size);
-	if (!q->cluster_data) {
-		pr_warning("cluster data malloc error");
+	if (qcow_l2_cache_init(q, l2_cache_size) < 0) {
+		pr_warning("L2 cache malloc error");
 		goto free_header;
 	}
 
-	q->cluster_cache = malloc(q->cluster_size);
-	if (!q->cluster_cache) {
+	if (qcow_cluster_cache_init(q, cluster_cache_size) < 0) {
 		pr_warning("cluster cache malloc error");
-		goto free_cluster_data;
+		goto free_header;
 	}
 
 	if (qcow_read_l1_table(q) < 0)
-		goto free_cluster_cache;
+		goto free_header;
+
+	/* No refcounts to allocate clusters with */
+	if (!readonly)
+		pr_warning("QCOW1 images are read-only");
 
 	/*
 	 * Do not use mmap use read/write instead
 	 */
-	if (readonly)
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
-	else
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
-
-	if (!disk_image)
+	disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
+	if (IS_ERR_OR_NULL(disk_image))
 		goto free_l1_table;
 
 	disk_image->priv = q;
@@ -1480,13 +3501,9 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 free_l1_table:
 	if (q->table.l1_table)
 		free(q->table.l1_table);
-free_cluster_cache:
-	if (q->cluster_cache)
-		free(q->cluster_cache);
-free_cluster_data:
-	if (q->cluster_data)
-		free(q->cluster_data);
 free_header:
+	qcow_cluster_cache_free(q);
+	free(q->table.hash);
 	if (q->header)
 		free(q->header);
 free_qcow:
@@ -1514,13 +3531,28 @@ static bool qcow1_check_image(int fd)
 	return true;
 }
 
-struct disk_image *qcow_probe(int fd, bool readonly)
+struct disk_image *qcow_probe(const char *filename, int fd, bool readonly,
+			      u64 l2_cache_size, u64 cluster_cache_size)
+{
+	if (qcow1_check_image(fd))
+		return qcow1_probe(fd, readonly, l2_cache_size,
+				   cluster_cache_size);
+
+	if (qcow2_check_image(fd))
+		return qcow2_probe(filename, fd, readonly, l2_cache_size,
+				   cluster_cache_size, false);
+
+	return NULL;
+}
+
+/* An image for overlays to read from, read-only and synchronous */
+struct disk_image *qcow_backing_probe(const char *filename, int fd)
 {
 	if (qcow1_check_image(fd))
-		return qcow1_probe(fd, readonly);
+		return qcow1_probe(fd, true, 0, 0);
 
 	if (qcow2_check_image(fd))
-		return qcow2_probe(fd, readonly);
+		return qcow2_probe(filename, fd, true, 0, 0, true);
 
 	return NULL;
 }
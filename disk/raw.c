@@ -1,6 +1,7 @@
 #include "kvm/disk-image.h"
 
 #include <linux/err.h>
+#include <linux/kernel.h>
 
 ssize_t raw_image__read_sync(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
@@ -8,19 +9,58 @@ ssize_t raw_image__read_sync(struct disk_image *disk, u64 sector, const struct i
 	return preadv_in_full(disk->fd, iov, iovcount, sector << SECTOR_SHIFT);
 }
 
+/*
+ * Writethrough: RWF_DSYNC makes the write itself durable. Kernels without
+ * it get a plain write followed by fdatasync().
+ */
+static ssize_t raw_image__write_dsync(struct disk_image *disk, u64 offset,
+				      const struct iovec *iov, int iovcount)
+{
+	ssize_t total;
+
+	total = pwritev2_in_full(disk->fd, iov, iovcount, offset, RWF_DSYNC);
+	if (total >= 0 || (errno != EOPNOTSUPP && errno != ENOSYS))
+		return total;
+
+	total = pwritev_in_full(disk->fd, iov, iovcount, offset);
+	if (total >= 0 && fdatasync(disk->fd) < 0)
+		return -1;
+
+	return total;
+}
+
 ssize_t raw_image__write_sync(struct disk_image *disk, u64 sector,
 			      const struct iovec *iov, int iovcount,
 			      void *param)
 {
+	if (disk->writethrough)
+		return raw_image__write_dsync(disk, sector << SECTOR_SHIFT,
+					      iov, iovcount);
+
 	return pwritev_in_full(disk->fd, iov, iovcount, sector << SECTOR_SHIFT);
 }
 
+static bool raw_image__mmap_in_range(struct disk_image *disk, u64 offset,
+				     const struct iovec *iov, int iovcount)
+{
+	u64 len = 0;
+
+	while (iovcount--)
+		len += (iov++)->iov_len;
+
+	return offset <= disk->size && len <= disk->size - offset;
+}
+
 ssize_t raw_image__read_mmap(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
 {
 	u64 offset = sector << SECTOR_SHIFT;
 	ssize_t total = 0;
 
+	/* Past the end is a fault on the mapping, not a short read */
+	if (!raw_image__mmap_in_range(disk, offset, iov, iovcount))
+		return -1;
+
 	while (iovcount--) {
 		memcpy(iov->iov_base, disk->priv + offset, iov->iov_len);
 
@@ -39,6 +79,9 @@ ssize_t raw_image__write_mmap(struct disk_image *disk, u64 sector, const struct
 	u64 offset = sector << SECTOR_SHIFT;
 	ssize_t total = 0;
 
+	if (!raw_image__mmap_in_range(disk, offset, iov, iovcount))
+		return -1;
+
 	while (iovcount--) {
 		memcpy(disk->priv + offset, iov->iov_base, iov->iov_len);
 
@@ -51,6 +94,38 @@ ssize_t raw_image__write_mmap(struct disk_image *disk, u64 sector, const struct
 	return total;
 }
 
+/*
+ * Zero a range without writing it: punch a hole, or have the filesystem
+ * mark it as zeroed while keeping the allocation.
+ */
+ssize_t raw_image__write_zeroes(struct disk_image *disk, u64 sector, u64 len,
+				bool unmap)
+{
+	int mode = FALLOC_FL_KEEP_SIZE;
+
+	mode |= unmap ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE;
+
+	if (fallocate(disk->fd, mode, sector << SECTOR_SHIFT, len) < 0)
+		return -1;
+
+	if (disk->writethrough && fdatasync(disk->fd) < 0)
+		return -1;
+
+	return len;
+}
+
+ssize_t raw_image__discard(struct disk_image *disk, u64 sector, u64 len,
+			   bool secure)
+{
+	/* A file has nothing to securely erase */
+	if (secure) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	return raw_image__write_zeroes(disk, sector, len, true);
+}
+
 int raw_image__close(struct disk_image *disk)
 {
 	int ret = 0;
@@ -61,6 +136,102 @@ int raw_image__close(struct disk_image *disk)
 	return ret;
 }
 
+static void raw_image__mark_dirty(struct disk_image *disk, u64 start, u64 end)
+{
+	unsigned long chunk = start >> DISK_MMAP_DIRTY_SHIFT;
+	unsigned long last = (end - 1) >> DISK_MMAP_DIRTY_SHIFT;
+
+	/* Several threads may be writing, and FLUSH clears bits concurrently */
+	for (; chunk <= last; chunk++)
+		__sync_fetch_and_or(&disk->mmap_dirty[chunk / DISK_MMAP_DIRTY_BITS],
+				    1UL << (chunk % DISK_MMAP_DIRTY_BITS));
+}
+
+static int raw_image__sync_range(struct disk_image *disk, u64 start, u64 end);
+
+static ssize_t raw_image__write_shared(struct disk_image *disk, u64 sector,
+				       const struct iovec *iov, int iovcount,
+				       void *param)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	ssize_t total;
+
+	total = raw_image__write_mmap(disk, sector, iov, iovcount, param);
+	if (total <= 0)
+		return total;
+
+	/* Writethrough: msync() wants a page aligned start */
+	if (disk->writethrough)
+		return raw_image__sync_range(disk, offset & ~(u64)(getpagesize() - 1),
+					     offset + total) < 0 ? -1 : total;
+
+	/* Only after the copy, so a FLUSH that clears the bit sees the data */
+	raw_image__mark_dirty(disk, offset, offset + total);
+
+	return total;
+}
+
+static int raw_image__sync_range(struct disk_image *disk, u64 start, u64 end)
+{
+	if (msync(disk->priv + start, end - start, MS_SYNC) == 0)
+		return 0;
+
+	pr_warning("msync() failed for range 0x%llx-0x%llx",
+		   (unsigned long long)start, (unsigned long long)end);
+
+	/* Keep it for the next FLUSH */
+	raw_image__mark_dirty(disk, start, end);
+	return -1;
+}
+
+/*
+ * Write back every chunk dirtied before this call, merging neighbouring
+ * chunks into a single msync().
+ */
+static int raw_image__flush_shared(struct disk_image *disk)
+{
+	unsigned long nr = DISK_MMAP_DIRTY_LONGS(disk->size);
+	unsigned long i, word;
+	u64 start = 0, end = 0;
+	int ret = 0;
+
+	for (i = 0; i < nr; i++) {
+		word = __sync_fetch_and_and(&disk->mmap_dirty[i], 0);
+
+		while (word) {
+			u64 chunk = i * DISK_MMAP_DIRTY_BITS + __builtin_ctzl(word);
+			u64 s = chunk << DISK_MMAP_DIRTY_SHIFT;
+			u64 e = min_t(u64, s + DISK_MMAP_DIRTY_SIZE, disk->size);
+
+			word &= word - 1;
+
+			if (end && s == end) {
+				end = e;
+				continue;
+			}
+
+			if (end && raw_image__sync_range(disk, start, end) < 0)
+				ret = -1;
+			start = s;
+			end = e;
+		}
+	}
+
+	if (end && raw_image__sync_range(disk, start, end) < 0)
+		ret = -1;
+
+	return ret;
+}
+
+static int raw_image__close_shared(struct disk_image *disk)
+{
+	raw_image__flush_shared(disk);
+	free(disk->mmap_dirty);
+	disk->mmap_dirty = NULL;
+
+	return raw_image__close(disk);
+}
+
 /*
  * multiple buffer based disk image operations
  */
@@ -68,13 +239,17 @@ static struct disk_image_operations raw_image_regular_ops = {
 	.read	= raw_image__read,
 	.write	= raw_image__write,
 	.wait	= raw_image__wait,
+	.write_zeroes = raw_image__write_zeroes,
+	.discard = raw_image__discard,
 	.async	= true,
+	.writethrough = true,
 };
 
 struct disk_image_operations ro_ops = {
 	.read	= raw_image__read_mmap,
 	.write	= raw_image__write_mmap,
 	.close	= raw_image__close,
+	.inline_io = true,
 };
 
 struct disk_image_operations ro_ops_nowrite = {
@@ -83,9 +258,48 @@ struct disk_image_operations ro_ops_nowrite = {
 	.async	= true,
 };
 
-struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
+/*
+ * MAP_SHARED read-write: requests are a memcpy to or from the page cache
+ */
+static struct disk_image_operations raw_image_shared_ops = {
+	.read	= raw_image__read_mmap,
+	.write	= raw_image__write_shared,
+	.flush	= raw_image__flush_shared,
+	.close	= raw_image__close_shared,
+	.inline_io = true,
+	.writethrough = true,
+};
+
+/*
+ * O_DIRECT: guest buffers that don't meet the alignment are bounced
+ */
+static struct disk_image_operations raw_image_direct_ops = {
+	.read	= raw_image__read_direct,
+	.write	= raw_image__write_direct,
+	.wait	= raw_image__wait,
+	.write_zeroes = raw_image__write_zeroes,
+	.discard = raw_image__discard,
+	.async	= true,
+	.writethrough = true,
+};
+
+static struct disk_image_operations ro_ops_direct = {
+	.read	= raw_image__read_direct,
+	.wait	= raw_image__wait,
+	.async	= true,
+};
+
+struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly, bool direct,
+				    bool use_mmap)
 {
-	if (readonly) {
+	if (direct) {
+		/*
+		 * Keep the page cache out entirely, mmap included
+		 */
+		return disk_image__new(fd, st->st_size,
+				       readonly ? &ro_ops_direct : &raw_image_direct_ops,
+				       DISK_IMAGE_REGULAR);
+	} else if (readonly) {
 		/*
 		 * Use mmap's MAP_PRIVATE to implement non-persistent write
 		 * FIXME: This does not work on 32-bit host.
@@ -98,6 +312,19 @@ struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
 		}
 
 		return disk;
+	} else if (use_mmap) {
+		/*
+		 * Map the whole image, FLUSH becomes msync() of what was written
+		 */
+		struct disk_image *disk;
+
+		disk = disk_image__new(fd, st->st_size, &raw_image_shared_ops,
+				       DISK_IMAGE_MMAP_SHARED);
+		if (!IS_ERR_OR_NULL(disk))
+			return disk;
+
+		pr_warning("Unable to map the image, using read/write");
+		return disk_image__new(fd, st->st_size, &raw_image_regular_ops, DISK_IMAGE_REGULAR);
 	} else {
 		/*
 		 * Use read/write instead of mmap
@@ -0,0 +1,165 @@
+#include "kvm/disk-image.h"
+
+#include <linux/err.h>
+#include <linux/kernel.h>
+
+/*
+ * Extent map for sparse raw images.
+ *
+ * One bit per 64KB chunk of the image, set when the chunk may hold data.
+ * It is built from SEEK_DATA/SEEK_HOLE when the disk is opened and bits
+ * are set as the guest writes. Reads that fall entirely in clear chunks
+ * are answered with zeroes without going to the kernel.
+ *
+ * Discards don't clear bits, a write still in flight over the range could
+ * land after them. Discarded chunks are just read from the file.
+ */
+
+#define DISK_SPARSE_SHIFT	16
+#define DISK_SPARSE_BITS	(8 * sizeof(unsigned long))
+
+struct disk_sparse_map {
+	unsigned long		nr_chunks;
+	unsigned long		map[];
+};
+
+static void disk_sparse_set(struct disk_sparse_map *sm, u64 start, u64 end)
+{
+	unsigned long chunk = start >> DISK_SPARSE_SHIFT;
+	unsigned long last = (end - 1) >> DISK_SPARSE_SHIFT;
+	unsigned long *word, bit;
+
+	if (last >= sm->nr_chunks)
+		last = sm->nr_chunks - 1;
+
+	for (; chunk <= last; chunk++) {
+		word = &sm->map[chunk / DISK_SPARSE_BITS];
+		bit = 1UL << (chunk % DISK_SPARSE_BITS);
+
+		/* Mostly already set, don't bounce the line around for nothing */
+		if (!(*word & bit))
+			__sync_fetch_and_or(word, bit);
+	}
+}
+
+static bool disk_sparse_is_hole(struct disk_sparse_map *sm, u64 start, u64 end)
+{
+	unsigned long chunk = start >> DISK_SPARSE_SHIFT;
+	unsigned long last = (end - 1) >> DISK_SPARSE_SHIFT;
+
+	if (last >= sm->nr_chunks)
+		return false;
+
+	for (; chunk <= last; chunk++)
+		if (sm->map[chunk / DISK_SPARSE_BITS] & (1UL << (chunk % DISK_SPARSE_BITS)))
+			return false;
+
+	return true;
+}
+
+/*
+ * Record the data extents of the file. Returns -EOPNOTSUPP when the
+ * filesystem can't tell, and -EEXIST when there's no hole to speak of.
+ */
+static int disk_sparse_scan(struct disk_image *disk, struct disk_sparse_map *sm)
+{
+	off_t pos = 0, data, hole;
+
+	while ((u64)pos < disk->size) {
+		data = lseek(disk->fd, pos, SEEK_DATA);
+		if (data < 0) {
+			if (errno == ENXIO)
+				break;
+			return -EOPNOTSUPP;
+		}
+
+		hole = lseek(disk->fd, data, SEEK_HOLE);
+		if (hole < 0)
+			return -EOPNOTSUPP;
+
+		/* Fully allocated, nothing for the map to do */
+		if (data == 0 && (u64)hole >= disk->size)
+			return -EEXIST;
+
+		if (hole > data)
+			disk_sparse_set(sm, data, hole);
+		pos = hole;
+	}
+
+	return 0;
+}
+
+int disk_sparse_setup(struct disk_image *disk)
+{
+	struct disk_sparse_map *sm;
+	unsigned long nr_chunks;
+	int r;
+
+	if (!disk->size)
+		return -EINVAL;
+
+	nr_chunks = DIV_ROUND_UP(disk->size, 1ULL << DISK_SPARSE_SHIFT);
+	sm = calloc(1, sizeof(*sm) +
+		    DIV_ROUND_UP(nr_chunks, DISK_SPARSE_BITS) * sizeof(unsigned long));
+	if (!sm)
+		return -ENOMEM;
+
+	sm->nr_chunks = nr_chunks;
+
+	r = disk_sparse_scan(disk, sm);
+	if (r < 0) {
+		free(sm);
+		return r;
+	}
+
+	disk->sparse = sm;
+
+	return 0;
+}
+
+void disk_sparse_destroy(struct disk_image *disk)
+{
+	free(disk->sparse);
+	disk->sparse = NULL;
+}
+
+/*
+ * Zero the iovec if the whole range lies in holes. Returns the number of
+ * bytes read that way, 0 when the read has to go to the file.
+ */
+ssize_t disk_sparse_read(struct disk_image *disk, u64 sector,
+			 const struct iovec *iov, int iovcount)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	ssize_t total = 0;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		total += iov[i].iov_len;
+
+	if (!total || !disk_sparse_is_hole(disk->sparse, offset, offset + total))
+		return 0;
+
+	for (i = 0; i < iovcount; i++)
+		memset(iov[i].iov_base, 0, iov[i].iov_len);
+
+	return total;
+}
+
+/*
+ * Called before a write is issued, so a read racing with it never takes
+ * the range for a hole once the data may be there.
+ */
+void disk_sparse_write(struct disk_image *disk, u64 sector,
+		       const struct iovec *iov, int iovcount)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 total = 0;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		total += iov[i].iov_len;
+
+	if (total)
+		disk_sparse_set(disk->sparse, offset, offset + total);
+}
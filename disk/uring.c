@@ -0,0 +1,513 @@
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+#include "kvm/kvm.h"
+
+#include <linux/kernel.h>
+
+/*
+ * io_uring engine, a drop-in for the libaio one in disk/aio.c.
+ *
+ * The image fd is registered as fixed file 0 so the kernel doesn't look it
+ * up on every request. Memory that stays mapped for the life of the disk
+ * can be registered as fixed buffers with disk_uring_register_buffers();
+ * single-segment I/O that falls inside such a region is issued as
+ * READ_FIXED/WRITE_FIXED and skips per-I/O page pinning. Everything else
+ * goes out as READV/WRITEV on the fixed file.
+ *
+ * Other engines can run their own commands through a ring of the size they
+ * need (see disk/nvme.c): disk_uring_setup() takes the ring flags and the
+ * completion handler, disk_uring_get_sqe() and disk_uring_submit_sqe()
+ * queue SQEs they fill themselves.
+ *
+ * This talks to the kernel ABI directly rather than through liburing.
+ */
+
+#define URING_ENTRIES		256
+#define URING_MAX_BUFS		16
+
+/* user_data tag for synchronous submitters waiting on their own CQE */
+#define URING_WAITER		1UL
+
+struct disk_uring_waiter {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	bool			done;
+	s32			res;
+};
+
+struct disk_uring {
+	int			fd;
+	/* SQEs are 128 bytes and CQEs 32 with SQE128 and CQE32 */
+	unsigned		sqe_shift;
+	unsigned		cqe_shift;
+	disk_uring_complete_t	complete;
+
+	struct mutex		sq_lock;
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	struct io_uring_sqe	*sqes;
+
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring;
+	size_t			sq_ring_sz;
+	void			*cq_ring;
+	size_t			cq_ring_sz;
+	size_t			sqes_sz;
+
+	struct iovec		bufs[URING_MAX_BUFS];
+	unsigned		nr_bufs;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			      unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg,
+				 unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_unmap(struct disk_uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_sz);
+}
+
+static int uring_map(struct disk_uring *ring, struct io_uring_params *p)
+{
+	ring->sq_ring_sz = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ring->cq_ring_sz = p->cq_off.cqes +
+			   (p->cq_entries * sizeof(struct io_uring_cqe) << ring->cqe_shift);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_sz = ring->cq_ring_sz =
+			max(ring->sq_ring_sz, ring->cq_ring_sz);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_RW,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		return -errno;
+	}
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_RW,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			return -errno;
+		}
+	}
+
+	ring->sqes_sz = p->sq_entries * sizeof(struct io_uring_sqe) << ring->sqe_shift;
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_RW,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		return -errno;
+	}
+
+	ring->sq_head	= ring->sq_ring + p->sq_off.head;
+	ring->sq_tail	= ring->sq_ring + p->sq_off.tail;
+	ring->sq_mask	= ring->sq_ring + p->sq_off.ring_mask;
+	ring->sq_array	= ring->sq_ring + p->sq_off.array;
+	ring->cq_head	= ring->cq_ring + p->cq_off.head;
+	ring->cq_tail	= ring->cq_ring + p->cq_off.tail;
+	ring->cq_mask	= ring->cq_ring + p->cq_off.ring_mask;
+	ring->cqes	= ring->cq_ring + p->cq_off.cqes;
+
+	return 0;
+}
+
+/*
+ * Find the registered buffer holding [base, base + len), if any.
+ */
+static int uring_find_buffer(struct disk_uring *ring, void *base, size_t len)
+{
+	unsigned i;
+
+	for (i = 0; i < ring->nr_bufs; i++) {
+		struct iovec *b = &ring->bufs[i];
+
+		if (base >= b->iov_base &&
+		    base + len <= b->iov_base + b->iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static void uring_prep_rw(struct io_uring_sqe *sqe, struct disk_uring *ring,
+			  const struct iovec *iov, int iovcount, u64 offset,
+			  bool write)
+{
+	int idx = -1;
+
+	if (iovcount == 1)
+		idx = uring_find_buffer(ring, iov->iov_base, iov->iov_len);
+
+	if (idx >= 0) {
+		sqe->opcode	= write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr	= (unsigned long)iov->iov_base;
+		sqe->len	= iov->iov_len;
+		sqe->buf_index	= idx;
+	} else {
+		sqe->opcode	= write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr	= (unsigned long)iov;
+		sqe->len	= iovcount;
+	}
+
+	/* Registered as fixed file 0 in disk_aio_setup() */
+	sqe->fd		= 0;
+	sqe->flags	= IOSQE_FIXED_FILE;
+	sqe->off	= offset;
+}
+
+/*
+ * Take the submission lock and return the next SQE, zeroed. It is queued,
+ * and the lock dropped, by disk_uring_submit_sqe().
+ */
+struct io_uring_sqe *disk_uring_get_sqe(struct disk_image *disk)
+{
+	struct disk_uring *ring = disk->uring;
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	mutex_lock(&ring->sq_lock);
+
+	idx = *ring->sq_tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx << ring->sqe_shift];
+	memset(sqe, 0, sizeof(*sqe) << ring->sqe_shift);
+	ring->sq_array[idx] = idx;
+
+	return sqe;
+}
+
+int disk_uring_submit_sqe(struct disk_image *disk)
+{
+	struct disk_uring *ring = disk->uring;
+	unsigned tail = *ring->sq_tail;
+	int ret;
+
+	/* The kernel must see the SQE before the new tail */
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+restart:
+	ret = sys_io_uring_enter(ring->fd, 1, 0, 0);
+	if (ret < 0 && (errno == EAGAIN || errno == EBUSY || errno == EINTR))
+		goto restart;
+
+	/*
+	 * Not consumed, or the next enter would submit it behind the back of
+	 * the caller, which completes the request itself. Without SQPOLL the
+	 * kernel only looks at the ring in io_uring_enter().
+	 */
+	if (ret < 0)
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	mutex_unlock(&ring->sq_lock);
+
+	return ret < 0 ? -errno : 0;
+}
+
+static int uring_submit(struct disk_image *disk, const struct iovec *iov,
+			int iovcount, u64 offset, bool write, u64 user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = disk_uring_get_sqe(disk);
+
+	uring_prep_rw(sqe, disk->uring, iov, iovcount, offset, write);
+	sqe->user_data = user_data;
+	if (write && disk->writethrough)
+		sqe->rw_flags = RWF_DSYNC;
+
+	return disk_uring_submit_sqe(disk);
+}
+
+static ssize_t uring_submit_async(struct disk_image *disk, const struct iovec *iov,
+				  int iovcount, u64 offset, bool write, void *param)
+{
+	int ret;
+
+	/* See aio_submit(): disk_aio_thread() must see this first */
+	__sync_fetch_and_add(&disk->aio_inflight, 1);
+
+	ret = uring_submit(disk, iov, iovcount, offset, write,
+			   (unsigned long)param);
+	if (ret < 0) {
+		__sync_fetch_and_sub(&disk->aio_inflight, 1);
+		return ret;
+	}
+
+	return 1;
+}
+
+ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
+			      const struct iovec *iov, int iovcount,
+			      void *param)
+{
+	return uring_submit_async(disk, iov, iovcount, sector << SECTOR_SHIFT,
+				  false, param);
+}
+
+ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
+			       const struct iovec *iov, int iovcount,
+			       void *param)
+{
+	return uring_submit_async(disk, iov, iovcount, sector << SECTOR_SHIFT,
+				  true, param);
+}
+
+/*
+ * Synchronous I/O through the ring, for callers that want fixed buffers
+ * but have nothing to do until the data is there.
+ */
+ssize_t disk_uring_rw(struct disk_image *disk, void *buf, size_t len,
+		      u64 offset, bool write)
+{
+	struct disk_uring_waiter w = {
+		.lock	= PTHREAD_MUTEX_INITIALIZER,
+		.cond	= PTHREAD_COND_INITIALIZER,
+	};
+	struct iovec iov = { buf, len };
+	int ret;
+
+	ret = uring_submit(disk, &iov, 1, offset, write,
+			   (unsigned long)&w | URING_WAITER);
+	if (ret < 0)
+		return ret;
+
+	pthread_mutex_lock(&w.lock);
+	while (!w.done)
+		pthread_cond_wait(&w.cond, &w.lock);
+	pthread_mutex_unlock(&w.lock);
+
+	return w.res;
+}
+
+/*
+ * When this function returns there are no in-flight I/O. Caller ensures that
+ * nothing is submitted concurrently.
+ */
+int raw_image__wait(struct disk_image *disk)
+{
+	u64 inflight = disk->aio_inflight;
+
+	while (__atomic_load_n(&disk->aio_inflight, __ATOMIC_ACQUIRE))
+		usleep(100);
+
+	return inflight;
+}
+
+static void uring_complete(struct disk_image *disk, struct io_uring_cqe *cqe)
+{
+	u64 user_data = cqe->user_data;
+	s32 res = cqe->res;
+	struct disk_uring_waiter *w;
+
+	if (!(user_data & URING_WAITER)) {
+		disk->disk_req_cb((void *)(unsigned long)user_data, res);
+		__sync_fetch_and_sub(&disk->aio_inflight, 1);
+		return;
+	}
+
+	w = (void *)(unsigned long)(user_data & ~URING_WAITER);
+	pthread_mutex_lock(&w->lock);
+	w->res = res;
+	w->done = true;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void disk_uring_get_events(struct disk_image *disk)
+{
+	struct disk_uring *ring = disk->uring;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+
+	head = *ring->cq_head;
+	for (;;) {
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+
+		while (head != tail) {
+			cqe = &ring->cqes[(head & *ring->cq_mask) << ring->cqe_shift];
+			ring->complete(disk, cqe);
+			head++;
+		}
+
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+static void *disk_aio_thread(void *param)
+{
+	struct disk_image *disk = param;
+	u64 dummy;
+
+	kvm__set_thread_name("disk-image-io");
+
+	while (read(disk->evt, &dummy, sizeof(dummy)) > 0)
+		disk_uring_get_events(disk);
+
+	return NULL;
+}
+
+/*
+ * (Re)register the table of long-lived buffers. Must be called while no
+ * I/O is in flight, i.e. at open time.
+ */
+int disk_uring_register_buffers(struct disk_image *disk,
+				const struct iovec *iov, int nr)
+{
+	struct disk_uring *ring = disk->uring;
+	int r;
+
+	if (!ring)
+		return -ENODEV;
+
+	if (ring->nr_bufs + nr > URING_MAX_BUFS)
+		return -ENOSPC;
+
+	memcpy(&ring->bufs[ring->nr_bufs], iov, nr * sizeof(*iov));
+
+	if (ring->nr_bufs)
+		sys_io_uring_register(ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+
+	r = sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS,
+				  ring->bufs, ring->nr_bufs + nr);
+	if (r < 0) {
+		r = -errno;
+		/* Whatever was there before is gone too */
+		ring->nr_bufs = 0;
+		return r;
+	}
+
+	ring->nr_bufs += nr;
+
+	return 0;
+}
+
+/*
+ * Give the disk a ring created with 'flags', whose completions are handed
+ * to 'complete' on the disk's I/O thread.
+ */
+int disk_uring_setup(struct disk_image *disk, unsigned flags,
+		     disk_uring_complete_t complete)
+{
+	struct io_uring_params p = { .flags = flags };
+	struct disk_uring *ring;
+	int r;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return -ENOMEM;
+
+	mutex_init(&ring->sq_lock);
+	ring->sqe_shift = !!(flags & IORING_SETUP_SQE128);
+	ring->cqe_shift = !!(flags & IORING_SETUP_CQE32);
+	ring->complete = complete;
+
+	ring->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (ring->fd < 0) {
+		r = -errno;
+		goto err_free;
+	}
+
+	r = uring_map(ring, &p);
+	if (r)
+		goto err_close;
+
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_FILES, &disk->fd, 1) < 0) {
+		r = -errno;
+		goto err_close;
+	}
+
+	disk->evt = eventfd(0, 0);
+	if (disk->evt < 0) {
+		r = -errno;
+		goto err_close;
+	}
+
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_EVENTFD, &disk->evt, 1) < 0) {
+		r = -errno;
+		goto err_evt;
+	}
+
+	disk->uring = ring;
+
+	r = pthread_create(&disk->thread, NULL, disk_aio_thread, disk);
+	if (r) {
+		r = -r;
+		disk->uring = NULL;
+		goto err_evt;
+	}
+
+	disk->async = true;
+	return 0;
+
+err_evt:
+	close(disk->evt);
+err_close:
+	uring_unmap(ring);
+	close(ring->fd);
+err_free:
+	free(ring);
+	return r;
+}
+
+int disk_aio_setup(struct disk_image *disk)
+{
+	/* No need to setup the ring if the disk ops won't make use of it */
+	if (!disk->ops->async)
+		return 0;
+
+	return disk_uring_setup(disk, 0, uring_complete);
+}
+
+void disk_aio_destroy(struct disk_image *disk)
+{
+	struct disk_uring *ring = disk->uring;
+
+	if (!disk->async)
+		return;
+
+	pthread_cancel(disk->thread);
+	pthread_join(disk->thread, NULL);
+	close(disk->evt);
+
+	uring_unmap(ring);
+	close(ring->fd);
+	free(ring);
+	disk->uring = NULL;
+}
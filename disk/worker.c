@@ -0,0 +1,293 @@
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+#include "kvm/kvm.h"
+
+#include <linux/list.h>
+#include <pthread.h>
+
+/*
+ * Worker pool for disks without an asynchronous engine (qcow, and raw
+ * images when AIO is not built in), and for the requests of async qcow2
+ * disks that need metadata work first. Mapped raw images aren't served:
+ * their requests are a memcpy, cheaper than the hop to a worker.
+ *
+ * Without it disk_image__read/write() run the backend on the virtio-blk
+ * queue thread, so one slow request holds up everything queued behind
+ * it. Instead each such disk gets a queue of pending requests, and a
+ * small pool of threads shared by all disks executes them and completes
+ * them through disk_req_cb. A worker serves the disk it is homed on first
+ * and steals from the other disks' queues when that one is empty.
+ */
+
+#define DISK_WORKER_THREADS	4
+#define DISK_WORK_DEPTH		256
+
+struct disk_work {
+	struct list_head	list;
+	struct disk_image	*disk;
+	const struct iovec	*iov;
+	u64			sector;
+	void			*param;
+	int			iovcount;
+	bool			write;
+};
+
+struct disk_work_queue {
+	struct list_head	pending;
+	struct list_head	free;
+	u64			inflight;
+	pthread_cond_t		idle;
+	struct disk_work	work[DISK_WORK_DEPTH];
+};
+
+static struct {
+	struct mutex		mutex;
+	pthread_cond_t		cond;
+	struct disk_work_queue	*queues[MAX_DISK_IMAGES];
+	pthread_t		threads[DISK_WORKER_THREADS];
+	int			nr_threads;
+	int			nr_queues;
+	bool			stop;
+} disk_workers = {
+	.mutex	= MUTEX_INITIALIZER,
+	.cond	= PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Called with the pool lock held. Start at the home queue, then steal.
+ */
+static struct disk_work *disk_worker_next(int home)
+{
+	struct disk_work_queue *wq;
+	struct disk_work *work;
+	int i;
+
+	for (i = 0; i < MAX_DISK_IMAGES; i++) {
+		wq = disk_workers.queues[(home + i) % MAX_DISK_IMAGES];
+		if (!wq || list_empty(&wq->pending))
+			continue;
+
+		work = list_first_entry(&wq->pending, struct disk_work, list);
+		list_del(&work->list);
+		return work;
+	}
+
+	return NULL;
+}
+
+static void disk_worker_run(struct disk_work *work)
+{
+	struct disk_image *disk = work->disk;
+	ssize_t total = 0;
+
+	if (work->write) {
+		if (disk->ops->write_sync)
+			total = disk->ops->write_sync(disk, work->sector, work->iov,
+						      work->iovcount, work->param);
+		else if (disk->ops->write)
+			total = disk->ops->write(disk, work->sector, work->iov,
+						 work->iovcount, work->param);
+		total = disk_image__writethrough(disk, total);
+	} else {
+		if (disk->ops->read_sync)
+			total = disk->ops->read_sync(disk, work->sector, work->iov,
+						     work->iovcount, work->param);
+		else if (disk->ops->read)
+			total = disk->ops->read(disk, work->sector, work->iov,
+						work->iovcount, work->param);
+	}
+
+	if (total < 0)
+		pr_info("disk worker %s error: total=%ld\n",
+			work->write ? "write" : "read", (long)total);
+
+	if (disk->disk_req_cb)
+		disk->disk_req_cb(work->param, total);
+}
+
+static void *disk_worker_thread(void *arg)
+{
+	int home = (long)arg % MAX_DISK_IMAGES;
+	struct disk_work_queue *wq;
+	struct disk_work *work;
+
+	kvm__set_thread_name("disk-worker");
+
+	mutex_lock(&disk_workers.mutex);
+	while (!disk_workers.stop) {
+		work = disk_worker_next(home);
+		if (!work) {
+			pthread_cond_wait(&disk_workers.cond,
+					  &disk_workers.mutex.mutex);
+			continue;
+		}
+
+		mutex_unlock(&disk_workers.mutex);
+		disk_worker_run(work);
+		mutex_lock(&disk_workers.mutex);
+
+		wq = work->disk->wq;
+		list_add(&work->list, &wq->free);
+		if (!--wq->inflight)
+			pthread_cond_broadcast(&wq->idle);
+	}
+	mutex_unlock(&disk_workers.mutex);
+
+	return NULL;
+}
+
+/*
+ * Queue a read or write for the pool. Returns 0 once queued, or -EBUSY
+ * when the disk already has DISK_WORK_DEPTH requests outstanding and the
+ * caller should run this one itself.
+ */
+int disk_worker_submit(struct disk_image *disk, u64 sector,
+		       const struct iovec *iov, int iovcount, void *param,
+		       bool write)
+{
+	struct disk_work_queue *wq = disk->wq;
+	struct disk_work *work;
+
+	mutex_lock(&disk_workers.mutex);
+	if (list_empty(&wq->free)) {
+		mutex_unlock(&disk_workers.mutex);
+		return -EBUSY;
+	}
+
+	work = list_first_entry(&wq->free, struct disk_work, list);
+	list_del(&work->list);
+
+	*work = (struct disk_work) {
+		.disk		= disk,
+		.iov		= iov,
+		.sector		= sector,
+		.param		= param,
+		.iovcount	= iovcount,
+		.write		= write,
+	};
+
+	list_add_tail(&work->list, &wq->pending);
+	wq->inflight++;
+	pthread_cond_signal(&disk_workers.cond);
+	mutex_unlock(&disk_workers.mutex);
+
+	return 0;
+}
+
+/*
+ * When this function returns the pool holds no request for this disk.
+ */
+void disk_worker_wait(struct disk_image *disk)
+{
+	struct disk_work_queue *wq = disk->wq;
+
+	if (!wq)
+		return;
+
+	mutex_lock(&disk_workers.mutex);
+	while (wq->inflight)
+		pthread_cond_wait(&wq->idle, &disk_workers.mutex.mutex);
+	mutex_unlock(&disk_workers.mutex);
+}
+
+static void disk_worker_stop_threads(void)
+{
+	int i;
+
+	mutex_lock(&disk_workers.mutex);
+	disk_workers.stop = true;
+	pthread_cond_broadcast(&disk_workers.cond);
+	mutex_unlock(&disk_workers.mutex);
+
+	for (i = 0; i < disk_workers.nr_threads; i++)
+		pthread_join(disk_workers.threads[i], NULL);
+
+	disk_workers.nr_threads = 0;
+	disk_workers.stop = false;
+}
+
+static int disk_worker_start_threads(void)
+{
+	long i;
+
+	for (i = 0; i < DISK_WORKER_THREADS; i++) {
+		if (pthread_create(&disk_workers.threads[i], NULL,
+				   disk_worker_thread, (void *)i))
+			break;
+		disk_workers.nr_threads++;
+	}
+
+	if (disk_workers.nr_threads)
+		return 0;
+
+	return -EAGAIN;
+}
+
+int disk_worker_attach(struct disk_image *disk)
+{
+	struct disk_work_queue *wq;
+	int i, slot, r;
+
+	wq = calloc(1, sizeof(*wq));
+	if (!wq)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&wq->pending);
+	INIT_LIST_HEAD(&wq->free);
+	pthread_cond_init(&wq->idle, NULL);
+	for (i = 0; i < DISK_WORK_DEPTH; i++)
+		list_add_tail(&wq->work[i].list, &wq->free);
+
+	if (!disk_workers.nr_threads) {
+		r = disk_worker_start_threads();
+		if (r < 0)
+			goto err_free;
+	}
+
+	mutex_lock(&disk_workers.mutex);
+	for (slot = 0; slot < MAX_DISK_IMAGES; slot++)
+		if (!disk_workers.queues[slot])
+			break;
+	if (slot < MAX_DISK_IMAGES) {
+		disk_workers.queues[slot] = wq;
+		disk_workers.nr_queues++;
+		disk->wq = wq;
+	}
+	mutex_unlock(&disk_workers.mutex);
+
+	if (slot < MAX_DISK_IMAGES)
+		return 0;
+
+	r = -ENOSPC;
+	if (!disk_workers.nr_queues)
+		disk_worker_stop_threads();
+err_free:
+	pthread_cond_destroy(&wq->idle);
+	free(wq);
+	return r;
+}
+
+void disk_worker_detach(struct disk_image *disk)
+{
+	struct disk_work_queue *wq = disk->wq;
+	int slot;
+
+	if (!wq)
+		return;
+
+	disk_worker_wait(disk);
+
+	mutex_lock(&disk_workers.mutex);
+	for (slot = 0; slot < MAX_DISK_IMAGES; slot++)
+		if (disk_workers.queues[slot] == wq)
+			disk_workers.queues[slot] = NULL;
+	disk_workers.nr_queues--;
+	disk->wq = NULL;
+	mutex_unlock(&disk_workers.mutex);
+
+	if (!disk_workers.nr_queues)
+		disk_worker_stop_threads();
+
+	pthread_cond_destroy(&wq->idle);
+	free(wq);
+}
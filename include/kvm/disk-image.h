@@ -18,6 +18,14 @@
 #include <unistd.h>
 #include <fcntl.h>
 
+#if defined(CONFIG_HAS_AIO) && defined(CONFIG_HAS_IO_URING)
+#error "CONFIG_HAS_AIO and CONFIG_HAS_IO_URING are mutually exclusive"
+#endif
+
+#if defined(CONFIG_HAS_NVME) && !defined(CONFIG_HAS_IO_URING)
+#error "CONFIG_HAS_NVME requires CONFIG_HAS_IO_URING"
+#endif
+
 #ifdef CONFIG_HAS_AIO
 #include <libaio.h>
 #endif
@@ -28,13 +36,64 @@
 enum {
 	DISK_IMAGE_REGULAR,
 	DISK_IMAGE_MMAP,
+	DISK_IMAGE_MMAP_SHARED,
 };
 
 #define MAX_DISK_IMAGES         4
 
+/* DISK_DIRECT_AUTO bypasses the page cache for host block devices only */
+enum {
+	DISK_DIRECT_OFF,
+	DISK_DIRECT_ON,
+	DISK_DIRECT_AUTO,
+};
+
+/*
+ * Largest discard or zeroing range handed to the host in one call. These
+ * run to completion on the queue thread.
+ */
+#define DISK_DISCARD_MAX_SECTORS	(1U << 21)
+
+/* What to do with writes of nothing but zeroes */
+enum {
+	DISK_ZEROES_OFF,
+	DISK_ZEROES_ON,		/* zero the range in place */
+	DISK_ZEROES_UNMAP,	/* punch a hole */
+};
+
+/*
+ * Dirty tracking granularity of DISK_IMAGE_MMAP_SHARED images: FLUSH only
+ * msync()s chunks written since the previous one.
+ */
+#define DISK_MMAP_DIRTY_SHIFT	16
+#define DISK_MMAP_DIRTY_SIZE	(1UL << DISK_MMAP_DIRTY_SHIFT)
+#define DISK_MMAP_DIRTY_BITS	(8 * sizeof(unsigned long))
+#define DISK_MMAP_DIRTY_LONGS(size)					\
+	DIV_ROUND_UP(DIV_ROUND_UP(size, DISK_MMAP_DIRTY_SIZE), DISK_MMAP_DIRTY_BITS)
+
 struct disk_image;
+struct disk_bounce_pool;
+struct disk_uring;
+struct disk_work_queue;
+struct disk_flusher;
+struct disk_sparse_map;
 struct kvm;
 
+/*
+ * What the backing store can do. A zero maximum means the operation is not
+ * supported, zero sizes that they are unknown.
+ */
+struct disk_limits {
+	u32	logical_block_size;	/* 0 for SECTOR_SIZE */
+	u32	physical_block_size;
+	u32	io_min;
+	u32	io_opt;
+	u32	max_discard_sectors;
+	u32	discard_alignment;	/* in sectors */
+	u32	max_write_zeroes_sectors;
+	u32	max_secure_erase_sectors;
+};
+
 struct disk_image_operations {
 	ssize_t (*read)(struct disk_image *disk, u64 sector, const struct iovec *iov,
 			int iovcount, void *param);
@@ -43,7 +102,29 @@ struct disk_image_operations {
 	int (*flush)(struct disk_image *disk);
 	int (*wait)(struct disk_image *disk);
 	int (*close)(struct disk_image *disk);
+	ssize_t (*write_zeroes)(struct disk_image *disk, u64 sector, u64 len,
+				bool unmap);
+	ssize_t (*discard)(struct disk_image *disk, u64 sector, u64 len,
+			   bool secure);
+	/* Read without blocking, or fail. Tried before handing reads to a worker */
+	ssize_t (*read_nowait)(struct disk_image *disk, u64 sector,
+			       const struct iovec *iov, int iovcount);
+	/*
+	 * Synchronous read() and write() of async disks that hand some
+	 * requests to the worker pool, which runs these
+	 */
+	ssize_t (*read_sync)(struct disk_image *disk, u64 sector,
+			     const struct iovec *iov, int iovcount, void *param);
+	ssize_t (*write_sync)(struct disk_image *disk, u64 sector,
+			      const struct iovec *iov, int iovcount, void *param);
 	bool async;
+	/*
+	 * Requests are a memcpy to or from a mapping of the image, cheaper
+	 * done on the queue thread than handed to a worker
+	 */
+	bool inline_io;
+	/* write() makes the data durable itself when disk->writethrough is set */
+	bool writethrough;
 };
 
 struct disk_image_params {
@@ -55,7 +136,12 @@ struct disk_image_params {
 	const char *wwpn;
 	const char *tpgt;
 	bool readonly;
-	bool direct;
+	u8 direct;
+	bool mmap;
+	bool writethrough;
+	u8 detect_zeroes;
+	u64 l2_cache_size;	/* qcow2, in bytes, 0 for the default */
+	u64 cluster_cache_size;	/* qcow, inflated clusters in bytes, 0 for the default */
 
 	u32 addr;
 	u8 irq;
@@ -70,12 +156,28 @@ struct disk_image {
 	void				(*disk_req_cb)(void *param, long len);
 	bool				readonly;
 	bool				async;
+	bool				direct;
+	bool				writethrough;
+	u8				detect_zeroes;
+	u32				dio_align;
+	struct disk_limits		limits;
+	struct disk_bounce_pool		*bounce;
+	unsigned long			*mmap_dirty;
+	struct disk_work_queue		*wq;
+	struct disk_flusher		*flusher;
+	struct disk_sparse_map		*sparse;
 #ifdef CONFIG_HAS_AIO
 	io_context_t			ctx;
 	int				evt;
 	pthread_t			thread;
 	u64				aio_inflight;
 #endif /* CONFIG_HAS_AIO */
+#ifdef CONFIG_HAS_IO_URING
+	struct disk_uring		*uring;
+	int				evt;
+	pthread_t			thread;
+	u64				aio_inflight;
+#endif /* CONFIG_HAS_IO_URING */
 	const char			*wwpn;
 	const char			*tpgt;
 	int				debug_iodelay;
@@ -91,15 +193,32 @@ int disk_image__init(struct kvm *kvm);
 int disk_image__exit(struct kvm *kvm);
 struct disk_image *disk_image__new(int fd, u64 size, struct disk_image_operations *ops, int mmap);
 int disk_image__flush(struct disk_image *disk);
+int disk_image__flush_async(struct disk_image *disk, void *param);
+void disk_image__set_writethrough(struct disk_image *disk, bool writethrough);
+ssize_t disk_image__writethrough(struct disk_image *disk, ssize_t total);
 int disk_image__wait(struct disk_image *disk);
 ssize_t disk_image__read(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
 ssize_t disk_image__write(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
+ssize_t disk_image__discard(struct disk_image *disk, u64 sector, u64 len,
+			    bool secure);
+ssize_t disk_image__write_zeroes(struct disk_image *disk, u64 sector, u64 len,
+				 bool unmap);
 ssize_t disk_image__get_serial(struct disk_image *disk, void *buffer, ssize_t *len);
 
-struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly);
+struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly, bool direct,
+				    bool use_mmap);
 struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *st);
+#ifdef CONFIG_HAS_NVME
+struct disk_image *nvme__probe(const char *filename, int flags, struct stat *st);
+#else
+static inline struct disk_image *nvme__probe(const char *filename, int flags,
+					     struct stat *st)
+{
+	return NULL;
+}
+#endif
 
 ssize_t raw_image__read_sync(struct disk_image *disk, u64 sector,
 			     const struct iovec *iov, int iovcount, void *param);
@@ -110,9 +229,42 @@ ssize_t raw_image__read_mmap(struct disk_image *disk, u64 sector,
 ssize_t raw_image__write_mmap(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param);
 int raw_image__close(struct disk_image *disk);
+ssize_t raw_image__write_zeroes(struct disk_image *disk, u64 sector, u64 len,
+				bool unmap);
+ssize_t raw_image__discard(struct disk_image *disk, u64 sector, u64 len,
+			   bool secure);
+
+u32 disk_direct_align(int fd);
+int disk_direct_setup(struct disk_image *disk);
+void disk_direct_destroy(struct disk_image *disk);
+ssize_t raw_image__read_direct(struct disk_image *disk, u64 sector,
+			       const struct iovec *iov, int iovcount, void *param);
+ssize_t raw_image__write_direct(struct disk_image *disk, u64 sector,
+				const struct iovec *iov, int iovcount, void *param);
 void disk_image__set_callback(struct disk_image *disk, void (*disk_req_cb)(void *param, long len));
 
-#ifdef CONFIG_HAS_AIO
+int disk_sparse_setup(struct disk_image *disk);
+void disk_sparse_destroy(struct disk_image *disk);
+ssize_t disk_sparse_read(struct disk_image *disk, u64 sector,
+			 const struct iovec *iov, int iovcount);
+void disk_sparse_write(struct disk_image *disk, u64 sector,
+		       const struct iovec *iov, int iovcount);
+
+struct disk_image *disk_backing_open(const char *filename, const char *format);
+void disk_backing_close(struct disk_image *disk);
+
+int disk_flush_setup(struct disk_image *disk);
+void disk_flush_destroy(struct disk_image *disk);
+void disk_flush_wait(struct disk_image *disk);
+
+int disk_worker_attach(struct disk_image *disk);
+void disk_worker_detach(struct disk_image *disk);
+void disk_worker_wait(struct disk_image *disk);
+int disk_worker_submit(struct disk_image *disk, u64 sector,
+		       const struct iovec *iov, int iovcount, void *param,
+		       bool write);
+
+#if defined(CONFIG_HAS_AIO) || defined(CONFIG_HAS_IO_URING)
 int disk_aio_setup(struct disk_image *disk);
 void disk_aio_destroy(struct disk_image *disk);
 ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
@@ -124,7 +276,7 @@ int raw_image__wait(struct disk_image *disk);
 #define raw_image__read		raw_image__read_async
 #define raw_image__write	raw_image__write_async
 
-#else /* !CONFIG_HAS_AIO */
+#else /* !CONFIG_HAS_AIO && !CONFIG_HAS_IO_URING */
 static inline int disk_aio_setup(struct disk_image *disk)
 {
 	/* No-op */
@@ -140,6 +292,22 @@ static inline int raw_image__wait(struct disk_image *disk)
 }
 #define raw_image__read		raw_image__read_sync
 #define raw_image__write	raw_image__write_sync
-#endif /* CONFIG_HAS_AIO */
+#endif /* CONFIG_HAS_AIO || CONFIG_HAS_IO_URING */
+
+#ifdef CONFIG_HAS_IO_URING
+struct io_uring_sqe;
+struct io_uring_cqe;
+typedef void (*disk_uring_complete_t)(struct disk_image *disk,
+				      struct io_uring_cqe *cqe);
+
+int disk_uring_setup(struct disk_image *disk, unsigned flags,
+		     disk_uring_complete_t complete);
+struct io_uring_sqe *disk_uring_get_sqe(struct disk_image *disk);
+int disk_uring_submit_sqe(struct disk_image *disk);
+int disk_uring_register_buffers(struct disk_image *disk,
+				const struct iovec *iov, int nr);
+ssize_t disk_uring_rw(struct disk_image *disk, void *buf, size_t len,
+		      u64 offset, bool write);
+#endif /* CONFIG_HAS_IO_URING */
 
 #endif /* KVM__DISK_IMAGE_H */
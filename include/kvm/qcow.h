@@ -2,6 +2,7 @@
 #define KVM__QCOW_H
 
 #include "kvm/mutex.h"
+#include "kvm/seqlock.h"
 
 #include <linux/types.h>
 #include <stdbool.h>
@@ -12,6 +13,7 @@
 
 #define QCOW1_VERSION		1
 #define QCOW2_VERSION		2
+#define QCOW3_VERSION		3	/* qcow2, with feature bits */
 
 #define QCOW1_OFLAG_COMPRESSED	(1ULL << 63)
 
@@ -22,24 +24,106 @@
 
 #define QCOW2_OFFSET_MASK	(~QCOW2_OFLAGS_MASK)
 
+/* Version 3, reads as zeroes. In compressed entries the bit is offset */
+#define QCOW2_OFLAG_ZERO	(1ULL << 0)
+
+/* Version 3 incompatible features */
+#define QCOW2_INCOMPAT_DIRTY		(1ULL << 0)
+#define QCOW2_INCOMPAT_CORRUPT		(1ULL << 1)
+#define QCOW2_INCOMPAT_DATA_FILE	(1ULL << 2)
+#define QCOW2_INCOMPAT_COMPRESSION	(1ULL << 3)
+#define QCOW2_INCOMPAT_EXTL2		(1ULL << 4)
+
+#define QCOW2_INCOMPAT_SUPPORTED	(QCOW2_INCOMPAT_DIRTY | \
+					 QCOW2_INCOMPAT_CORRUPT | \
+					 QCOW2_INCOMPAT_COMPRESSION | \
+					 QCOW2_INCOMPAT_EXTL2)
+
+/*
+ * Extended L2 entries are followed by a bitmap of the subclusters that are
+ * allocated, and above it of those that read as zeroes.
+ */
+#define QCOW2_SUBCLUSTERS_SHIFT		5
+#define QCOW2_SUBCLUSTERS		(1 << QCOW2_SUBCLUSTERS_SHIFT)
+#define QCOW2_SC_ALLOC_MASK		0xffffffffULL
+#define QCOW2_SC_ZERO_SHIFT		32
+#define QCOW2_EXTL2_MIN_CLUSTER_BITS	14
+
+/* Version 3 compatible features */
+#define QCOW2_COMPAT_LAZY_REFCOUNTS	(1ULL << 0)
+
+#define QCOW2_COMPRESSION_ZLIB		0
+#define QCOW2_COMPRESSION_ZSTD		1
+
+/* Header extensions, following the header in the first cluster */
+#define QCOW2_EXT_END			0
+#define QCOW2_EXT_BACKING_FORMAT	0xe2792acaU
+
+#define QCOW_BACKING_NAME_MAX		1023
+
 #define MAX_CACHE_NODES         32
 
+/*
+ * L2 tables are cached in slices of this many bytes, so that a cluster
+ * worth of table isn't read to translate a single offset.
+ */
+#define QCOW_L2_SLICE_SIZE	4096
+
+/* Unless configured, the L2 cache maps the whole image up to this size */
+#define QCOW_L2_CACHE_MAX	(64 << 20)
+#define QCOW_L2_CACHE_MIN_SLICES	16
+
+/* Ranges freed between two metadata write-backs, see qcow_free_clusters() */
+#define QCOW_PENDING_FREES_MAX	64
+
+/* Unless configured, up to this many bytes of clusters are kept inflated */
+#define QCOW_CLUSTER_CACHE_DEFAULT	(8 << 20)
+
+/* A cached slice of an L2 table */
 struct qcow_l2_table {
 	u64				offset;
-	struct rb_node			node;
+	struct hlist_node		node;
 	struct list_head		list;
 	u8				dirty;
+	u8				referenced;	/* by lockless lookups */
 	u64				table[];
 };
 
+/* An inflated compressed cluster, keyed by the L2 entry pointing to it */
+struct qcow_cached_cluster {
+	u64				entry;
+	struct hlist_node		node;
+	struct list_head		list;	/* empty while loading */
+	u8				loading;
+	u8				data[];
+};
+
+struct qcow_cluster_cache {
+	struct mutex			mutex;
+	pthread_cond_t			loaded;
+	struct hlist_head		*hash;
+	int				hash_bits;
+	struct list_head		lru_list;
+	u32				nr_cached;
+	u32				max_cached;	/* 0 when turned off */
+	/* Where the last read of a compressed cluster stopped */
+	u64				next_offset;
+};
+
 struct qcow_l1_table {
 	u32				table_size;
 	u64				*l1_table;
+	u8				dirty;
 
-	/* Level2 caching data structures */
-	struct rb_root			root;
+	/* Level2 caching data structures, slices are hashed by offset */
+	struct hlist_head		*hash;
+	int				hash_bits;
 	struct list_head		lru_list;
 	int				nr_cached;
+	int				max_cached;
+
+	/* Evicted tables, reused before going back to the heap */
+	struct list_head		free_list;
 };
 
 #define QCOW_REFCOUNT_BLOCK_SHIFT	1
@@ -61,20 +145,41 @@ struct qcow_refcount_table {
 	struct rb_root			root;
 	struct list_head		lru_list;
 	int				nr_cached;
+
+	/* Evicted blocks, reused before going back to the heap */
+	struct list_head		free_list;
+};
+
+struct qcow_free_range {
+	u64				offset;
+	u64				size;
 };
 
 struct qcow_header {
+	u32				version;
 	u64				size;	/* in bytes */
+	u64				backing_file_offset;
+	u32				backing_file_size;
 	u64				l1_table_offset;
 	u32				l1_size;
 	u8				cluster_bits;
 	u8				l2_bits;
 	u64				refcount_table_offset;
 	u32				refcount_table_size;
+	u32				nb_snapshots;
+	u64				incompatible_features;
+	u64				compatible_features;
+	u64				autoclear_features;
+	u32				refcount_order;
+	u32				header_length;
+	u8				compression_type;
 };
 
 struct qcow {
+	/* Serializes metadata updates and cache misses */
 	struct mutex			mutex;
+	/* Lets lookups of cached metadata go without the mutex */
+	seqcount_t			seq;
 	struct qcow_header		*header;
 	struct qcow_l1_table		table;
 	struct qcow_refcount_table	refcount_table;
@@ -82,12 +187,33 @@ struct qcow {
 	int				csize_shift;
 	int				csize_mask;
 	u32				version;
+	u32				l2_slice_size;	/* in entries */
+	/* Entries are followed by their subcluster bitmap */
+	bool				extended_l2;
+	u32				subcluster_bits;
 	u64				cluster_size;
 	u64				cluster_offset_mask;
 	u64				free_clust_idx;
-	void				*cluster_cache;
+	/*
+	 * A bit for each cluster in use, kept in step with the refcounts so
+	 * that allocations needn't look at them. Filled in a refcount block
+	 * at a time, as allocations get there: 'used_loaded' has a bit for
+	 * each block done.
+	 */
+	unsigned long			*used_map;
+	unsigned long			*used_loaded;
+	u64				used_clusters;	/* the map covers */
+	/* Still referenced on the disk, their refcounts drop once they aren't */
+	struct qcow_free_range		pending_frees[QCOW_PENDING_FREES_MAX];
+	u32				nr_pending_frees;
+	/* Refcounts are written back in any order, the image is marked dirty */
+	bool				lazy_refcounts;
 	void				*cluster_data;
 	void				*copy_buff;
+	void				*zero_cluster;
+	struct qcow_cluster_cache	ccache;
+	/* Where unallocated clusters are read from, NULL if they are zeroes */
+	struct disk_image		*backing;
 };
 
 struct qcow1_header_disk {
@@ -126,8 +252,22 @@ struct qcow2_header_disk {
 
 	u32				nb_snapshots;
 	u64				snapshots_offset;
+
+	/* Version 3 only */
+	u64				incompatible_features;
+	u64				compatible_features;
+	u64				autoclear_features;
+
+	u32				refcount_order;
+	u32				header_length;
+
+	/* Only there if header_length says so */
+	u8				compression_type;
+	u8				padding[7];
 };
 
-struct disk_image *qcow_probe(int fd, bool readonly);
+struct disk_image *qcow_probe(const char *filename, int fd, bool readonly,
+			      u64 l2_cache_size, u64 cluster_cache_size);
+struct disk_image *qcow_backing_probe(const char *filename, int fd);
 
 #endif /* KVM__QCOW_H */
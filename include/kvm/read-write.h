@@ -27,8 +27,12 @@ ssize_t writev_in_full(int fd, const struct iovec *iov, int iovcnt);
 
 ssize_t xpreadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
 ssize_t xpwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t xpwritev2(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+		  int flags);
 
 ssize_t preadv_in_full(int fd, const struct iovec *iov, int iovcnt, off_t offset);
 ssize_t pwritev_in_full(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t pwritev2_in_full(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+			 int flags);
 
 #endif /* KVM_READ_WRITE_H */
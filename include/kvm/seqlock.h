@@ -0,0 +1,54 @@
+#ifndef KVM__SEQLOCK_H
+#define KVM__SEQLOCK_H
+
+/*
+ * Kernel-alike sequence counter. Writers, serialized by a lock of their
+ * own, bracket their updates with write_seqcount_begin/end(). Readers take
+ * no lock: they redo whatever they read if an update overlapped, so they
+ * never write shared memory and scale with the number of threads.
+ *
+ * Anything a reader dereferences must stay mapped while it may be looking:
+ * the values read are only meaningful once read_seqcount_retry() is false.
+ */
+
+typedef struct {
+	unsigned int	sequence;
+} seqcount_t;
+
+#define SEQCNT_ZERO	{ .sequence = 0 }
+
+static inline void seqcount_init(seqcount_t *s)
+{
+	s->sequence = 0;
+}
+
+static inline unsigned int read_seqcount_begin(const seqcount_t *s)
+{
+	unsigned int seq;
+
+	/* Writers hold it odd for a few stores at most */
+	while ((seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1)
+		;
+
+	return seq;
+}
+
+static inline int read_seqcount_retry(const seqcount_t *s, unsigned int start)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != start;
+}
+
+static inline void write_seqcount_begin(seqcount_t *s)
+{
+	__atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqcount_end(seqcount_t *s)
+{
+	__atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* KVM__SEQLOCK_H */
@@ -44,6 +44,8 @@ extern void pr_warning(const char *err, ...) __attribute__((format (printf, 1, 2
 extern void pr_info(const char *err, ...) __attribute__((format (printf, 1, 2)));
 extern void set_die_routine(void (*routine)(const char *err, va_list params) NORETURN);
 
+bool buffer_is_zero(const void *buf, size_t len);
+
 #define pr_debug(fmt, ...)						\
 	do {								\
 		if (do_debug_print)					\
@@ -82,6 +84,18 @@ do {								\
 	__ret_warn_on;						\
 })
 
+/*
+ * Heap allocations made on behalf of guest I/O. The caches and scratch
+ * buffers on that path recycle what they allocate, so once they are warm
+ * this count must stop moving.
+ */
+extern unsigned long io_path_allocs;
+
+static inline void io_path_alloc_account(void)
+{
+	__sync_fetch_and_add(&io_path_allocs, 1);
+}
+
 #define MSECS_TO_USECS(s) ((s) * 1000)
 
 /* Millisecond sleep */
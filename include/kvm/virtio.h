@@ -128,6 +128,30 @@ static inline u16 virt_queue__pop(struct virt_queue *queue)
 	return virtio_guest_to_host_u16(queue, guest_idx);
 }
 
+/*
+ * Number of entries the guest has made available that we have not popped yet.
+ */
+static inline u16 virt_queue__pending(struct virt_queue *queue)
+{
+	return virtio_guest_to_host_u16(queue, queue->vring.avail->idx) -
+		queue->last_avail_idx;
+}
+
+/*
+ * Read the head 'ahead' entries past the next one to be popped, without
+ * consuming it. The caller checks virt_queue__pending() first.
+ */
+static inline u16 virt_queue__peek(struct virt_queue *queue, u16 ahead)
+{
+	__u16 guest_idx;
+
+	/* Pairs with the guest's write of the avail index, see virt_queue__pop() */
+	xen_rmb();
+
+	guest_idx = queue->vring.avail->ring[(u16)(queue->last_avail_idx + ahead) % queue->vring.num];
+	return virtio_guest_to_host_u16(queue, guest_idx);
+}
+
 static inline struct vring_desc *virt_queue__get_desc(struct virt_queue *queue, u16 desc_ndx)
 {
 	return &queue->vring.desc[desc_ndx];
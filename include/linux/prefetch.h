@@ -1,6 +1,14 @@
 #ifndef KVM__LINUX_PREFETCH_H
 #define KVM__LINUX_PREFETCH_H
 
-static inline void prefetch(void *a __attribute__((unused))) { }
+static inline void prefetch(const void *a)
+{
+	__builtin_prefetch(a, 0);
+}
+
+static inline void prefetchw(const void *a)
+{
+	__builtin_prefetch(a, 1);
+}
 
 #endif
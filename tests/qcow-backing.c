@@ -0,0 +1,186 @@
+/*
+ * Reads of a qcow2 overlay through iovecs whose segments aren't whole
+ * sectors, over clusters of its own and clusters from a raw backing file
+ * that doesn't end on a sector boundary.
+ */
+#include "kvm/disk-image.h"
+#include "kvm/qcow.h"
+#include "kvm/read-write.h"
+
+#include <linux/byteorder.h>
+#include <linux/err.h>
+#include <linux/kernel.h>
+
+#include <stdio.h>
+#include <string.h>
+
+bool do_debug_print = true;
+
+#define CLUSTER_BITS	16
+#define CLUSTER_SIZE	(1UL << CLUSTER_BITS)
+#define IMAGE_SIZE	(1UL << 20)
+#define BACKING_SIZE	(IMAGE_SIZE - 1000)
+#define BACKING_NAME_OFFSET	1024
+
+static const size_t seg_sizes[] = { 64, 100, 3, 509, 4096, 7, 1000, 64 };
+
+static int mk_backing(const char *path, u8 *mirror)
+{
+	int fd, r;
+	u64 i;
+
+	for (i = 0; i < BACKING_SIZE; i++)
+		mirror[i] = i * 7 + (i >> 9);
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -1;
+
+	r = pwrite_in_full(fd, mirror, BACKING_SIZE, 0) < 0 ? -1 : 0;
+	close(fd);
+
+	return r;
+}
+
+/* Header, refcount table, refcount block and L1 table, one cluster each */
+static int mk_overlay(const char *path, const char *backing)
+{
+	struct qcow2_header_disk h = {
+		.magic			= cpu_to_be32(QCOW_MAGIC),
+		.version		= cpu_to_be32(QCOW2_VERSION),
+		.backing_file_offset	= cpu_to_be64(BACKING_NAME_OFFSET),
+		.backing_file_size	= cpu_to_be32(strlen(backing)),
+		.cluster_bits		= cpu_to_be32(CLUSTER_BITS),
+		.size			= cpu_to_be64(IMAGE_SIZE),
+		.l1_size		= cpu_to_be32(1),
+		.l1_table_offset	= cpu_to_be64(3 * CLUSTER_SIZE),
+		.refcount_table_offset	= cpu_to_be64(CLUSTER_SIZE),
+		.refcount_table_clusters = cpu_to_be32(1),
+	};
+	u64 rft = cpu_to_be64(2 * CLUSTER_SIZE);
+	u16 rfb[4];
+	int fd, r = -1;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		rfb[i] = cpu_to_be16(1);
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, 4 * CLUSTER_SIZE) < 0 ||
+	    pwrite_in_full(fd, &h, offsetof(struct qcow2_header_disk,
+					    incompatible_features), 0) < 0 ||
+	    pwrite_in_full(fd, backing, strlen(backing),
+			   BACKING_NAME_OFFSET) < 0 ||
+	    pwrite_in_full(fd, &rft, sizeof(rft), CLUSTER_SIZE) < 0 ||
+	    pwrite_in_full(fd, rfb, sizeof(rfb), 2 * CLUSTER_SIZE) < 0)
+		goto out;
+
+	r = 0;
+out:
+	close(fd);
+	return r;
+}
+
+/* Read 'len' bytes at 'offset' through segments from 'seg' on */
+static int check_read(struct disk_image *disk, const u8 *mirror, u8 *buf,
+		      u64 offset, u64 len, int seg)
+{
+	struct iovec iov[512] = { };
+	u64 done = 0;
+	int nr = 0;
+	u64 i;
+
+	memset(buf, 0xaa, len);
+	while (done < len && nr < 512) {
+		iov[nr].iov_base = buf + done;
+		iov[nr].iov_len = min_t(u64, seg_sizes[seg++ % ARRAY_SIZE(seg_sizes)],
+					len - done);
+		done += iov[nr++].iov_len;
+	}
+	len = done;
+
+	if (disk->ops->read(disk, offset >> SECTOR_SHIFT, iov, nr, NULL) !=
+	    (ssize_t)len) {
+		fprintf(stderr, "read at %llu failed\n", (unsigned long long)offset);
+		return -1;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] != mirror[offset + i]) {
+			fprintf(stderr, "mismatch at %llu\n",
+				(unsigned long long)(offset + i));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/qcow-backing.XXXXXX";
+	char backing[64], overlay[64];
+	struct disk_image *disk;
+	u8 *mirror, *buf;
+	struct iovec iov;
+	u64 offset;
+	int fd, seg;
+	int r = 1;
+
+	if (!mkdtemp(dir))
+		return 1;
+
+	snprintf(backing, sizeof(backing), "%s/base.raw", dir);
+	snprintf(overlay, sizeof(overlay), "%s/top.qcow2", dir);
+
+	mirror = calloc(1, IMAGE_SIZE);
+	buf = malloc(IMAGE_SIZE);
+	if (!mirror || !buf || mk_backing(backing, mirror) < 0 ||
+	    mk_overlay(overlay, backing) < 0)
+		goto out;
+
+	fd = open(overlay, O_RDWR);
+	disk = qcow_probe(overlay, fd, false, 0, 0);
+	if (IS_ERR_OR_NULL(disk)) {
+		fprintf(stderr, "can't open %s\n", overlay);
+		goto out;
+	}
+
+	/* A cluster of our own, filled in around the write from the backing file */
+	memset(mirror + 3 * CLUSTER_SIZE + 4096, 0x5a, 8192);
+	iov = (struct iovec) {
+		.iov_base = mirror + 3 * CLUSTER_SIZE + 4096,
+		.iov_len = 8192,
+	};
+	if (disk->ops->write(disk, (3 * CLUSTER_SIZE + 4096) >> SECTOR_SHIFT,
+			     &iov, 1, NULL) != 8192)
+		goto close;
+
+	for (seg = 0; seg < (int)ARRAY_SIZE(seg_sizes); seg++) {
+		for (offset = 0; offset < IMAGE_SIZE; offset += 128 << 10)
+			if (check_read(disk, mirror, buf, offset,
+				       min_t(u64, 128 << 10, IMAGE_SIZE - offset),
+				       seg) < 0)
+				goto close;
+	}
+
+	/* The end of the backing file, and the zeroes after it */
+	offset = BACKING_SIZE & ~(SECTOR_SIZE - 1);
+	if (check_read(disk, mirror, buf, offset, IMAGE_SIZE - offset, 1) < 0)
+		goto close;
+
+	printf("ok\n");
+	r = 0;
+close:
+	disk->ops->close(disk);
+out:
+	unlink(overlay);
+	unlink(backing);
+	rmdir(dir);
+	free(mirror);
+	free(buf);
+	return r;
+}
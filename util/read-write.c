@@ -213,7 +213,7 @@ static inline ssize_t get_iov_size(const struct iovec *iov, int iovcnt)
 static inline void shift_iovec(const struct iovec **iov, int *iovcnt,
 				size_t nr, ssize_t *total, size_t *count, off_t *offset)
 {
-	while (nr >= (*iov)->iov_len) {
+	while (*iovcnt && nr >= (*iov)->iov_len) {
 		nr -= (*iov)->iov_len;
 		*total += (*iov)->iov_len;
 		*count -= (*iov)->iov_len;
@@ -316,7 +316,27 @@ ssize_t preadv_in_full(int fd, const struct iovec *iov, int iovcnt, off_t offset
 	return total;
 }
 
+/* Same as pwritev2(2) except that this function never returns EAGAIN or EINTR. */
+ssize_t xpwritev2(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+		  int flags)
+{
+	ssize_t nr;
+
+restart:
+	nr = pwritev2(fd, iov, iovcnt, offset, flags);
+	if ((nr < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+		goto restart;
+
+	return nr;
+}
+
 ssize_t pwritev_in_full(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return pwritev2_in_full(fd, iov, iovcnt, offset, 0);
+}
+
+ssize_t pwritev2_in_full(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+			 int flags)
 {
 	ssize_t total = 0;
 	size_t count = get_iov_size(iov, iovcnt);
@@ -324,7 +344,10 @@ ssize_t pwritev_in_full(int fd, const struct iovec *iov, int iovcnt, off_t offse
 	while (count > 0) {
 		ssize_t nr;
 
-		nr = xpwritev(fd, iov, iovcnt, offset);
+		if (flags)
+			nr = xpwritev2(fd, iov, iovcnt, offset, flags);
+		else
+			nr = xpwritev(fd, iov, iovcnt, offset);
 		if (nr < 0)
 			return -1;
 		if (nr == 0) {
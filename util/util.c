@@ -10,6 +10,8 @@
 #include <sys/stat.h>
 #include <sys/statfs.h>
 
+unsigned long io_path_allocs;
+
 static void report(const char *prefix, const char *err, va_list params)
 {
 	char msg[1024];
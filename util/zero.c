@@ -0,0 +1,130 @@
+#include "kvm/util.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define ZERO_HAVE_SSE2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define ZERO_HAVE_NEON
+#endif
+
+/*
+ * Zero detection for guest writes. The bulk of the buffer is scanned 64
+ * bytes at a time with vector ORs, the unaligned head and the tail byte by
+ * byte. Data that isn't zero almost always fails in the first few bytes,
+ * so those are looked at before anything else.
+ */
+
+#define ZERO_BLOCK	64
+
+static bool bytes_are_zero(const u8 *p, size_t len)
+{
+	while (len--)
+		if (*p++)
+			return false;
+
+	return true;
+}
+
+#if defined(ZERO_HAVE_SSE2)
+
+static bool blocks_are_zero_sse2(const void *buf, size_t len)
+{
+	const __m128i *p = buf;
+	const __m128i *end = buf + len;
+	__m128i zero = _mm_setzero_si128();
+	__m128i t;
+
+	for (; p < end; p += 4) {
+		t = _mm_or_si128(_mm_or_si128(p[0], p[1]),
+				 _mm_or_si128(p[2], p[3]));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xffff)
+			return false;
+	}
+
+	return true;
+}
+
+__attribute__((target("avx2")))
+static bool blocks_are_zero_avx2(const void *buf, size_t len)
+{
+	const __m256i *p = buf;
+	const __m256i *end = buf + len;
+	__m256i t;
+
+	for (; p < end; p += 2) {
+		t = _mm256_or_si256(_mm256_load_si256(p),
+				    _mm256_load_si256(p + 1));
+		if (!_mm256_testz_si256(t, t))
+			return false;
+	}
+
+	return true;
+}
+
+static bool (*blocks_are_zero)(const void *buf, size_t len);
+
+static void __attribute__((constructor)) buffer_is_zero_init(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		blocks_are_zero = blocks_are_zero_avx2;
+	else
+		blocks_are_zero = blocks_are_zero_sse2;
+}
+
+#elif defined(ZERO_HAVE_NEON)
+
+static bool blocks_are_zero(const void *buf, size_t len)
+{
+	const uint64_t *p = buf;
+	const uint64_t *end = buf + len;
+	uint64x2_t t;
+
+	for (; p < end; p += 8) {
+		t = vorrq_u64(vorrq_u64(vld1q_u64(p), vld1q_u64(p + 2)),
+			      vorrq_u64(vld1q_u64(p + 4), vld1q_u64(p + 6)));
+		if (vgetq_lane_u64(t, 0) | vgetq_lane_u64(t, 1))
+			return false;
+	}
+
+	return true;
+}
+
+#else
+
+static bool blocks_are_zero(const void *buf, size_t len)
+{
+	const u64 *p = buf;
+	const u64 *end = buf + len;
+
+	for (; p < end; p += 8)
+		if (p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7])
+			return false;
+
+	return true;
+}
+
+#endif
+
+bool buffer_is_zero(const void *buf, size_t len)
+{
+	const u8 *p = buf;
+	size_t head, bulk;
+
+	if (len < 2 * ZERO_BLOCK)
+		return bytes_are_zero(p, len);
+
+	/* Cheap early out, and the first block is aligned after it */
+	head = ZERO_BLOCK - ((uintptr_t)p & (ZERO_BLOCK - 1));
+	if (!bytes_are_zero(p, head))
+		return false;
+
+	p += head;
+	len -= head;
+	bulk = len & ~(size_t)(ZERO_BLOCK - 1);
+
+	return blocks_are_zero(p, bulk) && bytes_are_zero(p + bulk, len - bulk);
+}
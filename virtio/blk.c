@@ -12,6 +12,8 @@
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/types.h>
+#include <linux/prefetch.h>
+#include <limits.h>
 #include <pthread.h>
 
 #include "../demu.h"
@@ -29,12 +31,62 @@
 #define VIRTIO_BLK_QUEUE_SIZE		256
 #define NUM_VIRT_QUEUES			1
 
+/*
+ * How many avail entries ahead of the one being submitted get their
+ * descriptor and header pulled in.
+ */
+#define VIRTIO_BLK_PREFETCH_DEPTH	4
+
+/*
+ * Header + status + up to four data segments, which covers nearly every
+ * request a guest sends. Longer chains borrow a chunk from blk_iov_slab.
+ */
+#define BLK_REQ_INLINE_IOVS		6
+
+/*
+ * Sector-contiguous reads or writes popped in one pass are issued as a
+ * single vectored I/O of at most this many segments and bytes. The
+ * segment limit is that of the largest blk_iov_slab chunk, which holds
+ * the merged iovec.
+ */
+#define BLK_MERGE_MAX_IOVS		min(IOV_MAX, VIRTIO_BLK_QUEUE_SIZE)
+#define BLK_MERGE_MAX_BYTES		(512 * 1024)
+
+/* Ranges a DISCARD, WRITE_ZEROES or SECURE_ERASE request may carry */
+#define BLK_DISCARD_MAX_SEG		32
+
+struct blk_iov_chunk {
+	struct list_head		list;
+	int				class;
+	struct iovec			iov[];
+};
+
 struct blk_dev_req {
 	struct virt_queue		*vq;
 	struct blk_dev			*bdev;
-	struct iovec			iov[VIRTIO_BLK_QUEUE_SIZE];
+	struct iovec			*iov;
+	struct blk_iov_chunk		*chunk;
 	u16				out, in, head;
 	struct kvm			*kvm;
+	u32				type;
+	u64				sector;
+	u32				data_len;
+	/* Requests merged into this one's I/O, and the iovec it was issued with */
+	struct blk_dev_req		*merge_next;
+	struct blk_iov_chunk		*merge_chunk;
+	struct iovec			inline_iov[BLK_REQ_INLINE_IOVS];
+};
+
+/*
+ * Requests being collected into one I/O by virtio_blk_do_io()
+ */
+struct blk_merge {
+	struct blk_dev_req		*head;
+	struct blk_dev_req		*tail;
+	u64				next_sector;
+	u32				bytes;
+	u16				nr_iov;
+	u16				nr_reqs;
 };
 
 struct blk_dev {
@@ -46,10 +98,15 @@ struct blk_dev {
 	struct virtio_blk_config	blk_config;
 	struct disk_image		*disk;
 	u32				features;
+	/* Cache mode the disk was last set to, see virtio_blk_update_wce() */
+	u8				wce;
 
 	struct virt_queue		vqs[NUM_VIRT_QUEUES];
 	struct blk_dev_req		reqs[VIRTIO_BLK_QUEUE_SIZE];
 
+	/* Descriptor chains are gathered here before being sized */
+	struct iovec			iov_scratch[VIRTIO_BLK_QUEUE_SIZE];
+
 	pthread_t			io_thread;
 	int				io_efd;
 	int				io_done;
@@ -62,25 +119,116 @@ struct blk_dev {
 
 static LIST_HEAD(bdevs);
 
-void virtio_blk_complete(void *param, long len)
+/*
+ * Overflow iovec arrays for requests with long descriptor chains, shared
+ * by all disks and kept in a few size classes. Chunks are allocated on
+ * first use and recycled from then on.
+ */
+static const u16 blk_iov_chunk_sizes[] = { 16, 64, VIRTIO_BLK_QUEUE_SIZE };
+
+static struct list_head blk_iov_slab[] = {
+	LIST_HEAD_INIT(blk_iov_slab[0]),
+	LIST_HEAD_INIT(blk_iov_slab[1]),
+	LIST_HEAD_INIT(blk_iov_slab[2]),
+};
+static DEFINE_MUTEX(blk_iov_slab_lock);
+
+static struct blk_iov_chunk *blk_iov_chunk_get(u16 nr)
+{
+	struct blk_iov_chunk *chunk = NULL;
+	unsigned int class;
+
+	for (class = 0; class < ARRAY_SIZE(blk_iov_chunk_sizes); class++)
+		if (nr <= blk_iov_chunk_sizes[class])
+			break;
+
+	if (class == ARRAY_SIZE(blk_iov_chunk_sizes))
+		return NULL;
+
+	mutex_lock(&blk_iov_slab_lock);
+	if (!list_empty(&blk_iov_slab[class])) {
+		chunk = list_first_entry(&blk_iov_slab[class],
+					 struct blk_iov_chunk, list);
+		list_del(&chunk->list);
+	}
+	mutex_unlock(&blk_iov_slab_lock);
+
+	if (chunk)
+		return chunk;
+
+	chunk = malloc(sizeof(*chunk) +
+		       blk_iov_chunk_sizes[class] * sizeof(struct iovec));
+	if (!chunk)
+		return NULL;
+
+	io_path_alloc_account();
+	chunk->class = class;
+
+	return chunk;
+}
+
+static void blk_iov_chunk_put(struct blk_iov_chunk *chunk)
+{
+	mutex_lock(&blk_iov_slab_lock);
+	list_add(&chunk->list, &blk_iov_slab[chunk->class]);
+	mutex_unlock(&blk_iov_slab_lock);
+}
+
+static void blk_iov_slab_drain(void)
+{
+	struct blk_iov_chunk *chunk, *n;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(blk_iov_slab); i++) {
+		list_for_each_entry_safe(chunk, n, &blk_iov_slab[i], list) {
+			list_del(&chunk->list);
+			free(chunk);
+		}
+	}
+}
+
+/*
+ * Move the chain gathered in 'iov' into storage owned by the request:
+ * its inline array when it fits, an overflow chunk otherwise.
+ */
+static int virtio_blk_req_set_iov(struct blk_dev_req *req, struct iovec *iov)
+{
+	u16 nr = req->out + req->in;
+
+	req->chunk = NULL;
+	req->iov = req->inline_iov;
+
+	if (nr > BLK_REQ_INLINE_IOVS) {
+		req->chunk = blk_iov_chunk_get(nr);
+		if (!req->chunk)
+			return -ENOMEM;
+		req->iov = req->chunk->iov;
+	}
+
+	memcpy(req->iov, iov, nr * sizeof(*iov));
+
+	return 0;
+}
+
+/*
+ * Complete one request. The caller holds bdev->mutex and signals the guest.
+ */
+static void virtio_blk_finish(struct blk_dev_req *req, long len)
 {
-	struct blk_dev_req *req = param;
-	struct blk_dev *bdev = req->bdev;
-	int queueid = req->vq - bdev->vqs;
 	u8 *status;
 	int i;
 
 	/* status */
 	status	= req->iov[req->out + req->in - 1].iov_base;
-	*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
-
-	mutex_lock(&bdev->mutex);
-	virt_queue__set_used_elem(req->vq, req->head, len);
-	mutex_unlock(&bdev->mutex);
-
-	if (virtio_queue__should_signal(&bdev->vqs[queueid]))
-		bdev->vdev.ops->signal_vq(req->kvm, &bdev->vdev, queueid);
-
+	if (len == -EOPNOTSUPP)
+		*status = VIRTIO_BLK_S_UNSUPP;
+	else
+		*status = (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+
+	/*
+	 * Release everything the request holds before handing the head back,
+	 * the guest may reuse it (and the queue thread this slot) right after.
+	 */
 #ifdef USE_MAPCACHE
 	/* Unmap data descriptors */
 	for (i = 1; i < req->out + req->in - 1; i++)
@@ -90,27 +238,69 @@ void virtio_blk_complete(void *param, long len)
 	for (i = 0; i < req->out + req->in; i++)
 		demu_unmap_guest_range(req->iov[i].iov_base, req->iov[i].iov_len);
 #endif
+
+	if (req->chunk) {
+		blk_iov_chunk_put(req->chunk);
+		req->chunk = NULL;
+	}
+
+	virt_queue__set_used_elem(req->vq, req->head, len < 0 ? 0 : len);
 }
 
-static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, struct blk_dev_req *req)
+void virtio_blk_complete(void *param, long len)
+{
+	struct blk_dev_req *req = param;
+	struct blk_dev *bdev = req->bdev;
+	int queueid = req->vq - bdev->vqs;
+	struct blk_dev_req *next;
+	u64 done = 0;
+	bool signal;
+
+	if (req->merge_chunk) {
+		blk_iov_chunk_put(req->merge_chunk);
+		req->merge_chunk = NULL;
+	}
+
+	/* Completions may come from several disk worker threads at once */
+	mutex_lock(&bdev->mutex);
+	if (!req->merge_next) {
+		virtio_blk_finish(req, len);
+	} else {
+		/*
+		 * Fan a merged I/O out to its requests: each one succeeded if
+		 * the transfer got past its last byte.
+		 */
+		for (; req; req = next) {
+			next = req->merge_next;
+			req->merge_next = NULL;
+
+			done += req->data_len;
+			virtio_blk_finish(req, (len >= 0 && (u64)len >= done) ?
+					  (long)req->data_len : -1);
+		}
+	}
+	signal = virtio_queue__should_signal(&bdev->vqs[queueid]);
+	mutex_unlock(&bdev->mutex);
+
+	if (signal)
+		bdev->vdev.ops->signal_vq(bdev->kvm, &bdev->vdev, queueid);
+}
+
+/*
+ * Map the request's buffers and decode its header.
+ */
+static void virtio_blk_map_request(struct virt_queue *vq, struct blk_dev_req *req)
 {
 	struct virtio_blk_outhdr *req_hdr;
-	ssize_t block_cnt;
-	struct blk_dev *bdev;
 	struct iovec *iov;
-	u16 out, in;
-	u32 type;
-	u64 sector;
-#ifdef USE_MAPCACHE
 	u16 last;
 	int i;
+#ifdef USE_MAPCACHE
+	struct blk_dev *bdev = req->bdev;
 #endif
 
-	block_cnt	= -1;
-	bdev		= req->bdev;
 	iov		= req->iov;
-	out		= req->out;
-	in		= req->in;
+	last		= req->out + req->in - 1;
 
 #ifdef USE_MAPCACHE
 	/* Cache header descriptor  */
@@ -118,7 +308,6 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 			(u64)iov[0].iov_base, iov[0].iov_len);
 
 	/* Cache status descriptor */
-	last = out + in - 1;
 	iov[last].iov_base = mapcache_lookup(bdev->index,
 			(u64)iov[last].iov_base, iov[last].iov_len);
 
@@ -129,21 +318,103 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 
 	req_hdr		= iov[0].iov_base;
 
-	type = virtio_guest_to_host_u32(vq, req_hdr->type);
-	sector = virtio_guest_to_host_u64(vq, req_hdr->sector);
+	req->type	= virtio_guest_to_host_u32(vq, req_hdr->type);
+	req->sector	= virtio_guest_to_host_u64(vq, req_hdr->sector);
+
+	req->data_len	= 0;
+	for (i = 1; i < last; i++)
+		req->data_len += iov[i].iov_len;
+}
+
+/*
+ * DISCARD, WRITE_ZEROES and SECURE_ERASE carry an array of ranges in their
+ * driver-readable segments. They are handled one after the other, to
+ * completion. Returns 0 or a negative errno.
+ */
+static long virtio_blk_discard(struct blk_dev *bdev, struct blk_dev_req *req)
+{
+	struct virtio_blk_discard_write_zeroes *range;
+	struct disk_image *disk = bdev->disk;
+	u64 capacity = disk->size >> SECTOR_SHIFT;
+	u64 sector, nr;
+	u32 flags, max;
+	size_t j;
+	ssize_t r;
+	int i;
+
+	switch (req->type) {
+	case VIRTIO_BLK_T_DISCARD:
+		max = disk->limits.max_discard_sectors;
+		break;
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+		max = disk->limits.max_write_zeroes_sectors;
+		break;
+	default:
+		max = disk->limits.max_secure_erase_sectors;
+		break;
+	}
+
+	if (!max || disk->readonly)
+		return -EOPNOTSUPP;
+
+	for (i = 1; i < req->out; i++) {
+		if (req->iov[i].iov_len % sizeof(*range))
+			return -EINVAL;
+
+		range = req->iov[i].iov_base;
+		for (j = 0; j < req->iov[i].iov_len / sizeof(*range); j++, range++) {
+			sector	= virtio_guest_to_host_u64(req->vq, range->sector);
+			nr	= virtio_guest_to_host_u32(req->vq, range->num_sectors);
+			flags	= virtio_guest_to_host_u32(req->vq, range->flags);
+
+			/* Only WRITE_ZEROES has a flag, and just the one */
+			if (flags & ~VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP ||
+			    (flags && req->type != VIRTIO_BLK_T_WRITE_ZEROES))
+				return -EOPNOTSUPP;
+
+			if (nr > max || sector > capacity || nr > capacity - sector)
+				return -EINVAL;
+
+			if (req->type == VIRTIO_BLK_T_WRITE_ZEROES)
+				r = disk_image__write_zeroes(disk, sector,
+						nr << SECTOR_SHIFT,
+						flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+			else
+				r = disk_image__discard(disk, sector,
+						nr << SECTOR_SHIFT,
+						req->type == VIRTIO_BLK_T_SECURE_ERASE);
+			if (r < 0)
+				return r;
+		}
+	}
+
+	return 0;
+}
+
+static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, struct blk_dev_req *req)
+{
+	ssize_t block_cnt;
+	struct blk_dev *bdev;
+	struct iovec *iov;
+	u16 out, in;
+
+	block_cnt	= -1;
+	bdev		= req->bdev;
+	iov		= req->iov;
+	out		= req->out;
+	in		= req->in;
 
-	switch (type) {
+	switch (req->type) {
 	case VIRTIO_BLK_T_IN:
-		block_cnt = disk_image__read(bdev->disk, sector,
+		block_cnt = disk_image__read(bdev->disk, req->sector,
 				iov + 1, in + out - 2, req);
 		break;
 	case VIRTIO_BLK_T_OUT:
-		block_cnt = disk_image__write(bdev->disk, sector,
+		block_cnt = disk_image__write(bdev->disk, req->sector,
 				iov + 1, in + out - 2, req);
 		break;
 	case VIRTIO_BLK_T_FLUSH:
-		block_cnt = disk_image__flush(bdev->disk);
-		virtio_blk_complete(req, block_cnt);
+		block_cnt = disk_image__flush_async(bdev->disk, req);
 		break;
 	case VIRTIO_BLK_T_GET_ID:
 		block_cnt = VIRTIO_BLK_ID_BYTES;
@@ -151,27 +422,215 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 				(iov + 1)->iov_base, &block_cnt);
 		virtio_blk_complete(req, block_cnt);
 		break;
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+	case VIRTIO_BLK_T_SECURE_ERASE:
+		block_cnt = virtio_blk_discard(bdev, req);
+		virtio_blk_complete(req, block_cnt);
+		break;
 	default:
-		pr_warning("request type %d", type);
-		block_cnt	= -1;
+		pr_warning("request type %d", req->type);
+		block_cnt	= -EOPNOTSUPP;
+		virtio_blk_complete(req, block_cnt);
 		break;
 	}
 }
 
+/*
+ * Issue what has been collected: a lone request goes out as it is, several
+ * as one I/O over their concatenated data segments whose completion
+ * virtio_blk_complete() fans out.
+ */
+static void virtio_blk_merge_submit(struct kvm *kvm, struct virt_queue *vq,
+				    struct blk_merge *merge)
+{
+	struct blk_dev_req *head = merge->head;
+	struct blk_dev_req *req, *next;
+	struct blk_iov_chunk *chunk;
+	struct iovec *iov;
+	u16 nr;
+
+	if (!head)
+		return;
+
+	merge->head = merge->tail = NULL;
+
+	if (merge->nr_reqs == 1) {
+		virtio_blk_do_io_request(kvm, vq, head);
+		return;
+	}
+
+	chunk = blk_iov_chunk_get(merge->nr_iov);
+	if (!chunk) {
+		/* Fall back to issuing them one by one */
+		for (req = head; req; req = next) {
+			next = req->merge_next;
+			req->merge_next = NULL;
+			virtio_blk_do_io_request(kvm, vq, req);
+		}
+		return;
+	}
+
+	iov = chunk->iov;
+	for (req = head; req; req = req->merge_next) {
+		nr = req->out + req->in - 2;
+		memcpy(iov, req->iov + 1, nr * sizeof(*iov));
+		iov += nr;
+	}
+
+	head->merge_chunk = chunk;
+
+	if (head->type == VIRTIO_BLK_T_IN)
+		disk_image__read(head->bdev->disk, head->sector, chunk->iov,
+				 merge->nr_iov, head);
+	else
+		disk_image__write(head->bdev->disk, head->sector, chunk->iov,
+				  merge->nr_iov, head);
+}
+
+/*
+ * Add a decoded request to the pending merge, submitting that first if the
+ * request doesn't extend it. Requests other than reads and writes go out
+ * right away, after whatever was pending so that FLUSH stays ordered.
+ */
+static void virtio_blk_merge_add(struct kvm *kvm, struct virt_queue *vq,
+				 struct blk_merge *merge, struct blk_dev_req *req)
+{
+	u16 nr = req->out + req->in - 2;
+
+	req->merge_next = NULL;
+
+	if (req->type != VIRTIO_BLK_T_IN && req->type != VIRTIO_BLK_T_OUT) {
+		virtio_blk_merge_submit(kvm, vq, merge);
+		virtio_blk_do_io_request(kvm, vq, req);
+		return;
+	}
+
+	if (merge->head &&
+	    merge->head->type == req->type &&
+	    merge->next_sector == req->sector &&
+	    !(merge->bytes & (SECTOR_SIZE - 1)) &&
+	    merge->nr_iov + nr <= BLK_MERGE_MAX_IOVS &&
+	    merge->bytes + req->data_len <= BLK_MERGE_MAX_BYTES) {
+		merge->tail->merge_next = req;
+		merge->tail = req;
+		merge->nr_iov += nr;
+		merge->nr_reqs++;
+		merge->bytes += req->data_len;
+		merge->next_sector += req->data_len >> SECTOR_SHIFT;
+		return;
+	}
+
+	virtio_blk_merge_submit(kvm, vq, merge);
+
+	*merge = (struct blk_merge) {
+		.head		= req,
+		.tail		= req,
+		.next_sector	= req->sector + (req->data_len >> SECTOR_SHIFT),
+		.bytes		= req->data_len,
+		.nr_iov		= nr,
+		.nr_reqs	= 1,
+	};
+}
+
+/*
+ * Touch the request that sits 'ahead' entries past the next one to be
+ * popped: its descriptor, its slot in bdev->reqs and, with the mapcache,
+ * its header page. By the time the loop reaches it the loads have landed
+ * and the mapping exists, instead of missing one after another.
+ */
+static void virtio_blk_prefetch(struct virt_queue *vq, struct blk_dev *bdev,
+				u16 ahead)
+{
+	struct vring_desc *desc;
+	u16 head;
+#ifdef USE_MAPCACHE
+	void *hdr;
+#endif
+
+	if (ahead >= virt_queue__pending(vq))
+		return;
+
+	head = virt_queue__peek(vq, ahead);
+	if (head >= vq->vring.num)
+		return;
+
+	desc = virt_queue__get_desc(vq, head);
+	prefetch(desc);
+	prefetchw(&bdev->reqs[head]);
+
+#ifdef USE_MAPCACHE
+	/* The header of an indirect chain lives in a table we'd have to map */
+	if (virtio_guest_to_host_u16(vq, desc->flags) & VRING_DESC_F_INDIRECT)
+		return;
+
+	hdr = mapcache_lookup(bdev->index,
+			virtio_guest_to_host_u64(vq, desc->addr),
+			sizeof(struct virtio_blk_outhdr));
+	if (hdr)
+		prefetch(hdr);
+#endif
+}
+
+/*
+ * The guest flips the cache mode by writing the config field directly,
+ * pick it up before handling the requests that follow.
+ */
+static void virtio_blk_update_wce(struct blk_dev *bdev)
+{
+	u8 wce = bdev->blk_config.wce;
+
+	if (wce == bdev->wce)
+		return;
+
+	bdev->wce = wce;
+	disk_image__set_writethrough(bdev->disk, !wce);
+}
+
 static void virtio_blk_do_io(struct kvm *kvm, struct virt_queue *vq, struct blk_dev *bdev)
 {
+	struct blk_merge merge = { 0 };
 	struct blk_dev_req *req;
 	u16 head;
+	u16 i;
+
+	if (!virt_queue__available(vq))
+		return;
+
+	virtio_blk_update_wce(bdev);
+
+	for (i = 1; i < VIRTIO_BLK_PREFETCH_DEPTH; i++)
+		virtio_blk_prefetch(vq, bdev, i);
 
 	while (virt_queue__available(vq) && !bdev->io_done) {
+		/* Slide the window: the entry entering it is the last one */
+		virtio_blk_prefetch(vq, bdev, VIRTIO_BLK_PREFETCH_DEPTH);
+
 		head		= virt_queue__pop(vq);
 		req		= &bdev->reqs[head];
-		req->head	= virt_queue__get_head_iov(vq, req->iov, &req->out,
-					&req->in, head, kvm);
+		req->head	= virt_queue__get_head_iov(vq, bdev->iov_scratch,
+					&req->out, &req->in, head, kvm);
 		req->vq		= vq;
 
-		virtio_blk_do_io_request(kvm, vq, req);
+		if (virtio_blk_req_set_iov(req, bdev->iov_scratch) < 0) {
+			/*
+			 * No overflow chunk: serve it straight from the scratch
+			 * array and let it drain before the array is reused.
+			 */
+			virtio_blk_merge_submit(kvm, vq, &merge);
+			req->iov = bdev->iov_scratch;
+			req->merge_next = NULL;
+			virtio_blk_map_request(vq, req);
+			virtio_blk_do_io_request(kvm, vq, req);
+			disk_image__wait(bdev->disk);
+			continue;
+		}
+
+		virtio_blk_map_request(vq, req);
+		virtio_blk_merge_add(kvm, vq, &merge, req);
 	}
+
+	virtio_blk_merge_submit(kvm, vq, &merge);
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -184,11 +643,19 @@ static u8 *get_config(struct kvm *kvm, void *dev)
 static u32 get_host_features(struct kvm *kvm, void *dev)
 {
 	struct blk_dev *bdev = dev;
+	struct disk_limits *lim = &bdev->disk->limits;
 
 	return	1UL << VIRTIO_BLK_F_SEG_MAX
 		| 1UL << VIRTIO_BLK_F_FLUSH
+		| 1UL << VIRTIO_BLK_F_CONFIG_WCE
 		| 1UL << VIRTIO_RING_F_EVENT_IDX
 		| 1UL << VIRTIO_RING_F_INDIRECT_DESC
+		| (bdev->blk_config.blk_size ? 1UL << VIRTIO_BLK_F_BLK_SIZE : 0)
+		| (lim->physical_block_size || lim->io_min || lim->io_opt ?
+		   1UL << VIRTIO_BLK_F_TOPOLOGY : 0)
+		| (lim->max_discard_sectors ? 1UL << VIRTIO_BLK_F_DISCARD : 0)
+		| (lim->max_write_zeroes_sectors ? 1UL << VIRTIO_BLK_F_WRITE_ZEROES : 0)
+		| (lim->max_secure_erase_sectors ? 1UL << VIRTIO_BLK_F_SECURE_ERASE : 0)
 		| (bdev->disk->readonly ? 1UL << VIRTIO_BLK_F_RO : 0);
 }
 
@@ -210,6 +677,28 @@ static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
 	conf->blk_size = virtio_host_to_guest_u32(&bdev->vdev, conf->blk_size);
 	conf->min_io_size = virtio_host_to_guest_u16(&bdev->vdev, conf->min_io_size);
 	conf->opt_io_size = virtio_host_to_guest_u32(&bdev->vdev, conf->opt_io_size);
+
+	conf->max_discard_sectors = virtio_host_to_guest_u32(&bdev->vdev,
+						conf->max_discard_sectors);
+	conf->max_discard_seg = virtio_host_to_guest_u32(&bdev->vdev,
+						conf->max_discard_seg);
+	conf->discard_sector_alignment = virtio_host_to_guest_u32(&bdev->vdev,
+						conf->discard_sector_alignment);
+	conf->max_write_zeroes_sectors = virtio_host_to_guest_u32(&bdev->vdev,
+						conf->max_write_zeroes_sectors);
+	conf->max_write_zeroes_seg = virtio_host_to_guest_u32(&bdev->vdev,
+						conf->max_write_zeroes_seg);
+	conf->max_secure_erase_sectors = virtio_host_to_guest_u32(&bdev->vdev,
+						conf->max_secure_erase_sectors);
+	conf->max_secure_erase_seg = virtio_host_to_guest_u32(&bdev->vdev,
+						conf->max_secure_erase_seg);
+	conf->secure_erase_sector_alignment = virtio_host_to_guest_u32(&bdev->vdev,
+						conf->secure_erase_sector_alignment);
+
+	/* A driver that can't send FLUSH relies on every write being durable */
+	if (!(features & (1UL << VIRTIO_BLK_F_FLUSH)))
+		conf->wce = 0;
+	virtio_blk_update_wce(bdev);
 }
 
 static void notify_status(struct kvm *kvm, void *dev, u32 status)
@@ -358,6 +847,34 @@ static struct virtio_ops blk_dev_virtio_ops = {
 	.set_size_vq		= set_size_vq,
 };
 
+/*
+ * Describe the backing store's geometry and discard support, see
+ * struct disk_limits.
+ */
+static void virtio_blk_init_limits(struct virtio_blk_config *conf,
+				   struct disk_image *disk)
+{
+	struct disk_limits *lim = &disk->limits;
+	u32 lbs = conf->blk_size ? conf->blk_size : SECTOR_SIZE;
+
+	if (lim->physical_block_size > lbs)
+		conf->physical_block_exp = __builtin_ctz(lim->physical_block_size / lbs);
+	conf->min_io_size = min_t(u32, lim->io_min / lbs, USHRT_MAX);
+	conf->opt_io_size = lim->io_opt / lbs;
+
+	conf->max_discard_sectors = lim->max_discard_sectors;
+	conf->max_discard_seg = BLK_DISCARD_MAX_SEG;
+	conf->discard_sector_alignment = lim->discard_alignment;
+
+	conf->max_write_zeroes_sectors = lim->max_write_zeroes_sectors;
+	conf->max_write_zeroes_seg = BLK_DISCARD_MAX_SEG;
+	conf->write_zeroes_may_unmap = !!lim->max_discard_sectors;
+
+	conf->max_secure_erase_sectors = lim->max_secure_erase_sectors;
+	conf->max_secure_erase_seg = BLK_DISCARD_MAX_SEG;
+	conf->secure_erase_sector_alignment = lim->discard_alignment;
+}
+
 static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk, int index)
 {
 	struct blk_dev *bdev;
@@ -375,11 +892,17 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk, int in
 		.blk_config		= (struct virtio_blk_config) {
 			.capacity	= disk->size / SECTOR_SIZE,
 			.seg_max	= DISK_SEG_MAX,
+			/* The same whatever the cache mode */
+			.blk_size	= disk->limits.logical_block_size,
+			.wce		= !disk->writethrough,
 		},
+		.wce			= !disk->writethrough,
 		.kvm			= kvm,
 		.index			= index,
 	};
 
+	virtio_blk_init_limits(&bdev->blk_config, disk);
+
 	list_add_tail(&bdev->list, &bdevs);
 
 	r = virtio_init(kvm, bdev, &bdev->vdev, &blk_dev_virtio_ops,
@@ -430,6 +953,8 @@ int virtio_blk__exit(struct kvm *kvm)
 		virtio_blk__exit_one(kvm, bdev);
 	}
 
+	blk_iov_slab_drain();
+
 	return 0;
 }
 virtio_dev_exit(virtio_blk__exit);
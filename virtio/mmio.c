@@ -121,7 +121,7 @@ static void virtio_mmio_device_specific(
 	for (i = 0; i < len; i++) {
 		if (is_write)
 			vdev->ops->get_config(vmmio->kvm, vmmio->dev)[addr + i] =
-					      *(u8 *)data + i;
+					      data[i];
 		else
 			data[i] = vdev->ops->get_config(vmmio->kvm,
 							vmmio->dev)[addr + i];